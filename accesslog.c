@@ -0,0 +1,424 @@
+#include "accesslog.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/util.h>
+
+#define LOG_BATCH 64
+#define LOG_LINE 1024
+
+typedef struct {
+    int64_t time_us;
+    int64_t dur_us;
+    int64_t bytes;
+    int status;
+    uint16_t port;
+    char method[8];
+    char peer[48];
+    char uri[256];
+    char referer[128];
+    char agent[160];
+} log_rec;
+
+// bounded mpmc queue with a sequence number per slot, used with one consumer
+typedef struct {
+    size_t seq;
+    log_rec rec;
+} log_slot;
+
+typedef struct {
+    access_log_config config;
+    char *path;
+    int fd;
+    uint64_t size;
+    log_slot *slots;
+    size_t mask;
+    size_t head;
+    size_t tail;
+    int stop;
+    pthread_t thread;
+    char (*lines)[LOG_LINE];
+    access_log_stats stats;
+} access_log;
+
+static util_shared current = UTIL_SHARED_INIT;
+
+static const char *log_methods[] = {
+    "GET",     "POST",  "HEAD",    "PUT",   "DELETE",
+    "OPTIONS", "TRACE", "CONNECT", "PATCH",
+};
+
+static int log_file_open(access_log *l) {
+#ifdef _WIN32
+    l->fd = _open(l->path, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY,
+                  0644);
+    if (l->fd < 0)
+        return -1;
+    l->size = (uint64_t)_lseeki64(l->fd, 0, SEEK_END);
+#else
+    struct stat st;
+    l->fd = open(l->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (l->fd < 0)
+        return -1;
+    l->size = fstat(l->fd, &st) ? 0 : (uint64_t)st.st_size;
+#endif
+    return 0;
+}
+
+// path -> path.1 -> ... -> path.keep
+static void log_rotate(access_log *l) {
+    size_t len = strlen(l->path) + 16;
+    char *from = malloc(len), *to = malloc(len);
+    if (from && to) {
+#ifdef _WIN32
+        _close(l->fd);
+#else
+        close(l->fd);
+#endif
+        for (int i = l->config.keep; i > 0; --i) {
+            if (i > 1)
+                snprintf(from, len, "%s.%d", l->path, i - 1);
+            else
+                snprintf(from, len, "%s", l->path);
+            snprintf(to, len, "%s.%d", l->path, i);
+            remove(to);
+            rename(from, to);
+        }
+        if (l->config.keep <= 0)
+            remove(l->path);
+        if (log_file_open(l) < 0)
+            l->fd = -1;
+        l->stats.rotations++;
+    }
+    free(from);
+    free(to);
+}
+
+static int log_format(const access_log *l, const log_rec *r, char *line) {
+    char date[64], bytes[24];
+    time_t sec = (time_t)(r->time_us / 1000000);
+    struct tm tm;
+    int n;
+
+    if (r->bytes >= 0)
+        snprintf(bytes, sizeof(bytes), "%lld", (long long)r->bytes);
+    else
+        strcpy(bytes, "-");
+
+    if (l->config.format == ACCESS_LOG_JSON) {
+#ifdef _WIN32
+        gmtime_s(&tm, &sec);
+#else
+        gmtime_r(&sec, &tm);
+#endif
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+        // the strings were escaped when the record was taken
+        n = snprintf(line, LOG_LINE,
+                     "{\"time\":\"%s.%03dZ\",\"peer\":\"%s\",\"method\":\"%s\","
+                     "\"uri\":\"%s\",\"status\":%d,\"bytes\":%s,"
+                     "\"durUs\":%lld,\"referer\":\"%s\",\"agent\":\"%s\"}\n",
+                     date, (int)(r->time_us / 1000 % 1000), r->peer, r->method,
+                     r->uri, r->status, r->bytes >= 0 ? bytes : "null",
+                     (long long)r->dur_us, r->referer, r->agent);
+    } else {
+#ifdef _WIN32
+        localtime_s(&tm, &sec);
+#else
+        localtime_r(&sec, &tm);
+#endif
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        // the last byte before the NUL is kept for the newline
+        n = snprintf(line, LOG_LINE - 1, "%s - - [%s] \"%s %s HTTP/1.1\" %d %s",
+                     r->peer, date, r->method, r->uri, r->status, bytes);
+        if (n < LOG_LINE - 2 && l->config.format == ACCESS_LOG_COMBINED)
+            n += snprintf(line + n, LOG_LINE - 1 - n, " \"%s\" \"%s\"",
+                          r->referer[0] ? r->referer : "-",
+                          r->agent[0] ? r->agent : "-");
+        if (n > LOG_LINE - 2)
+            n = LOG_LINE - 2;
+        line[n++] = '\n';
+        line[n] = '\0';
+    }
+    if (n >= LOG_LINE) {
+        n = LOG_LINE - 1;
+        line[n - 1] = '\n';
+    }
+    return n;
+}
+
+static void log_write(access_log *l, char (*lines)[LOG_LINE], int *lens,
+                      int count) {
+    uint64_t total = 0, size = 0;
+    int written = 0;
+    for (int i = 0; i < count; ++i)
+        total += lens[i];
+    if (l->config.max_bytes && l->size && l->size + total > l->config.max_bytes)
+        log_rotate(l);
+    if (l->fd < 0) {
+        l->stats.write_errors += count;
+        return;
+    }
+#ifdef _WIN32
+    for (int i = 0; i < count; ++i) {
+        int n = _write(l->fd, lines[i], lens[i]);
+        if (n > 0)
+            size += n;
+        if (n == lens[i])
+            written++;
+        else
+            l->stats.write_errors++;
+    }
+#else
+    struct iovec iov[LOG_BATCH], *v = iov;
+    ssize_t n;
+    int left = count;
+    for (int i = 0; i < count; ++i) {
+        iov[i].iov_base = lines[i];
+        iov[i].iov_len = (size_t)lens[i];
+    }
+    // one syscall for the whole batch, more if the kernel takes less
+    while (left) {
+        n = writev(l->fd, v, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // a line cut short counts as an error, its bytes are on disk
+            l->stats.write_errors += left;
+            break;
+        }
+        size += (uint64_t)n;
+        for (; left && (size_t)n >= v->iov_len; v++, left--, written++)
+            n -= (ssize_t)v->iov_len;
+        if (left) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= (size_t)n;
+        }
+    }
+#endif
+    // only what reached the file, rotation goes by it
+    l->size += size;
+    __atomic_add_fetch(&l->stats.written, written, __ATOMIC_RELAXED);
+}
+
+// returns the number of records written
+static int log_drain(access_log *l) {
+    char(*lines)[LOG_LINE] = l->lines;
+    int lens[LOG_BATCH], count = 0, total = 0;
+    log_slot *s;
+
+    for (;;) {
+        s = &l->slots[l->tail & l->mask];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != l->tail + 1)
+            break;
+        lens[count] = log_format(l, &s->rec, lines[count]);
+        count++;
+        // hands the slot back to the producers
+        __atomic_store_n(&s->seq, l->tail + l->mask + 1, __ATOMIC_RELEASE);
+        l->tail++;
+        if (count == LOG_BATCH) {
+            log_write(l, lines, lens, count);
+            total += count;
+            count = 0;
+        }
+    }
+    if (count) {
+        log_write(l, lines, lens, count);
+        total += count;
+    }
+    return total;
+}
+
+static void *log_main(void *arg) {
+    access_log *l = arg;
+    while (!__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE)) {
+        // a full batch is worth writing right away
+        if (log_drain(l) < LOG_BATCH)
+            util_sleep_us((int64_t)l->config.flush_ms * 1000);
+    }
+    log_drain(l);
+    return NULL;
+}
+
+static void log_free(access_log *l) {
+    if (l->fd >= 0)
+#ifdef _WIN32
+        _close(l->fd);
+#else
+        close(l->fd);
+#endif
+    free(l->slots);
+    free(l->lines);
+    free(l->path);
+    free(l);
+}
+
+// flushes and frees a logger no reply uses any more
+static void log_stop(access_log *l) {
+    if (!l)
+        return;
+    __atomic_store_n(&l->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(l->thread, NULL);
+    log_free(l);
+}
+
+int access_log_open(const access_log_config *config) {
+    access_log *l = calloc(1, sizeof(*l));
+    size_t cap = 1;
+
+    if (!l)
+        return -1;
+    l->config = *config;
+    if (l->config.flush_ms <= 0)
+        l->config.flush_ms = 100;
+    while (cap < (config->ring ? config->ring : 8192))
+        cap <<= 1;
+    l->mask = cap - 1;
+    l->path = strdup(config->path);
+    l->slots = calloc(cap, sizeof(log_slot));
+    l->lines = malloc(LOG_BATCH * LOG_LINE);
+    l->fd = -1;
+    if (!l->path || !l->slots || !l->lines || log_file_open(l) < 0) {
+        log_free(l);
+        return -1;
+    }
+    l->config.path = l->path;
+    for (size_t i = 0; i < cap; ++i)
+        l->slots[i].seq = i;
+    if (pthread_create(&l->thread, NULL, log_main, l)) {
+        log_free(l);
+        errno = EAGAIN;
+        return -1;
+    }
+    log_stop(util_shared_swap(&current, l));
+    return 0;
+}
+
+void access_log_close(void) { log_stop(util_shared_swap(&current, NULL)); }
+
+int access_log_enabled(void) { return util_shared_enabled(&current); }
+
+// copies s into dst, escaping what would break a quoted field
+static void log_copy(char *dst, size_t size, const char *s) {
+    size_t n = 0;
+    if (!s) {
+        dst[0] = '\0';
+        return;
+    }
+    for (; *s && n + 7 < size; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = (char)c;
+        } else if (c < 0x20 || c == 0x7f) {
+            n += snprintf(dst + n, size - n, "\\u%04x", c);
+        } else {
+            dst[n++] = (char)c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+static void log_push(access_log *l, struct evhttp_request *req, void *arg);
+
+static void log_done(struct evhttp_request *req, void *arg) {
+    access_log *l = util_shared_enter(&current);
+    if (l)
+        log_push(l, req, arg);
+    util_shared_leave(&current);
+}
+
+static void log_push(access_log *l, struct evhttp_request *req, void *arg) {
+    struct evhttp_connection *evcon;
+    struct evkeyvalq *in, *out;
+    struct timeval tv;
+    const char *len, *peer = NULL;
+    enum evhttp_cmd_type cmd;
+    ev_uint16_t port = 0;
+    log_slot *s;
+    log_rec *r;
+    size_t pos, seq;
+
+    pos = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &l->slots[pos & l->mask];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&l->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if ((intptr_t)(seq - pos) < 0) {
+            // the writer is behind, never block the reply path
+            __atomic_add_fetch(&l->stats.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    r = &s->rec;
+    evutil_gettimeofday(&tv, NULL);
+    r->time_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    // the start time travels in the callback argument, the difference is
+    // right even when uintptr_t is narrower than the clock
+    r->dur_us = (int64_t)(uintptr_t)((uintptr_t)util_now_us() - (uintptr_t)arg);
+    r->status = evhttp_request_get_response_code(req);
+    cmd = evhttp_request_get_command(req);
+    strcpy(r->method, "-");
+    for (size_t i = 0; i < sizeof(log_methods) / sizeof(log_methods[0]); ++i) {
+        if (cmd & (1 << i)) {
+            strcpy(r->method, log_methods[i]);
+            break;
+        }
+    }
+    log_copy(r->uri, sizeof(r->uri), evhttp_request_get_uri(req));
+    out = evhttp_request_get_output_headers(req);
+    len = evhttp_find_header(out, "Content-Length");
+    r->bytes = len ? strtoll(len, NULL, 10) : -1;
+    in = evhttp_request_get_input_headers(req);
+    log_copy(r->referer, sizeof(r->referer), evhttp_find_header(in, "Referer"));
+    log_copy(r->agent, sizeof(r->agent), evhttp_find_header(in, "User-Agent"));
+    evcon = evhttp_request_get_connection(req);
+    if (evcon)
+        evhttp_connection_get_peer(evcon, (char **)&peer, &port);
+    log_copy(r->peer, sizeof(r->peer), peer ? peer : "-");
+    r->port = port;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void access_log_begin(struct evhttp_request *req) {
+    if (!access_log_enabled())
+        return;
+    evhttp_request_set_on_complete_cb(req, log_done,
+                                      (void *)(uintptr_t)util_now_us());
+}
+
+void access_log_get_stats(access_log_stats *stats) {
+    access_log *l;
+    memset(stats, 0, sizeof(*stats));
+    l = util_shared_lock(&current);
+    if (l) {
+        stats->written = __atomic_load_n(&l->stats.written, __ATOMIC_RELAXED);
+        stats->dropped = __atomic_load_n(&l->stats.dropped, __ATOMIC_RELAXED);
+        stats->rotations = l->stats.rotations;
+        stats->write_errors = l->stats.write_errors;
+    }
+    util_shared_unlock(&current);
+}
@@ -0,0 +1,43 @@
+#ifndef LANYT_ACCESSLOG_H
+#define LANYT_ACCESSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    ACCESS_LOG_COMMON,
+    ACCESS_LOG_COMBINED,
+    ACCESS_LOG_JSON,
+};
+
+typedef struct {
+    const char *path;
+    int format;
+    // rotate when the file would grow past this, 0 never
+    uint64_t max_bytes;
+    // rotated files kept as path.1 .. path.keep
+    int keep;
+    // records buffered between the reply path and the writer
+    size_t ring;
+    int flush_ms;
+} access_log_config;
+
+typedef struct {
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t rotations;
+    uint64_t write_errors;
+} access_log_stats;
+
+struct evhttp_request;
+
+// process wide, replaces the running logger. returns -1 with errno
+int access_log_open(const access_log_config *config);
+// flushes what is buffered and stops the writer
+void access_log_close(void);
+int access_log_enabled(void);
+// call when the request arrives, the record is made once the reply is done
+void access_log_begin(struct evhttp_request *req);
+void access_log_get_stats(access_log_stats *stats);
+
+#endif // LANYT_ACCESSLOG_H
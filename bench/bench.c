@@ -0,0 +1,160 @@
+// keep-alive load generator for comparing the server backends, one
+// connection per thread:
+//
+//   bench [-c conns] [-d seconds] [-P path] [-p pid] host port
+//
+// with -p the server's syscalls are counted by perf over the same window
+#include "../util.h"
+#include "client.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+    pthread_t thread;
+    util_hist lat;
+    uint64_t requests;
+    uint64_t errors;
+} bench_worker;
+
+static struct addrinfo *addr;
+static char request[512];
+static size_t request_len;
+static int64_t deadline;
+
+static void *bench_main(void *arg) {
+    bench_worker *w = arg;
+    char buf[65536];
+    int64_t t;
+    int fd = -1, ret;
+
+    while ((t = util_now_us()) < deadline) {
+        if (fd < 0 && (fd = client_connect(addr)) < 0) {
+            w->errors++;
+            util_sleep_us(10000);
+            continue;
+        }
+        if (write(fd, request, request_len) != (ssize_t)request_len ||
+            (ret = client_response(fd, buf, sizeof(buf), 0, NULL)) < 0) {
+            w->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        util_hist_add(&w->lat, util_now_us() - t);
+        w->requests++;
+        if (ret) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+// counts raw_syscalls:sys_enter of pid for the length of the run
+static FILE *perf_start(int pid, int seconds) {
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd),
+             "perf stat -x, -e raw_syscalls:sys_enter -p %d -- sleep %d 2>&1",
+             pid, seconds);
+    return popen(cmd, "r");
+}
+
+static int64_t perf_finish(FILE *f) {
+    char line[256];
+    int64_t count = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, "raw_syscalls:sys_enter"))
+            count = strtoll(line, NULL, 10);
+    }
+    pclose(f);
+    return count;
+}
+
+int main(int argc, char **argv) {
+    struct addrinfo hints = {0};
+    const char *path = "/";
+    bench_worker *ws;
+    util_hist lat = {0};
+    uint64_t requests = 0, errors = 0;
+    int conns = 64, seconds = 10, pid = 0, opt;
+    int64_t start, syscalls = -1;
+    double elapsed;
+    FILE *perf = NULL;
+
+    while ((opt = getopt(argc, argv, "c:d:P:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'P':
+            path = optarg;
+            break;
+        case 'p':
+            pid = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2 || conns < 1 || seconds < 1)
+        goto usage;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &addr)) {
+        fprintf(stderr, "bench: cannot resolve %s\n", argv[optind]);
+        return 1;
+    }
+    request_len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path,
+                           argv[optind]);
+
+    ws = calloc(conns, sizeof(*ws));
+    if (!ws)
+        return 1;
+    if (pid && !(perf = perf_start(pid, seconds)))
+        fprintf(stderr, "bench: perf not available, no syscall count\n");
+    start = util_now_us();
+    deadline = start + (int64_t)seconds * 1000000;
+    for (int i = 0; i < conns; ++i) {
+        pthread_create(&ws[i].thread, NULL, bench_main, &ws[i]);
+    }
+    for (int i = 0; i < conns; ++i) {
+        pthread_join(ws[i].thread, NULL);
+        util_hist_merge(&lat, &ws[i].lat);
+        requests += ws[i].requests;
+        errors += ws[i].errors;
+    }
+    elapsed = (util_now_us() - start) / 1e6;
+    if (perf)
+        syscalls = perf_finish(perf);
+
+    printf("requests  %llu\n", (unsigned long long)requests);
+    printf("errors    %llu\n", (unsigned long long)errors);
+    printf("req/s     %.0f\n", requests / elapsed);
+    printf("p50       %lluus\n",
+           (unsigned long long)util_hist_quantile(&lat, 0.5));
+    printf("p99       %lluus\n",
+           (unsigned long long)util_hist_quantile(&lat, 0.99));
+    if (syscalls >= 0 && requests)
+        printf("syscalls  %.2f/req\n", (double)syscalls / requests);
+    freeaddrinfo(addr);
+    free(ws);
+    return 0;
+usage:
+    fprintf(stderr,
+            "usage: bench [-c conns] [-d seconds] [-P path] [-p pid] host "
+            "port\n");
+    return 2;
+}
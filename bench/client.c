@@ -0,0 +1,140 @@
+#include "client.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int client_connect(const struct addrinfo *addr) {
+    int fd, one = 1;
+    fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// moves the unread bytes to the front and reads more after them
+static int client_more(int fd, char *buf, size_t cap, size_t *len,
+                       size_t *pos) {
+    ssize_t n;
+    memmove(buf, buf + *pos, *len - *pos);
+    *len -= *pos;
+    *pos = 0;
+    if (*len + 1 >= cap)
+        return -1;
+    n = read(fd, buf + *len, cap - *len - 1);
+    if (n <= 0)
+        return -1;
+    *len += n;
+    return 0;
+}
+
+// the line at pos, with pos moved past it. NULL on errors
+static char *client_line(int fd, char *buf, size_t cap, size_t *len,
+                         size_t *pos) {
+    char *p, *line;
+    while (!(p = memmem(buf + *pos, *len - *pos, "\r\n", 2))) {
+        if (client_more(fd, buf, cap, len, pos) < 0)
+            return NULL;
+    }
+    line = buf + *pos;
+    *p = '\0';
+    *pos = p + 2 - buf;
+    return line;
+}
+
+// reads a chunked body whose first len - pos bytes are at buf + pos, up to
+// the end of the trailers. the data is only counted
+static int client_chunked(int fd, char *buf, size_t cap, size_t len,
+                          size_t pos) {
+    unsigned long long size;
+    char *line;
+    ssize_t n;
+
+    for (;;) {
+        if (!(line = client_line(fd, buf, cap, &len, &pos)))
+            return -1;
+        size = strtoull(line, NULL, 16);
+        if (!size)
+            break;
+        // the data and its CRLF
+        for (size += 2; size;) {
+            if (pos == len) {
+                n = read(fd, buf, cap);
+                if (n <= 0)
+                    return -1;
+                pos = 0;
+                len = (size_t)n;
+            }
+            n = len - pos < size ? (ssize_t)(len - pos) : (ssize_t)size;
+            pos += n;
+            size -= n;
+        }
+    }
+    do {
+        if (!(line = client_line(fd, buf, cap, &len, &pos)))
+            return -1;
+    } while (*line);
+    return 0;
+}
+
+int client_response(int fd, char *buf, size_t cap, int head, int *status) {
+    size_t len = 0, start = 0, body = 0;
+    int keep = 1, code = 0, chunked = 0;
+    ssize_t n;
+    char *p;
+
+    for (;;) {
+        n = read(fd, buf + len, cap - len - 1);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        if (!start && (p = strstr(buf, "\r\n\r\n"))) {
+            start = p + 4 - buf;
+            *p = '\0';
+            if ((p = strchr(buf, ' ')))
+                code = atoi(p + 1);
+            // these never have a body whatever the headers say
+            if (!head && code != 204 && code != 304) {
+                if (strcasestr(buf, "\r\nTransfer-Encoding: chunked"))
+                    chunked = 1;
+                else if ((p = strcasestr(buf, "\r\nContent-Length:")))
+                    body = strtoull(p + 17, NULL, 10);
+            }
+            if (strcasestr(buf, "\r\nConnection: close"))
+                keep = 0;
+            // streamed and proxied routes answer this way
+            if (chunked) {
+                if (client_chunked(fd, buf, cap, len, start) < 0)
+                    return -1;
+                break;
+            }
+        }
+        if (start && len - start >= body)
+            break;
+        if (len + 1 >= cap) {
+            // the rest of a large body is only counted
+            if (!start)
+                return -1;
+            for (body -= len - start; body; body -= n) {
+                n = read(fd, buf, body < cap ? body : cap);
+                if (n <= 0)
+                    return -1;
+            }
+            break;
+        }
+    }
+    if (status)
+        *status = code;
+    return keep ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#ifndef LANYT_BENCH_CLIENT_H
+#define LANYT_BENCH_CLIENT_H
+
+#include <stddef.h>
+
+struct addrinfo;
+
+// blocking connect with TCP_NODELAY, -1 on failure
+int client_connect(const struct addrinfo *addr);
+// reads one response into buf, framed by Content-Length or chunked. head is
+// set for replies to HEAD. returns 0 when the server keeps the connection
+// open, 1 when it closes it, -1 on errors. status may be NULL
+int client_response(int fd, char *buf, size_t cap, int head, int *status);
+
+#endif // LANYT_BENCH_CLIENT_H
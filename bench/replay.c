@@ -0,0 +1,321 @@
+// plays a capture (set({ capture })) back against a server and reports
+// latency per route:
+//
+//   replay [-c conns] [-s speed] [-m] file host port
+//
+// requests start at their captured offsets scaled by -s, or back to back
+// with -m. each connection is a thread, a request waits for a free one
+#include "../capture.h"
+#include "../util.h"
+#include "client.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REPLAY_ROUTES 256
+
+typedef struct {
+    char *data;
+    size_t len;
+    int64_t offset_us;
+    int route;
+    int head;
+} replay_req;
+
+typedef struct {
+    util_hist lat;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t client_errors;
+    uint64_t server_errors;
+} replay_stat;
+
+typedef struct {
+    pthread_t thread;
+    replay_stat *routes;
+    util_hist lag;
+} replay_worker;
+
+static struct addrinfo *addr;
+static replay_req *reqs;
+static size_t reqs_len;
+static size_t next;
+static char *routes[REPLAY_ROUTES];
+static int routes_len;
+static double speed = 1;
+static int64_t start;
+
+// path without the query, the last slot collects what does not fit
+static int replay_route(const char *uri) {
+    size_t len = strcspn(uri, "?#");
+    for (int i = 0; i < routes_len; ++i) {
+        if (strlen(routes[i]) == len && !strncmp(routes[i], uri, len))
+            return i;
+    }
+    if (routes_len == REPLAY_ROUTES - 1) {
+        if (!routes[routes_len])
+            routes[routes_len] = strdup("(other)");
+        return routes_len;
+    }
+    routes[routes_len] = strndup(uri, len);
+    return routes_len++;
+}
+
+// framing headers are rebuilt, the body may have been cut by the capture
+static int replay_skip(const char *name) {
+    return !strcasecmp(name, "Content-Length") ||
+           !strcasecmp(name, "Transfer-Encoding") ||
+           !strcasecmp(name, "Connection") || !strcasecmp(name, "Expect");
+}
+
+static int replay_build(replay_req *r, const capture_rec *rec,
+                        const char *host) {
+    const char *method = capture_methods[rec->method];
+    size_t cap = strlen(method) + strlen(rec->uri) + strlen(host) + 96, n;
+    int has_host = 0;
+
+    for (size_t i = 0; i < rec->headers; ++i) {
+        cap += strlen(rec->names[i]) + strlen(rec->values[i]) + 4;
+        if (!strcasecmp(rec->names[i], "Host"))
+            has_host = 1;
+    }
+    cap += rec->body_len;
+    if (!(r->data = malloc(cap)))
+        return -1;
+    n = snprintf(r->data, cap, "%s %s HTTP/1.1\r\n", method, rec->uri);
+    if (!has_host)
+        n += snprintf(r->data + n, cap - n, "Host: %s\r\n", host);
+    for (size_t i = 0; i < rec->headers; ++i) {
+        if (!replay_skip(rec->names[i]))
+            n += snprintf(r->data + n, cap - n, "%s: %s\r\n", rec->names[i],
+                          rec->values[i]);
+    }
+    if (rec->body_len || !strcmp(method, "POST") || !strcmp(method, "PUT") ||
+        !strcmp(method, "PATCH"))
+        n += snprintf(r->data + n, cap - n, "Content-Length: %zu\r\n",
+                      rec->body_len);
+    n += snprintf(r->data + n, cap - n, "\r\n");
+    memcpy(r->data + n, rec->body, rec->body_len);
+    r->len = n + rec->body_len;
+    r->offset_us = rec->offset_us;
+    r->route = replay_route(rec->uri);
+    r->head = !strcmp(method, "HEAD");
+    return 0;
+}
+
+static int replay_load(const char *path, const char *host, size_t *skipped) {
+    FILE *f = fopen(path, "rb");
+    capture_rec rec;
+    replay_req *grown;
+    size_t cap = 0;
+    int ret;
+
+    if (!f || capture_read_start(f, NULL) < 0) {
+        fprintf(stderr, "replay: %s is not a capture\n", path);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    while ((ret = capture_read(f, &rec)) > 0) {
+        if (rec.method < 0 || rec.method == 7) {
+            // CONNECT and unknown methods cannot be replayed
+            (*skipped)++;
+            capture_rec_free(&rec);
+            continue;
+        }
+        if (reqs_len == cap) {
+            size_t want = cap ? cap * 2 : 1024;
+            // reqs stays valid when realloc fails
+            if ((grown = realloc(reqs, want * sizeof(*reqs)))) {
+                reqs = grown;
+                cap = want;
+            } else {
+                ret = -1;
+            }
+        }
+        if (ret < 0 || replay_build(&reqs[reqs_len], &rec, host) < 0) {
+            capture_rec_free(&rec);
+            fclose(f);
+            for (size_t i = 0; i < reqs_len; ++i)
+                free(reqs[i].data);
+            free(reqs);
+            reqs = NULL;
+            reqs_len = 0;
+            fprintf(stderr, "replay: out of memory\n");
+            return -1;
+        }
+        reqs_len++;
+        capture_rec_free(&rec);
+    }
+    fclose(f);
+    // a capture cut short by a crash is still worth replaying
+    if (ret < 0)
+        fprintf(stderr, "replay: damaged record after %zu requests\n",
+                reqs_len);
+    return 0;
+}
+
+static void *replay_main(void *arg) {
+    replay_worker *w = arg;
+    char buf[65536];
+    replay_req *r;
+    replay_stat *s;
+    int64_t t, due;
+    int fd = -1, ret, status;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < reqs_len) {
+        r = &reqs[i];
+        s = &w->routes[r->route];
+        if (speed > 0) {
+            due = start + (int64_t)(r->offset_us / speed);
+            if ((t = util_now_us()) < due)
+                util_sleep_us(due - t);
+            else
+                util_hist_add(&w->lag, t - due);
+        }
+        if (fd < 0 && (fd = client_connect(addr)) < 0) {
+            s->errors++;
+            continue;
+        }
+        t = util_now_us();
+        if (write(fd, r->data, r->len) != (ssize_t)r->len ||
+            (ret = client_response(fd, buf, sizeof(buf), r->head, &status)) <
+                0) {
+            s->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        util_hist_add(&s->lat, util_now_us() - t);
+        s->requests++;
+        if (status >= 500)
+            s->server_errors++;
+        else if (status >= 400)
+            s->client_errors++;
+        if (ret) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static void replay_print(const char *name, const replay_stat *s,
+                         double elapsed) {
+    printf("%-32s %8llu %9.0f %8llu %8llu %8llu %6llu %6llu %6llu\n", name,
+           (unsigned long long)s->requests, s->requests / elapsed,
+           (unsigned long long)util_hist_quantile(&s->lat, 0.5),
+           (unsigned long long)util_hist_quantile(&s->lat, 0.99),
+           (unsigned long long)s->lat.max,
+           (unsigned long long)s->client_errors,
+           (unsigned long long)s->server_errors,
+           (unsigned long long)s->errors);
+}
+
+int main(int argc, char **argv) {
+    struct addrinfo hints = {0};
+    replay_worker *ws;
+    replay_stat *totals, all = {0};
+    util_hist lag = {0};
+    size_t skipped = 0;
+    int conns = 64, opt;
+    double elapsed;
+
+    while ((opt = getopt(argc, argv, "c:s:m")) != -1) {
+        switch (opt) {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'm':
+            speed = 0;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3 || conns < 1 || speed < 0)
+        goto usage;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &addr)) {
+        fprintf(stderr, "replay: cannot resolve %s\n", argv[optind + 1]);
+        return 1;
+    }
+    if (replay_load(argv[optind], argv[optind + 1], &skipped) < 0)
+        return 1;
+    if (!reqs_len) {
+        fprintf(stderr, "replay: no requests to replay\n");
+        return 1;
+    }
+
+    ws = calloc(conns, sizeof(*ws));
+    totals = calloc(REPLAY_ROUTES, sizeof(*totals));
+    for (int i = 0; ws && i < conns; ++i) {
+        if (!(ws[i].routes = calloc(REPLAY_ROUTES, sizeof(replay_stat))))
+            return 1;
+    }
+    if (!ws || !totals)
+        return 1;
+    start = util_now_us();
+    for (int i = 0; i < conns; ++i) {
+        pthread_create(&ws[i].thread, NULL, replay_main, &ws[i]);
+    }
+    for (int i = 0; i < conns; ++i) {
+        pthread_join(ws[i].thread, NULL);
+        util_hist_merge(&lag, &ws[i].lag);
+        for (int j = 0; j < REPLAY_ROUTES; ++j) {
+            replay_stat *s = &ws[i].routes[j], *t = &totals[j];
+            util_hist_merge(&t->lat, &s->lat);
+            t->requests += s->requests;
+            t->errors += s->errors;
+            t->client_errors += s->client_errors;
+            t->server_errors += s->server_errors;
+        }
+        free(ws[i].routes);
+    }
+    elapsed = (util_now_us() - start) / 1e6;
+
+    printf("requests  %zu", reqs_len);
+    if (skipped)
+        printf(" (%zu skipped)", skipped);
+    printf("\nelapsed   %.2fs\n", elapsed);
+    // how far behind the captured schedule the requests started
+    if (speed > 0)
+        printf("late p99  %lluus\n",
+               (unsigned long long)util_hist_quantile(&lag, 0.99));
+    printf("\n%-32s %8s %9s %8s %8s %8s %6s %6s %6s\n", "route", "count",
+           "req/s", "p50us", "p99us", "maxus", "4xx", "5xx", "err");
+    for (int j = 0; j < REPLAY_ROUTES; ++j) {
+        replay_stat *t = &totals[j];
+        if (!routes[j])
+            continue;
+        replay_print(routes[j], t, elapsed);
+        util_hist_merge(&all.lat, &t->lat);
+        all.requests += t->requests;
+        all.errors += t->errors;
+        all.client_errors += t->client_errors;
+        all.server_errors += t->server_errors;
+    }
+    replay_print("(all)", &all, elapsed);
+    freeaddrinfo(addr);
+    free(totals);
+    free(ws);
+    return 0;
+usage:
+    fprintf(stderr,
+            "usage: replay [-c conns] [-s speed] [-m] file host port\n");
+    return 2;
+}
@@ -0,0 +1,15 @@
+// server for bench, the backend comes from the command line:
+//   qjs bench/server.js uring 8080
+import * as http from "libhttp.so";
+
+const backend = scriptArgs[1] || "libevent";
+const port = Number(scriptArgs[2] || 8080);
+const big = "x".repeat(64 * 1024);
+
+const server = new http.server({ backend });
+server.listen("127.0.0.1", port);
+server.fixed("/fixed", new http.response({ status: 200, body: "ok" }));
+server.on("/", (req) => new http.response({ status: 200, body: "Hello, world!" }));
+server.on("/big", (req) => new http.response({ status: 200, body: big }));
+server.on("/stats", (req) => new http.response({ json: server.stats() }));
+server.dispatch();
@@ -15,21 +15,105 @@ pub fn build(b: *std.Build) void {
     http.linkSystemLibrary("quickjs");
     http.linkSystemLibrary("curl");
     http.linkSystemLibrary("event");
+    http.linkSystemLibrary("z");
+    if (target.result.os.tag != .windows) {
+        http.linkSystemLibrary("pthread");
+    }
     http.linkSystemLibrary("c");
+
+    var flags = std.ArrayList([]const u8).init(b.allocator);
+    flags.appendSlice(&.{
+        "-fPIC",
+        "-shared",
+        "-Wall",
+        "-Wno-array-bounds",
+        "-fwrapv",
+        "-fdeclspec",
+        "-fvisibility=hidden",
+        "-DCONFIG_VERSION=\"2024-02-14\"",
+        // "-DCONFIG_CHECK_JSVALUE",
+    }) catch @panic("OOM");
+
+    // tls listeners, needs libevent built with openssl
+    const openssl = b.option(bool, "openssl", "Enable TLS listeners") orelse false;
+    if (openssl) {
+        flags.append("-DHTTP_OPENSSL") catch @panic("OOM");
+        http.linkSystemLibrary("event_openssl");
+        http.linkSystemLibrary("ssl");
+        http.linkSystemLibrary("crypto");
+    }
+
+    // zstd request bodies, gzip and deflate only need zlib
+    const zstd = b.option(bool, "zstd", "Decode zstd request bodies") orelse false;
+    if (zstd) {
+        flags.append("-DHTTP_ZSTD") catch @panic("OOM");
+        http.linkSystemLibrary("zstd");
+    }
+
+    // io_uring server backend, linux 6.0 or newer with liburing
+    const uring = b.option(bool, "uring", "Enable the io_uring backend") orelse false;
+    if (uring and target.result.os.tag == .linux) {
+        flags.append("-DHTTP_URING") catch @panic("OOM");
+        http.linkSystemLibrary("uring");
+        http.addCSourceFiles(.{
+            .files = &.{"uring.c"},
+            .flags = flags.items,
+        });
+    }
+
+    // h2c, prior knowledge and ALPN h2 next to HTTP/1.1
+    const http2 = b.option(bool, "http2", "Enable HTTP/2 with nghttp2") orelse false;
+    if (http2) {
+        flags.append("-DHTTP_NGHTTP2") catch @panic("OOM");
+        http.linkSystemLibrary("nghttp2");
+        http.addCSourceFiles(.{
+            .files = &.{"h2.c"},
+            .flags = flags.items,
+        });
+    }
+
     http.addCSourceFiles(.{
-        .files = &.{ "http.c", "util.c" },
-        .flags = &.{
-            "-fPIC",
-            "-shared",
-            "-Wall",
-            "-Wno-array-bounds",
-            "-fwrapv",
-            "-fdeclspec",
-            "-fvisibility=hidden",
-            "-DCONFIG_VERSION=\"2024-02-14\"",
-            // "-DCONFIG_CHECK_JSVALUE",
+        .files = &.{
+            "http.c",
+            "util.c",
+            "cache.c",
+            "trace.c",
+            "accesslog.c",
+            "capture.c",
+            "decode.c",
         },
+        .flags = flags.items,
     });
 
     b.installArtifact(http);
+
+    if (target.result.os.tag != .windows) {
+        const bench = b.addExecutable(.{
+            .name = "bench",
+            .target = target,
+            .optimize = .ReleaseFast,
+        });
+        bench.linkLibC();
+        bench.linkSystemLibrary("pthread");
+        bench.addCSourceFiles(.{
+            .files = &.{ "bench/bench.c", "bench/client.c", "util.c" },
+            .flags = &.{ "-Wall", "-D_GNU_SOURCE" },
+        });
+        b.installArtifact(bench);
+
+        // plays captures back, set({ capture }) on the server records them
+        const replay = b.addExecutable(.{
+            .name = "replay",
+            .target = target,
+            .optimize = .ReleaseFast,
+        });
+        replay.linkLibC();
+        replay.linkSystemLibrary("pthread");
+        replay.linkSystemLibrary("event");
+        replay.addCSourceFiles(.{
+            .files = &.{ "bench/replay.c", "bench/client.c", "capture.c", "util.c" },
+            .flags = &.{ "-Wall", "-D_GNU_SOURCE" },
+        });
+        b.installArtifact(replay);
+    }
 }
@@ -0,0 +1,379 @@
+#include "cache.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/http.h>
+#include <event2/util.h>
+
+#define CACHE_BUCKETS 1024
+// forgetting a Vary only costs a miss, the table is cleared when full
+#define CACHE_VARY_MAX 4096
+
+// request headers named by the Vary of a uri's last response
+typedef struct cache_vary {
+    struct cache_vary *next;
+    char *uri;
+    char *names;
+} cache_vary;
+
+// a fetch in progress, identical requests wait for it
+typedef struct cache_flight {
+    struct cache_flight *next;
+    char *key;
+    http_cached *result;
+    int done;
+    int waiters;
+} cache_flight;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static http_cached *cache_table[CACHE_BUCKETS];
+// most recently used first
+static http_cached *lru_head, *lru_tail;
+static cache_flight *flights;
+static cache_vary *varies[CACHE_BUCKETS];
+static size_t varies_len;
+static cache_stats stats;
+
+static void cache_ref(http_cached *e) {
+    __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static uint32_t cache_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(http_cached *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(http_cached *e) {
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    else
+        lru_tail = e;
+    lru_head = e;
+}
+
+static http_cached *cache_find(const char *key, uint32_t hash) {
+    for (http_cached *e = cache_table[hash % CACHE_BUCKETS]; e; e = e->hnext) {
+        if (e->hash == hash && !strcmp(e->key, key))
+            return e;
+    }
+    return NULL;
+}
+
+static void cache_remove(http_cached *e) {
+    http_cached **pp = &cache_table[e->hash % CACHE_BUCKETS];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->hnext = NULL;
+    lru_unlink(e);
+    stats.entries--;
+    stats.bytes -= e->size;
+    cache_unref(e);
+}
+
+static void cache_evict(void) {
+    while (lru_tail && stats.bytes > stats.max_bytes)
+        cache_remove(lru_tail);
+}
+
+static cache_flight *flight_find(const char *key) {
+    for (cache_flight *f = flights; f; f = f->next) {
+        if (!strcmp(f->key, key))
+            return f;
+    }
+    return NULL;
+}
+
+static void flight_free(cache_flight *f) {
+    if (f->result)
+        cache_unref(f->result);
+    free(f->key);
+    free(f);
+}
+
+// Cache-Control max-age/no-cache/no-store and Age decide the lifetime
+static void cache_freshness(http_cached *e, struct evkeyvalq *headers) {
+    const char *cc = evhttp_find_header(headers, "Cache-Control");
+    const char *age = evhttp_find_header(headers, "Age");
+    const char *vary;
+    int64_t max_age = -1;
+
+    if (!cc)
+        cc = evhttp_find_header(&e->headers, "Cache-Control");
+    e->storable = e->status == 200 || e->status == 203 || e->status == 301 ||
+                  e->status == 404 || e->status == 410;
+    // shared between callers, so nothing meant for one of them
+    for (const char *p = cc; p && *p;) {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (!evutil_ascii_strncasecmp(p, "no-store", 8) ||
+            !evutil_ascii_strncasecmp(p, "private", 7))
+            e->storable = 0;
+        else if (!evutil_ascii_strncasecmp(p, "no-cache", 8))
+            max_age = 0;
+        else if (!evutil_ascii_strncasecmp(p, "max-age=", 8) && max_age)
+            max_age = strtoll(p + 8, NULL, 10);
+        p = strchr(p, ',');
+    }
+    if (max_age < 0)
+        max_age = 0;
+    if (age)
+        max_age -= strtoll(age, NULL, 10);
+    e->expires = util_now_us() + max_age * 1000000;
+    e->etag = evhttp_find_header(&e->headers, "ETag");
+    e->last_modified = evhttp_find_header(&e->headers, "Last-Modified");
+    if (max_age <= 0 && !e->etag && !e->last_modified)
+        e->storable = 0;
+    vary = evhttp_find_header(&e->headers, "Vary");
+    if (vary && strchr(vary, '*'))
+        e->storable = 0;
+    // stays in the table until replaced, but is never served fresh
+    if (!e->storable)
+        e->expires = 0;
+}
+
+void cache_configure(size_t max_bytes) {
+    pthread_mutex_lock(&cache_lock);
+    stats.max_bytes = max_bytes;
+    cache_evict();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_begin(const char *key, http_cached **out) {
+    uint32_t hash = cache_hash(key);
+    http_cached *e;
+    cache_flight *f;
+    int ret = CACHE_MISS;
+
+    *out = NULL;
+    pthread_mutex_lock(&cache_lock);
+    if (!stats.max_bytes) {
+        pthread_mutex_unlock(&cache_lock);
+        return CACHE_BYPASS;
+    }
+    e = cache_find(key, hash);
+    if (e && e->expires > util_now_us()) {
+        lru_unlink(e);
+        lru_push(e);
+        cache_ref(e);
+        *out = e;
+        stats.hits++;
+        stats.bytes_saved += e->body_len;
+        pthread_mutex_unlock(&cache_lock);
+        return CACHE_HIT;
+    }
+
+    f = flight_find(key);
+    if (f) {
+        f->waiters++;
+        stats.coalesced++;
+        while (!f->done)
+            pthread_cond_wait(&cache_cond, &cache_lock);
+        if (f->result) {
+            cache_ref(f->result);
+            *out = f->result;
+            stats.hits++;
+            stats.bytes_saved += f->result->body_len;
+            ret = CACHE_HIT;
+        } else {
+            ret = CACHE_ALONE;
+        }
+        if (!--f->waiters)
+            flight_free(f);
+        pthread_mutex_unlock(&cache_lock);
+        return ret;
+    }
+
+    f = calloc(1, sizeof(*f));
+    if (!f || !(f->key = strdup(key))) {
+        free(f);
+        pthread_mutex_unlock(&cache_lock);
+        return CACHE_BYPASS;
+    }
+    f->next = flights;
+    flights = f;
+    stats.misses++;
+    if (e) {
+        // stale, the caller revalidates with its validators
+        cache_ref(e);
+        *out = e;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+// result is NULL when the fetch failed
+void cache_end(const char *key, http_cached *result) {
+    uint32_t hash = cache_hash(key);
+    cache_flight *f, **pp;
+    http_cached *old;
+
+    pthread_mutex_lock(&cache_lock);
+    for (pp = &flights; (f = *pp); pp = &f->next) {
+        if (!strcmp(f->key, key)) {
+            *pp = f->next;
+            break;
+        }
+    }
+    if (result && result->storable && result->size <= stats.max_bytes &&
+        (result->key || (result->key = strdup(key)))) {
+        old = cache_find(key, hash);
+        if (old != result) {
+            if (old)
+                cache_remove(old);
+            result->hash = hash;
+            result->hnext = cache_table[hash % CACHE_BUCKETS];
+            cache_table[hash % CACHE_BUCKETS] = result;
+            cache_ref(result);
+            stats.entries++;
+            stats.bytes += result->size;
+        } else {
+            lru_unlink(result);
+        }
+        lru_push(result);
+        cache_evict();
+    }
+    if (f) {
+        if (result) {
+            cache_ref(result);
+            f->result = result;
+        }
+        f->done = 1;
+        pthread_cond_broadcast(&cache_cond);
+        if (!f->waiters)
+            flight_free(f);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+http_cached *cache_entry_new(long status, struct evkeyvalq *headers,
+                             const char *body, size_t body_len) {
+    http_cached *e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->refcnt = 1;
+    e->status = status;
+    e->headers.tqh_last = &e->headers.tqh_first;
+    e->size = sizeof(*e) + body_len;
+    for (struct evkeyval *p = headers->tqh_first; p; p = p->next.tqe_next) {
+        if (evhttp_add_header(&e->headers, p->key, p->value) < 0)
+            goto fail;
+        e->size += strlen(p->key) + strlen(p->value) + sizeof(*p);
+    }
+    e->body = malloc(body_len + 1);
+    if (!e->body)
+        goto fail;
+    memcpy(e->body, body, body_len);
+    e->body[body_len] = '\0';
+    e->body_len = body_len;
+    cache_freshness(e, headers);
+    return e;
+fail:
+    cache_unref(e);
+    return NULL;
+}
+
+// a 304 came back for e
+void cache_refresh(http_cached *e, struct evkeyvalq *headers) {
+    pthread_mutex_lock(&cache_lock);
+    cache_freshness(e, headers);
+    stats.revalidated++;
+    stats.hits++;
+    stats.misses--;
+    stats.bytes_saved += e->body_len;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_unref(http_cached *e) {
+    if (!e || __atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    evhttp_clear_headers(&e->headers);
+    free(e->body);
+    free(e->key);
+    free(e);
+}
+
+void cache_get_stats(cache_stats *out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void vary_free(cache_vary *v) {
+    free(v->uri);
+    free(v->names);
+    free(v);
+}
+
+char *cache_vary_get(const char *uri) {
+    uint32_t hash = cache_hash(uri);
+    char *names = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    for (cache_vary *v = varies[hash % CACHE_BUCKETS]; v; v = v->next) {
+        if (!strcmp(v->uri, uri)) {
+            names = strdup(v->names);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return names;
+}
+
+void cache_vary_set(const char *uri, const char *vary) {
+    uint32_t hash = cache_hash(uri);
+    cache_vary **pp, *v;
+
+    pthread_mutex_lock(&cache_lock);
+    for (pp = &varies[hash % CACHE_BUCKETS]; (v = *pp); pp = &v->next) {
+        if (!strcmp(v->uri, uri)) {
+            *pp = v->next;
+            vary_free(v);
+            varies_len--;
+            break;
+        }
+    }
+    if (vary && varies_len >= CACHE_VARY_MAX) {
+        for (size_t i = 0; i < CACHE_BUCKETS; ++i) {
+            while ((v = varies[i])) {
+                varies[i] = v->next;
+                vary_free(v);
+            }
+        }
+        varies_len = 0;
+    }
+    if (vary && (v = calloc(1, sizeof(*v)))) {
+        v->uri = strdup(uri);
+        v->names = strdup(vary);
+        if (v->uri && v->names) {
+            v->next = varies[hash % CACHE_BUCKETS];
+            varies[hash % CACHE_BUCKETS] = v;
+            varies_len++;
+        } else {
+            vary_free(v);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,61 @@
+#ifndef LANYT_CACHE_H
+#define LANYT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/keyvalq_struct.h>
+
+// immutable cached response, shared by reference count
+typedef struct http_cached {
+    struct http_cached *hnext;
+    struct http_cached *prev, *next;
+    int refcnt;
+    char *key;
+    uint32_t hash;
+    long status;
+    struct evkeyvalq headers;
+    char *body;
+    size_t body_len;
+    const char *etag;
+    const char *last_modified;
+    int64_t expires;
+    int storable;
+    size_t size;
+} http_cached;
+
+enum {
+    CACHE_BYPASS,
+    // fresh entry returned
+    CACHE_HIT,
+    // caller must fetch and then call cache_end, stale entry may be returned
+    CACHE_MISS,
+    // an identical fetch failed, caller fetches on its own
+    CACHE_ALONE,
+};
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t revalidated;
+    uint64_t coalesced;
+    uint64_t bytes_saved;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+} cache_stats;
+
+void cache_configure(size_t max_bytes);
+int cache_begin(const char *key, http_cached **out);
+void cache_end(const char *key, http_cached *result);
+http_cached *cache_entry_new(long status, struct evkeyvalq *headers,
+                             const char *body, size_t body_len);
+void cache_refresh(http_cached *e, struct evkeyvalq *headers);
+void cache_unref(http_cached *e);
+void cache_get_stats(cache_stats *stats);
+// Vary of the last response for uri, malloc'd, NULL when it had none
+char *cache_vary_get(const char *uri);
+// NULL forgets it
+void cache_vary_set(const char *uri, const char *vary);
+
+#endif // LANYT_CACHE_H
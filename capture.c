@@ -0,0 +1,400 @@
+#include "capture.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/util.h>
+
+// fixed part of a record after the length
+#define CAPTURE_FIXED 18
+
+const char *capture_methods[9] = {
+    "GET",     "POST",  "HEAD",    "PUT",   "DELETE",
+    "OPTIONS", "TRACE", "CONNECT", "PATCH",
+};
+
+typedef struct {
+    capture_config config;
+    char *path;
+    int fd;
+    int64_t start_us;
+    // producers append to buf under lock, the writer swaps it with spare
+    pthread_mutex_t lock;
+    uint8_t *buf;
+    size_t len;
+    uint8_t *spare;
+    uint64_t seen;
+    int stop;
+    pthread_t thread;
+    capture_stats stats;
+} capture;
+
+static util_shared current = UTIL_SHARED_INIT;
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)v);
+    put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    put32(p, (uint32_t)v);
+    put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static int capture_write_all(capture *c, const uint8_t *p, size_t len) {
+    while (len) {
+#ifdef _WIN32
+        int n = _write(c->fd, p, (unsigned)len);
+#else
+        ssize_t n = write(c->fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+#endif
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void capture_flush(capture *c) {
+    uint8_t *p;
+    size_t len;
+
+    pthread_mutex_lock(&c->lock);
+    p = c->buf;
+    len = c->len;
+    c->buf = c->spare;
+    c->len = 0;
+    c->spare = p;
+    pthread_mutex_unlock(&c->lock);
+    if (!len)
+        return;
+    // one write per flush, the records never straddle two buffers
+    if (capture_write_all(c, p, len) < 0)
+        c->stats.write_errors++;
+    else
+        __atomic_add_fetch(&c->stats.bytes, len, __ATOMIC_RELAXED);
+}
+
+static void *capture_main(void *arg) {
+    capture *c = arg;
+    while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+        util_sleep_us((int64_t)c->config.flush_ms * 1000);
+        capture_flush(c);
+    }
+    capture_flush(c);
+    return NULL;
+}
+
+static void capture_free(capture *c) {
+    if (c->fd >= 0)
+#ifdef _WIN32
+        _close(c->fd);
+#else
+        close(c->fd);
+#endif
+    pthread_mutex_destroy(&c->lock);
+    free(c->buf);
+    free(c->spare);
+    free(c->path);
+    free(c);
+}
+
+// writes out and frees a capture no request uses any more
+static void capture_stop(capture *c) {
+    if (!c)
+        return;
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(c->thread, NULL);
+    capture_free(c);
+}
+
+int capture_open(const capture_config *config) {
+    capture *c = calloc(1, sizeof(*c));
+    uint8_t head[16];
+    struct timeval tv;
+
+    if (!c)
+        return -1;
+    c->config = *config;
+    if (c->config.sample <= 0 || c->config.sample > 1)
+        c->config.sample = 1;
+    if (c->config.flush_ms <= 0)
+        c->config.flush_ms = 100;
+    if (!c->config.buffer)
+        c->config.buffer = 4 << 20;
+    if (!c->config.max_body)
+        c->config.max_body = 64 << 10;
+    pthread_mutex_init(&c->lock, NULL);
+    c->path = strdup(config->path);
+    c->buf = malloc(c->config.buffer);
+    c->spare = malloc(c->config.buffer);
+#ifdef _WIN32
+    c->fd = _open(config->path,
+                  _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+                  _S_IREAD | _S_IWRITE);
+#else
+    // the records hold request headers and bodies, owner only
+    c->fd = open(config->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0600);
+    if (c->fd >= 0 && fchmod(c->fd, 0600) < 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+#endif
+    if (!c->path || !c->buf || !c->spare || c->fd < 0) {
+        capture_free(c);
+        return -1;
+    }
+    c->config.path = c->path;
+    c->start_us = util_now_us();
+    evutil_gettimeofday(&tv, NULL);
+    memcpy(head, CAPTURE_MAGIC, 8);
+    put64(head + 8, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+    if (capture_write_all(c, head, sizeof(head)) < 0) {
+        capture_free(c);
+        return -1;
+    }
+    if (pthread_create(&c->thread, NULL, capture_main, c)) {
+        capture_free(c);
+        errno = EAGAIN;
+        return -1;
+    }
+    capture_stop(util_shared_swap(&current, c));
+    return 0;
+}
+
+void capture_close(void) { capture_stop(util_shared_swap(&current, NULL)); }
+
+int capture_enabled(void) { return util_shared_enabled(&current); }
+
+// evenly spread, sample 0.25 keeps every fourth request
+static int capture_sampled(capture *c) {
+    uint64_t n = __atomic_fetch_add(&c->seen, 1, __ATOMIC_RELAXED);
+    double s = c->config.sample;
+    return (uint64_t)((n + 1) * s) != (uint64_t)(n * s);
+}
+
+// written in place of credentials unless config.credentials is set
+#define CAPTURE_REDACTED "redacted"
+
+static const char *capture_value(capture *c, const struct evkeyval *kv) {
+    if (!c->config.credentials &&
+        (!evutil_ascii_strcasecmp(kv->key, "Authorization") ||
+         !evutil_ascii_strcasecmp(kv->key, "Proxy-Authorization") ||
+         !evutil_ascii_strcasecmp(kv->key, "Cookie")))
+        return CAPTURE_REDACTED;
+    return kv->value;
+}
+
+static void capture_push(capture *c, struct evhttp_request *req) {
+    struct evkeyvalq *in = evhttp_request_get_input_headers(req);
+    struct evbuffer *body = evhttp_request_get_input_buffer(req);
+    enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+    const char *uri = evhttp_request_get_uri(req);
+    struct evkeyval *kv;
+    size_t uri_len = strlen(uri), body_len = evbuffer_get_length(body);
+    size_t len = 4 + CAPTURE_FIXED + uri_len, count = 0;
+    uint8_t method = 0xff, flags = 0, *p;
+
+    if (uri_len > UINT16_MAX)
+        goto drop;
+    for (kv = in->tqh_first; kv; kv = kv->next.tqe_next) {
+        size_t name_len = strlen(kv->key);
+        size_t value_len = strlen(capture_value(c, kv));
+        if (name_len > UINT16_MAX || value_len > UINT16_MAX)
+            goto drop;
+        len += 4 + name_len + value_len;
+        count++;
+    }
+    if (count > UINT16_MAX)
+        goto drop;
+    if (body_len > c->config.max_body) {
+        body_len = c->config.max_body;
+        flags |= CAPTURE_TRUNCATED;
+    }
+    len += body_len;
+    for (size_t i = 0; i < sizeof(capture_methods) / sizeof(capture_methods[0]);
+         ++i) {
+        if (cmd & (1 << i)) {
+            method = (uint8_t)i;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (c->len + len > c->config.buffer) {
+        // the writer is behind, never block the request path
+        pthread_mutex_unlock(&c->lock);
+        goto drop;
+    }
+    p = c->buf + c->len;
+    put32(p, (uint32_t)(len - 4));
+    put64(p + 4, (uint64_t)(util_now_us() - c->start_us));
+    p[12] = method;
+    p[13] = flags;
+    put16(p + 14, (uint16_t)uri_len);
+    put16(p + 16, (uint16_t)count);
+    put32(p + 18, (uint32_t)body_len);
+    p += 4 + CAPTURE_FIXED;
+    memcpy(p, uri, uri_len);
+    p += uri_len;
+    for (kv = in->tqh_first; kv; kv = kv->next.tqe_next) {
+        const char *value = capture_value(c, kv);
+        size_t name_len = strlen(kv->key), value_len = strlen(value);
+        put16(p, (uint16_t)name_len);
+        put16(p + 2, (uint16_t)value_len);
+        memcpy(p + 4, kv->key, name_len);
+        memcpy(p + 4 + name_len, value, value_len);
+        p += 4 + name_len + value_len;
+    }
+    evbuffer_copyout(body, p, body_len);
+    c->len += len;
+    pthread_mutex_unlock(&c->lock);
+    __atomic_add_fetch(&c->stats.captured, 1, __ATOMIC_RELAXED);
+    return;
+drop:
+    __atomic_add_fetch(&c->stats.dropped, 1, __ATOMIC_RELAXED);
+}
+
+void capture_request(struct evhttp_request *req) {
+    capture *c;
+    if (!capture_enabled())
+        return;
+    c = util_shared_enter(&current);
+    if (c && capture_sampled(c))
+        capture_push(c, req);
+    util_shared_leave(&current);
+}
+
+void capture_get_stats(capture_stats *stats) {
+    capture *c;
+    memset(stats, 0, sizeof(*stats));
+    c = util_shared_lock(&current);
+    if (c) {
+        stats->captured = __atomic_load_n(&c->stats.captured, __ATOMIC_RELAXED);
+        stats->dropped = __atomic_load_n(&c->stats.dropped, __ATOMIC_RELAXED);
+        stats->bytes = __atomic_load_n(&c->stats.bytes, __ATOMIC_RELAXED);
+        stats->write_errors = c->stats.write_errors;
+    }
+    util_shared_unlock(&current);
+}
+
+int capture_read_start(FILE *f, int64_t *start_us) {
+    uint8_t head[16];
+    if (fread(head, 1, sizeof(head), f) != sizeof(head) ||
+        memcmp(head, CAPTURE_MAGIC, 8))
+        return -1;
+    if (start_us)
+        *start_us = (int64_t)get64(head + 8);
+    return 0;
+}
+
+int capture_read(FILE *f, capture_rec *rec) {
+    uint8_t lenbuf[4], *p, *end;
+    size_t len, off, uri_len, count;
+    char *s;
+
+    memset(rec, 0, sizeof(*rec));
+    if (fread(lenbuf, 1, 4, f) != 4)
+        return 0;
+    len = get32(lenbuf);
+    if (len < CAPTURE_FIXED)
+        return -1;
+    // the record, then the header arrays and the terminated strings
+    off = (len + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    rec->mem = malloc(off + len / 4 * 2 * sizeof(char *) + len);
+    if (!rec->mem)
+        return -1;
+    p = rec->mem;
+    if (fread(p, 1, len, f) != len)
+        goto fail;
+    end = p + len;
+    rec->offset_us = (int64_t)get64(p);
+    rec->method = p[8] < 9 ? p[8] : -1;
+    rec->flags = p[9];
+    uri_len = get16(p + 10);
+    count = get16(p + 12);
+    rec->body_len = get32(p + 14);
+    p += CAPTURE_FIXED;
+    // the headers take at least 4 bytes each
+    if (count > len / 4)
+        goto fail;
+    rec->names = (char **)((uint8_t *)rec->mem + off);
+    rec->values = rec->names + count;
+    s = (char *)(rec->values + count);
+    if (p + uri_len > end)
+        goto fail;
+    rec->uri = s;
+    memcpy(s, p, uri_len);
+    s[uri_len] = '\0';
+    s += uri_len + 1;
+    p += uri_len;
+    for (size_t i = 0; i < count; ++i) {
+        size_t name_len, value_len;
+        if (p + 4 > end)
+            goto fail;
+        name_len = get16(p);
+        value_len = get16(p + 2);
+        p += 4;
+        if (p + name_len + value_len > end)
+            goto fail;
+        rec->names[i] = s;
+        memcpy(s, p, name_len);
+        s[name_len] = '\0';
+        s += name_len + 1;
+        p += name_len;
+        rec->values[i] = s;
+        memcpy(s, p, value_len);
+        s[value_len] = '\0';
+        s += value_len + 1;
+        p += value_len;
+    }
+    rec->headers = count;
+    if (p + rec->body_len != end)
+        goto fail;
+    rec->body = (char *)p;
+    return 1;
+fail:
+    capture_rec_free(rec);
+    return -1;
+}
+
+void capture_rec_free(capture_rec *rec) {
+    free(rec->mem);
+    rec->mem = NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef LANYT_CAPTURE_H
+#define LANYT_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// capture file, all integers little endian:
+//
+//   "HTTPCAP1" u64 wall clock us when the capture started
+//   per request:
+//     u32 length of the rest of the record
+//     u64 us since the capture started
+//     u8 method (index into capture_methods, 0xff unknown)
+//     u8 flags (CAPTURE_TRUNCATED)
+//     u16 uri length, u16 header count, u32 body length
+//     uri, then per header u16 name length, u16 value length, name, value,
+//     then the body
+#define CAPTURE_MAGIC "HTTPCAP1"
+#define CAPTURE_TRUNCATED 1
+
+extern const char *capture_methods[9];
+
+typedef struct {
+    const char *path;
+    // fraction of requests recorded, 0 < sample <= 1
+    double sample;
+    // longer bodies are cut and flagged
+    size_t max_body;
+    // bytes buffered between the request path and the writer
+    size_t buffer;
+    int flush_ms;
+    // keep Authorization, Proxy-Authorization and Cookie as sent, they are
+    // recorded as "redacted" otherwise
+    int credentials;
+} capture_config;
+
+typedef struct {
+    uint64_t captured;
+    uint64_t dropped;
+    uint64_t bytes;
+    uint64_t write_errors;
+} capture_stats;
+
+struct evhttp_request;
+
+// process wide, replaces the running capture. returns -1 with errno
+int capture_open(const capture_config *config);
+// writes what is buffered and stops the writer
+void capture_close(void);
+int capture_enabled(void);
+// call when the request arrives, sampled
+void capture_request(struct evhttp_request *req);
+void capture_get_stats(capture_stats *stats);
+
+// one record read back, the strings point into mem
+typedef struct {
+    int64_t offset_us;
+    // -1 when the method was not one of capture_methods
+    int method;
+    int flags;
+    char *uri;
+    size_t headers;
+    char **names;
+    char **values;
+    char *body;
+    size_t body_len;
+    void *mem;
+} capture_rec;
+
+// checks the file header. returns -1 when f is not a capture
+int capture_read_start(FILE *f, int64_t *start_us);
+// returns 1 with a record, 0 at the end, -1 on a damaged record
+int capture_read(FILE *f, capture_rec *rec);
+void capture_rec_free(capture_rec *rec);
+
+#endif // LANYT_CAPTURE_H
@@ -0,0 +1,173 @@
+#include "decode.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#ifdef HTTP_ZSTD
+#include <zstd.h>
+#endif
+
+#include <event2/buffer.h>
+
+#define DECODE_CHUNK 16384
+// zstd frames may ask for windows up to 2GB, 8MB covers what clients send
+#define DECODE_ZSTD_WINDOW_LOG 23
+
+static int decode_check(size_t out, size_t in, const decode_limits *l) {
+    if (l->max_size && out > l->max_size)
+        return DECODE_TOO_LARGE;
+    if (l->max_ratio > 0 && out > l->max_ratio * (double)in)
+        return DECODE_TOO_LARGE;
+    return DECODE_OK;
+}
+
+// the encoded chains, without copying them
+static struct evbuffer_iovec *decode_chains(struct evbuffer *in, int *n) {
+    struct evbuffer_iovec *vec;
+    *n = evbuffer_peek(in, -1, NULL, NULL, 0);
+    vec = malloc((*n ? *n : 1) * sizeof(*vec));
+    if (vec)
+        evbuffer_peek(in, -1, NULL, vec, *n);
+    return vec;
+}
+
+// gzip keeps going over members written back to back
+static int decode_zlib(struct evbuffer *in, struct evbuffer *out, int window,
+                       int members, const decode_limits *l) {
+    size_t total = evbuffer_get_length(in), produced = 0;
+    struct evbuffer_iovec *vec, space;
+    z_stream z = {0};
+    int n, ret = DECODE_OK, zret = Z_OK;
+
+    if (!(vec = decode_chains(in, &n)))
+        return DECODE_NOMEM;
+    if (inflateInit2(&z, window) != Z_OK) {
+        free(vec);
+        return DECODE_NOMEM;
+    }
+    for (int i = 0; i < n && ret == DECODE_OK; ++i) {
+        z.next_in = vec[i].iov_base;
+        z.avail_in = (uInt)vec[i].iov_len;
+        do {
+            if (zret == Z_STREAM_END && z.avail_in) {
+                if (!members) {
+                    ret = DECODE_CORRUPT;
+                    break;
+                }
+                inflateReset(&z);
+            }
+            if (evbuffer_reserve_space(out, DECODE_CHUNK, &space, 1) < 1) {
+                ret = DECODE_NOMEM;
+                break;
+            }
+            z.next_out = space.iov_base;
+            z.avail_out = (uInt)space.iov_len;
+            zret = inflate(&z, Z_NO_FLUSH);
+            space.iov_len -= z.avail_out;
+            produced += space.iov_len;
+            evbuffer_commit_space(out, &space, 1);
+            if (zret == Z_MEM_ERROR)
+                ret = DECODE_NOMEM;
+            else if (zret == Z_NEED_DICT || zret == Z_DATA_ERROR ||
+                     zret == Z_STREAM_ERROR)
+                ret = DECODE_CORRUPT;
+            else
+                ret = decode_check(produced, total, l);
+        } while (ret == DECODE_OK &&
+                 (z.avail_in || (!z.avail_out && zret != Z_STREAM_END)));
+    }
+    // truncated
+    if (ret == DECODE_OK && zret != Z_STREAM_END)
+        ret = DECODE_CORRUPT;
+    inflateEnd(&z);
+    free(vec);
+    return ret;
+}
+
+#ifdef HTTP_ZSTD
+static int decode_zstd(struct evbuffer *in, struct evbuffer *out,
+                       const decode_limits *l) {
+    size_t total = evbuffer_get_length(in), produced = 0, zret = 1;
+    struct evbuffer_iovec *vec, space;
+    ZSTD_DStream *ds;
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    int n, ret = DECODE_OK;
+
+    if (!(vec = decode_chains(in, &n)))
+        return DECODE_NOMEM;
+    if (!(ds = ZSTD_createDStream())) {
+        free(vec);
+        return DECODE_NOMEM;
+    }
+    ZSTD_DCtx_setParameter(ds, ZSTD_d_windowLogMax, DECODE_ZSTD_WINDOW_LOG);
+    for (int i = 0; i < n && ret == DECODE_OK; ++i) {
+        zin.src = vec[i].iov_base;
+        zin.size = vec[i].iov_len;
+        zin.pos = 0;
+        do {
+            if (evbuffer_reserve_space(out, DECODE_CHUNK, &space, 1) < 1) {
+                ret = DECODE_NOMEM;
+                break;
+            }
+            zout.dst = space.iov_base;
+            zout.size = space.iov_len;
+            zout.pos = 0;
+            zret = ZSTD_decompressStream(ds, &zout, &zin);
+            space.iov_len = zout.pos;
+            produced += zout.pos;
+            evbuffer_commit_space(out, &space, 1);
+            if (ZSTD_isError(zret))
+                ret = DECODE_CORRUPT;
+            else
+                ret = decode_check(produced, total, l);
+        } while (ret == DECODE_OK &&
+                 (zin.pos < zin.size || zout.pos == zout.size));
+    }
+    // 0 once the last frame is complete and flushed
+    if (ret == DECODE_OK && zret)
+        ret = DECODE_CORRUPT;
+    ZSTD_freeDStream(ds);
+    free(vec);
+    return ret;
+}
+#endif
+
+int decode_body(const char *encoding, struct evbuffer *in,
+                struct evbuffer *out, const decode_limits *limits) {
+    unsigned char head[2] = {0};
+    size_t len;
+
+    while (*encoding == ' ' || *encoding == '\t')
+        encoding++;
+    len = strcspn(encoding, " \t");
+    // a single coding only, anything after it is another one
+    if (encoding[len + strspn(encoding + len, " \t")])
+        return DECODE_UNSUPPORTED;
+    if ((len == 4 && !strncasecmp(encoding, "gzip", 4)) ||
+        (len == 6 && !strncasecmp(encoding, "x-gzip", 6)))
+        return decode_zlib(in, out, 16 + MAX_WBITS, 1, limits);
+    if (len == 7 && !strncasecmp(encoding, "deflate", 7)) {
+        // meant to be zlib wrapped, some clients send it raw
+        evbuffer_copyout(in, head, 2);
+        if ((head[0] & 0x0f) == Z_DEFLATED &&
+            (head[0] << 8 | head[1]) % 31 == 0)
+            return decode_zlib(in, out, MAX_WBITS, 0, limits);
+        return decode_zlib(in, out, -MAX_WBITS, 0, limits);
+    }
+#ifdef HTTP_ZSTD
+    if (len == 4 && !strncasecmp(encoding, "zstd", 4))
+        return decode_zstd(in, out, limits);
+#endif
+    return DECODE_UNSUPPORTED;
+}
+
+const char *decode_accepted(void) {
+#ifdef HTTP_ZSTD
+    return "gzip, deflate, zstd";
+#else
+    return "gzip, deflate";
+#endif
+}
@@ -0,0 +1,33 @@
+#ifndef LANYT_DECODE_H
+#define LANYT_DECODE_H
+
+#include <stddef.h>
+
+struct evbuffer;
+
+enum {
+    DECODE_OK,
+    // not a coding we know, 415
+    DECODE_UNSUPPORTED,
+    // over the size or ratio limit, 413
+    DECODE_TOO_LARGE,
+    // damaged or truncated data, 400
+    DECODE_CORRUPT,
+    DECODE_NOMEM,
+};
+
+typedef struct {
+    // decoded bytes allowed, 0 no limit
+    size_t max_size;
+    // decoded bytes allowed per encoded byte, 0 no limit
+    double max_ratio;
+} decode_limits;
+
+// decodes all of in by its Content-Encoding and appends the result to out,
+// stopping as soon as a limit is crossed. in is left alone
+int decode_body(const char *encoding, struct evbuffer *in,
+                struct evbuffer *out, const decode_limits *limits);
+// value for Accept-Encoding on a 415
+const char *decode_accepted(void);
+
+#endif // LANYT_DECODE_H
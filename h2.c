@@ -0,0 +1,710 @@
+#include "h2.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/util.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+// the same limits the HTTP/1.1 paths have
+#define H2_HEADERS_MAX (16 << 10)
+#define H2_BODY_MAX (8 << 20)
+#define H2_WINDOW (1 << 20)
+// nghttp2 is held back above this much unsent output
+#define H2_OUTPUT_HIGH (64 << 10)
+#define H2_OUTPUT_LOW (16 << 10)
+#define H2_EVHTTP_MAX 4
+
+typedef struct h2_session h2_session;
+
+typedef struct h2_stream {
+    struct h2_stream *prev, *next;
+    int32_t id;
+    char *method;
+    char *path;
+    char *authority;
+    struct evkeyvalq headers;
+    size_t headers_len;
+    struct evbuffer *body;
+    int too_large;
+    int dispatched;
+    h2_reply reply;
+    // body bytes handed to nghttp2, and written out
+    size_t queued;
+    size_t sent;
+} h2_stream;
+
+struct h2_session {
+    h2_session *prev, *next;
+    h2_backend *h2;
+    struct bufferevent *bev;
+    // evhttp's, freed with the session so it closes the socket
+    struct evhttp_connection *evcon;
+    nghttp2_session *ng;
+    h2_stream *streams;
+};
+
+struct h2_backend {
+    h2_backend *next;
+    h2_handler handler;
+    void *arg;
+    uint32_t max_streams;
+    nghttp2_session_callbacks *callbacks;
+    struct evhttp *https[H2_EVHTTP_MAX];
+    int https_len;
+    h2_session *sessions;
+    h2_stats stats;
+    // sessions get a GOAWAY and end with their last stream
+    int draining;
+};
+
+// evhttp has no user data on a connection, the backend is found through
+// the evhttp it came from
+static pthread_mutex_t h2_lock = PTHREAD_MUTEX_INITIALIZER;
+static h2_backend *h2_backends;
+
+static h2_backend *h2_lookup(struct evhttp *http) {
+    h2_backend *h2;
+    pthread_mutex_lock(&h2_lock);
+    for (h2 = h2_backends; h2; h2 = h2->next) {
+        int i;
+        for (i = 0; i < h2->https_len && h2->https[i] != http; ++i)
+            ;
+        if (i < h2->https_len)
+            break;
+    }
+    pthread_mutex_unlock(&h2_lock);
+    return h2;
+}
+
+static void h2_stream_free(h2_session *s, h2_stream *st) {
+    if (st->prev)
+        st->prev->next = st->next;
+    else
+        s->streams = st->next;
+    if (st->next)
+        st->next->prev = st->prev;
+    if (st->reply.done)
+        st->reply.done(st->reply.opaque);
+    free(st->method);
+    free(st->path);
+    free(st->authority);
+    evhttp_clear_headers(&st->headers);
+    if (st->body)
+        evbuffer_free(st->body);
+    free(st);
+}
+
+static h2_stream *h2_stream_new(h2_session *s, int32_t id) {
+    h2_stream *st = calloc(1, sizeof(*st));
+    if (!st)
+        return NULL;
+    st->id = id;
+    st->headers.tqh_first = NULL;
+    st->headers.tqh_last = &st->headers.tqh_first;
+    st->next = s->streams;
+    if (s->streams)
+        s->streams->prev = st;
+    s->streams = st;
+    return st;
+}
+
+static void h2_session_free(h2_session *s) {
+    h2_backend *h2 = s->h2;
+    // nghttp2 does not report the streams it drops
+    nghttp2_session_del(s->ng);
+    while (s->streams)
+        h2_stream_free(s, s->streams);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        h2->sessions = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    h2->stats.active--;
+    bufferevent_setcb(s->bev, NULL, NULL, NULL, NULL);
+    evhttp_connection_free(s->evcon);
+    free(s);
+}
+
+// 0 while the session has work, -1 once it is over
+static int h2_session_io(h2_session *s) {
+    if (nghttp2_session_send(s->ng))
+        return -1;
+    if (!nghttp2_session_want_read(s->ng) &&
+        !nghttp2_session_want_write(s->ng) &&
+        !evbuffer_get_length(bufferevent_get_output(s->bev)))
+        return -1;
+    return 0;
+}
+
+// evhttp is still in its request callback during an upgrade, the session
+// is driven from the write callback instead
+static void h2_session_kick(h2_session *s) {
+    bufferevent_trigger(s->bev, EV_WRITE,
+                        BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+}
+
+// streams already started finish, nghttp2 stops wanting to read after them
+static void h2_session_goaway(h2_session *s) {
+    nghttp2_submit_goaway(s->ng, NGHTTP2_FLAG_NONE,
+                          nghttp2_session_get_last_proc_stream_id(s->ng),
+                          NGHTTP2_NO_ERROR, NULL, 0);
+}
+
+static void h2_readcb(struct bufferevent *bev, void *arg) {
+    h2_session *s = arg;
+    struct evbuffer *in = bufferevent_get_input(bev);
+    size_t n;
+    ssize_t ret;
+
+    while ((n = evbuffer_get_contiguous_space(in))) {
+        ret = nghttp2_session_mem_recv(s->ng, evbuffer_pullup(in, n), n);
+        if (ret < 0) {
+            h2_session_free(s);
+            return;
+        }
+        evbuffer_drain(in, n);
+    }
+    if (h2_session_io(s) < 0)
+        h2_session_free(s);
+}
+
+static void h2_writecb(struct bufferevent *bev, void *arg) {
+    h2_session *s = arg;
+    if (h2_session_io(s) < 0)
+        h2_session_free(s);
+}
+
+static void h2_eventcb(struct bufferevent *bev, short what, void *arg) {
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+        h2_session_free(arg);
+}
+
+static ssize_t h2_send_cb(nghttp2_session *ng, const uint8_t *data,
+                          size_t len, int flags, void *arg) {
+    h2_session *s = arg;
+    struct evbuffer *out = bufferevent_get_output(s->bev);
+    if (evbuffer_get_length(out) >= H2_OUTPUT_HIGH)
+        return NGHTTP2_ERR_WOULDBLOCK;
+    if (evbuffer_add(out, data, len))
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    return (ssize_t)len;
+}
+
+// the body goes straight from the reply to the output, after the frame head
+static ssize_t h2_read_cb(nghttp2_session *ng, int32_t id, uint8_t *buf,
+                          size_t length, uint32_t *flags,
+                          nghttp2_data_source *source, void *arg) {
+    h2_stream *st = source->ptr;
+    size_t n = st->reply.body_len - st->queued;
+    if (n > length)
+        n = length;
+    st->queued += n;
+    *flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+    if (st->queued == st->reply.body_len)
+        *flags |= NGHTTP2_DATA_FLAG_EOF;
+    return (ssize_t)n;
+}
+
+static int h2_send_data_cb(nghttp2_session *ng, nghttp2_frame *frame,
+                           const uint8_t *framehd, size_t length,
+                           nghttp2_data_source *source, void *arg) {
+    h2_session *s = arg;
+    h2_stream *st = source->ptr;
+    struct evbuffer *out = bufferevent_get_output(s->bev);
+
+    if (evbuffer_get_length(out) >= H2_OUTPUT_HIGH)
+        return NGHTTP2_ERR_WOULDBLOCK;
+    if (evbuffer_add(out, framehd, 9) ||
+        evbuffer_add(out, st->reply.body + st->sent, length))
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    st->sent += length;
+    return 0;
+}
+
+// framing is the protocol's business in h2
+static int h2_hop_by_hop(const char *name) {
+    return !evutil_ascii_strcasecmp(name, "Connection") ||
+           !evutil_ascii_strcasecmp(name, "Keep-Alive") ||
+           !evutil_ascii_strcasecmp(name, "Proxy-Connection") ||
+           !evutil_ascii_strcasecmp(name, "Transfer-Encoding") ||
+           !evutil_ascii_strcasecmp(name, "Upgrade") ||
+           !evutil_ascii_strcasecmp(name, "Content-Length");
+}
+
+static const char *h2_date(void) {
+    static __thread time_t date_at;
+    static __thread char date[40];
+    time_t now = time(NULL);
+    struct tm tm;
+    if (now != date_at) {
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        date_at = now;
+    }
+    return date;
+}
+
+#define H2_NV(n, v, vlen)                                                      \
+    ((nghttp2_nv){(uint8_t *)(n), (uint8_t *)(v), strlen(n), (vlen),          \
+                  NGHTTP2_NV_FLAG_NONE})
+
+// the same defaults evhttp fills in, with the names lowercased
+static int h2_submit(h2_session *s, h2_stream *st) {
+    const h2_reply *r = &st->reply;
+    const struct evkeyval *h;
+    nghttp2_data_provider data = {{.ptr = st}, h2_read_cb};
+    nghttp2_nv *nva;
+    char status[8], length[24], *names, *p;
+    size_t count = 4, names_len = 0, n = 0;
+    int body, send, ret;
+
+    for (h = r->headers ? r->headers->tqh_first : NULL; h;
+         h = h->next.tqe_next) {
+        count++;
+        names_len += strlen(h->key) + 1;
+    }
+    nva = malloc(count * sizeof(*nva));
+    names = p = malloc(names_len + 1);
+    if (!nva || !names) {
+        free(nva);
+        free(names);
+        return -1;
+    }
+    // HEAD gets the fields of the body it would have had
+    body = r->status >= 200 && r->status != 204 && r->status != 304;
+    snprintf(status, sizeof(status), "%d", r->status);
+    nva[n++] = H2_NV(":status", status, strlen(status));
+    for (h = r->headers ? r->headers->tqh_first : NULL; h;
+         h = h->next.tqe_next) {
+        size_t len = strlen(h->key);
+        if (h2_hop_by_hop(h->key))
+            continue;
+        for (size_t i = 0; i < len; ++i)
+            p[i] = (char)tolower((unsigned char)h->key[i]);
+        p[len] = '\0';
+        nva[n++] = H2_NV(p, h->value, strlen(h->value));
+        p += len + 1;
+    }
+    if (!(r->headers && evhttp_find_header(r->headers, "Date")))
+        nva[n++] = H2_NV("date", h2_date(), strlen(h2_date()));
+    if (body) {
+        if (!(r->headers && evhttp_find_header(r->headers, "Content-Type")))
+            nva[n++] = H2_NV("content-type", "text/html; charset=ISO-8859-1",
+                             29);
+        snprintf(length, sizeof(length), "%zu", r->body_len);
+        nva[n++] = H2_NV("content-length", length, strlen(length));
+    }
+    send = body && r->body_len && strcmp(st->method, "HEAD");
+    ret = nghttp2_submit_response(s->ng, st->id, nva, n, send ? &data : NULL);
+    free(nva);
+    free(names);
+    return ret ? -1 : 0;
+}
+
+static void h2_dispatch(h2_session *s, h2_stream *st) {
+    h2_backend *h2 = s->h2;
+    h2_request req;
+
+    st->dispatched = 1;
+    h2->stats.streams++;
+    if (!st->method || !st->path) {
+        // CONNECT has no :path, nothing here can serve it
+        nghttp2_submit_rst_stream(s->ng, NGHTTP2_FLAG_NONE, st->id,
+                                  NGHTTP2_REFUSED_STREAM);
+        return;
+    }
+    if (st->too_large) {
+        st->reply.status = 413;
+    } else {
+        if (st->authority && !evhttp_find_header(&st->headers, "Host"))
+            evhttp_add_header(&st->headers, "Host", st->authority);
+        req.method = st->method;
+        req.uri = st->path;
+        req.headers = &st->headers;
+        req.body = NULL;
+        req.body_len = st->body ? evbuffer_get_length(st->body) : 0;
+        if (req.body_len)
+            req.body = (const char *)evbuffer_pullup(st->body, -1);
+        h2->handler(h2->arg, &req, &st->reply);
+        if (!st->reply.status)
+            st->reply.status = 500;
+    }
+    if (h2_submit(s, st) < 0)
+        nghttp2_submit_rst_stream(s->ng, NGHTTP2_FLAG_NONE, st->id,
+                                  NGHTTP2_INTERNAL_ERROR);
+}
+
+static int h2_begin_headers_cb(nghttp2_session *ng, const nghttp2_frame *frame,
+                               void *arg) {
+    h2_session *s = arg;
+    h2_stream *st;
+    if (frame->hd.type != NGHTTP2_HEADERS ||
+        frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+        return 0;
+    if (!(st = h2_stream_new(s, frame->hd.stream_id)))
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    nghttp2_session_set_stream_user_data(ng, frame->hd.stream_id, st);
+    return 0;
+}
+
+static int h2_header_cb(nghttp2_session *ng, const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen, uint8_t flags,
+                        void *arg) {
+    const char *n = (const char *)name, *v = (const char *)value;
+    h2_stream *st;
+    const char *old;
+    char **pseudo = NULL;
+
+    // trailers are dropped
+    if (frame->hd.type != NGHTTP2_HEADERS ||
+        frame->headers.cat != NGHTTP2_HCAT_REQUEST ||
+        !(st = nghttp2_session_get_stream_user_data(ng, frame->hd.stream_id)))
+        return 0;
+    st->headers_len += namelen + valuelen;
+    if (st->headers_len > H2_HEADERS_MAX)
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    if (n[0] == ':') {
+        if (!strcmp(n, ":method"))
+            pseudo = &st->method;
+        else if (!strcmp(n, ":path"))
+            pseudo = &st->path;
+        else if (!strcmp(n, ":authority"))
+            pseudo = &st->authority;
+        if (pseudo && !*pseudo && !(*pseudo = strdup(v)))
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        return 0;
+    }
+    // h2 may split cookies, handlers expect one field
+    if (!strcmp(n, "cookie") && (old = evhttp_find_header(&st->headers, n))) {
+        size_t len = strlen(old) + valuelen + 3;
+        char *joined = malloc(len);
+        if (!joined)
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        snprintf(joined, len, "%s; %s", old, v);
+        evhttp_remove_header(&st->headers, n);
+        evhttp_add_header(&st->headers, n, joined);
+        free(joined);
+        return 0;
+    }
+    if (evhttp_add_header(&st->headers, n, v))
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    return 0;
+}
+
+static int h2_data_cb(nghttp2_session *ng, uint8_t flags, int32_t id,
+                      const uint8_t *data, size_t len, void *arg) {
+    h2_stream *st = nghttp2_session_get_stream_user_data(ng, id);
+    if (!st || st->too_large)
+        return 0;
+    if (!st->body && !(st->body = evbuffer_new()))
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    // answered with 413 once the client is done sending
+    if (evbuffer_get_length(st->body) + len > H2_BODY_MAX) {
+        st->too_large = 1;
+        evbuffer_drain(st->body, evbuffer_get_length(st->body));
+        return 0;
+    }
+    if (evbuffer_add(st->body, data, len))
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+    return 0;
+}
+
+static int h2_frame_cb(nghttp2_session *ng, const nghttp2_frame *frame,
+                       void *arg) {
+    h2_stream *st;
+    if ((frame->hd.type != NGHTTP2_HEADERS &&
+         frame->hd.type != NGHTTP2_DATA) ||
+        !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+        return 0;
+    st = nghttp2_session_get_stream_user_data(ng, frame->hd.stream_id);
+    if (st && !st->dispatched)
+        h2_dispatch(arg, st);
+    return 0;
+}
+
+static int h2_close_cb(nghttp2_session *ng, int32_t id, uint32_t error_code,
+                       void *arg) {
+    h2_session *s = arg;
+    h2_stream *st = nghttp2_session_get_stream_user_data(ng, id);
+    if (error_code)
+        s->h2->stats.resets++;
+    if (st)
+        h2_stream_free(s, st);
+    return 0;
+}
+
+// takes the connection over from evhttp, which keeps it until the end
+static h2_session *h2_session_new(h2_backend *h2, struct bufferevent *bev,
+                                  struct evhttp_connection *evcon) {
+    nghttp2_settings_entry settings[] = {
+        {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, h2->max_streams},
+        {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_WINDOW},
+        {NGHTTP2_SETTINGS_MAX_HEADER_LIST_SIZE, H2_HEADERS_MAX},
+    };
+    h2_session *s = calloc(1, sizeof(*s));
+
+    if (!s)
+        return NULL;
+    if (nghttp2_session_server_new(&s->ng, h2->callbacks, s)) {
+        free(s);
+        return NULL;
+    }
+    if (nghttp2_submit_settings(s->ng, NGHTTP2_FLAG_NONE, settings,
+                                sizeof(settings) / sizeof(settings[0]))) {
+        nghttp2_session_del(s->ng);
+        free(s);
+        return NULL;
+    }
+    s->h2 = h2;
+    s->bev = bev;
+    s->evcon = evcon;
+    return s;
+}
+
+// a session that never took over its connection, evhttp keeps it
+static void h2_session_discard(h2_session *s) {
+    nghttp2_session_del(s->ng);
+    while (s->streams)
+        h2_stream_free(s, s->streams);
+    free(s);
+}
+
+// takes the connection over from evhttp
+static void h2_session_start(h2_session *s) {
+    h2_backend *h2 = s->h2;
+    s->next = h2->sessions;
+    if (h2->sessions)
+        h2->sessions->prev = s;
+    h2->sessions = s;
+    h2->stats.sessions++;
+    h2->stats.active++;
+    if (h2->draining)
+        h2_session_goaway(s);
+    bufferevent_setcb(s->bev, h2_readcb, h2_writecb, h2_eventcb, s);
+    bufferevent_setwatermark(s->bev, EV_WRITE, H2_OUTPUT_LOW, 0);
+    bufferevent_enable(s->bev, EV_READ | EV_WRITE);
+}
+
+// runs on every change to a new connection's input until the first bytes
+// tell whether it is h2. evhttp is held off a partial preface by freezing
+static void h2_sniff_cb(struct evbuffer *buf,
+                        const struct evbuffer_cb_info *info, void *arg) {
+    struct bufferevent *bev = arg;
+    struct evhttp_connection *evcon = NULL;
+    size_t len = evbuffer_get_length(buf);
+    unsigned char *p;
+    h2_backend *h2;
+    h2_session *s;
+
+    if (!info->n_added)
+        return;
+    evbuffer_unfreeze(buf, 1);
+    if (len > H2_PREFACE_LEN)
+        len = H2_PREFACE_LEN;
+    p = evbuffer_pullup(buf, len);
+    if (p && memcmp(p, H2_PREFACE, len)) {
+        evbuffer_remove_cb(buf, h2_sniff_cb, bev);
+        return;
+    }
+    if (len < H2_PREFACE_LEN) {
+        evbuffer_freeze(buf, 1);
+        return;
+    }
+    evbuffer_remove_cb(buf, h2_sniff_cb, bev);
+    bufferevent_getcb(bev, NULL, NULL, NULL, (void **)&evcon);
+    // evhttp answers 400 when this fails
+    if (evcon && (h2 = h2_lookup(evhttp_connection_get_server(evcon))) &&
+        (s = h2_session_new(h2, bev, evcon)))
+        h2_session_start(s);
+}
+
+void h2_watch(struct bufferevent *bev) {
+    evbuffer_add_cb(bufferevent_get_input(bev), h2_sniff_cb, bev);
+}
+
+static int h2_token(const char *list, const char *token) {
+    size_t len = strlen(token);
+    for (const char *p = list; *p;) {
+        p += strspn(p, " \t,");
+        if (!evutil_ascii_strncasecmp(p, token, len) &&
+            (!p[len] || strchr(" \t,", p[len])))
+            return 1;
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+// HTTP2-Settings, base64url without padding
+static int h2_base64url(const char *src, uint8_t *dst, size_t *len) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (; *src && *src != '='; ++src) {
+        char c = *src;
+        int v = c >= 'A' && c <= 'Z'   ? c - 'A'
+                : c >= 'a' && c <= 'z' ? c - 'a' + 26
+                : c >= '0' && c <= '9' ? c - '0' + 52
+                : c == '-'             ? 62
+                : c == '_'             ? 63
+                                       : -1;
+        if (v < 0)
+            return -1;
+        acc = acc << 6 | (uint32_t)v;
+        if ((bits += 6) >= 8) {
+            bits -= 8;
+            dst[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    *len = n;
+    return 0;
+}
+
+int h2_upgrade(h2_backend *h2, struct evhttp_request *req,
+               const char *method) {
+    struct evkeyvalq *in = evhttp_request_get_input_headers(req);
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    const char *upgrade = evhttp_find_header(in, "Upgrade");
+    const char *settings = evhttp_find_header(in, "HTTP2-Settings");
+    struct evbuffer *body = evhttp_request_get_input_buffer(req);
+    struct bufferevent *bev;
+    struct evkeyval *kv;
+    h2_session *s;
+    h2_stream *st;
+    uint8_t *payload;
+    size_t len;
+
+    if (h2->draining || !evcon || !method || !upgrade || !settings ||
+        !h2_token(upgrade, "h2c"))
+        return -1;
+    payload = malloc(strlen(settings) + 1);
+    if (!payload || h2_base64url(settings, payload, &len) < 0) {
+        free(payload);
+        return -1;
+    }
+    bev = evhttp_connection_get_bufferevent(evcon);
+    if (!(s = h2_session_new(h2, bev, evcon))) {
+        free(payload);
+        return -1;
+    }
+    // the request itself is stream 1, half closed from the client side. a
+    // bad HTTP2-Settings keeps the connection on HTTP/1.1
+    st = h2_stream_new(s, 1);
+    if (!st || nghttp2_session_upgrade2(s->ng, payload, len,
+                                        !strcmp(method, "HEAD"), st)) {
+        free(payload);
+        h2_session_discard(s);
+        return -1;
+    }
+    free(payload);
+    h2_session_start(s);
+    // ahead of the server preface, which waits for the next send
+    evbuffer_add_printf(bufferevent_get_output(bev),
+                        "HTTP/1.1 101 Switching Protocols\r\n"
+                        "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    h2->stats.upgrades++;
+    st->method = strdup(method);
+    st->path = strdup(evhttp_request_get_uri(req));
+    for (kv = in->tqh_first; kv; kv = kv->next.tqe_next) {
+        if (!h2_hop_by_hop(kv->key) &&
+            evutil_ascii_strcasecmp(kv->key, "HTTP2-Settings"))
+            evhttp_add_header(&st->headers, kv->key, kv->value);
+    }
+    if (evbuffer_get_length(body) > H2_BODY_MAX)
+        st->too_large = 1;
+    else if (evbuffer_get_length(body) && (st->body = evbuffer_new()))
+        evbuffer_add_buffer(st->body, body);
+    h2_dispatch(s, st);
+    h2_session_kick(s);
+    return 0;
+}
+
+h2_backend *h2_new(h2_handler handler, void *arg) {
+    h2_backend *h2 = calloc(1, sizeof(*h2));
+    nghttp2_session_callbacks *cbs;
+
+    if (!h2)
+        return NULL;
+    if (nghttp2_session_callbacks_new(&cbs)) {
+        free(h2);
+        return NULL;
+    }
+    nghttp2_session_callbacks_set_send_callback(cbs, h2_send_cb);
+    nghttp2_session_callbacks_set_send_data_callback(cbs, h2_send_data_cb);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(
+        cbs, h2_begin_headers_cb);
+    nghttp2_session_callbacks_set_on_header_callback(cbs, h2_header_cb);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, h2_data_cb);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, h2_frame_cb);
+    nghttp2_session_callbacks_set_on_stream_close_callback(cbs, h2_close_cb);
+    h2->callbacks = cbs;
+    h2->handler = handler;
+    h2->arg = arg;
+    h2->max_streams = 100;
+    pthread_mutex_lock(&h2_lock);
+    h2->next = h2_backends;
+    h2_backends = h2;
+    pthread_mutex_unlock(&h2_lock);
+    return h2;
+}
+
+void h2_set_max_streams(h2_backend *h2, uint32_t max_streams) {
+    h2->max_streams = max_streams ? max_streams : 100;
+}
+
+int h2_attach(h2_backend *h2, struct evhttp *http) {
+    int ret = 0;
+    pthread_mutex_lock(&h2_lock);
+    for (int i = 0; i < h2->https_len; ++i) {
+        if (h2->https[i] == http)
+            goto done;
+    }
+    if (h2->https_len == H2_EVHTTP_MAX)
+        ret = -1;
+    else
+        h2->https[h2->https_len++] = http;
+done:
+    pthread_mutex_unlock(&h2_lock);
+    return ret;
+}
+
+void h2_drain(h2_backend *h2) {
+    h2->draining = 1;
+    // may run inside a stream's handler, the sessions close from their
+    // write callbacks
+    for (h2_session *s = h2->sessions; s; s = s->next) {
+        h2_session_goaway(s);
+        h2_session_kick(s);
+    }
+}
+
+void h2_free(h2_backend *h2) {
+    h2_backend **p;
+    if (!h2)
+        return;
+    pthread_mutex_lock(&h2_lock);
+    for (p = &h2_backends; *p && *p != h2; p = &(*p)->next)
+        ;
+    if (*p)
+        *p = h2->next;
+    pthread_mutex_unlock(&h2_lock);
+    while (h2->sessions)
+        h2_session_free(h2->sessions);
+    nghttp2_session_callbacks_del(h2->callbacks);
+    free(h2);
+}
+
+void h2_get_stats(const h2_backend *h2, h2_stats *stats) { *stats = h2->stats; }
@@ -0,0 +1,64 @@
+#ifndef LANYT_H2_H
+#define LANYT_H2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/keyvalq_struct.h>
+
+struct bufferevent;
+struct evhttp;
+struct evhttp_request;
+
+typedef struct h2_backend h2_backend;
+
+// one stream, valid for the handler call
+typedef struct {
+    const char *method;
+    const char *uri;
+    // regular fields, :authority comes as Host
+    struct evkeyvalq *headers;
+    const char *body;
+    size_t body_len;
+} h2_request;
+
+// filled by the handler. body and headers must stay valid until done
+typedef struct {
+    int status;
+    const struct evkeyvalq *headers;
+    const char *body;
+    size_t body_len;
+    void (*done)(void *opaque);
+    void *opaque;
+} h2_reply;
+
+typedef void (*h2_handler)(void *arg, h2_request *req, h2_reply *reply);
+
+typedef struct {
+    uint64_t sessions;
+    uint64_t upgrades;
+    uint64_t streams;
+    uint64_t resets;
+    size_t active;
+} h2_stats;
+
+h2_backend *h2_new(h2_handler handler, void *arg);
+// closes the sessions, before the evhttp they came from is freed
+void h2_free(h2_backend *h2);
+// SETTINGS_MAX_CONCURRENT_STREAMS of new sessions, 100 by default
+void h2_set_max_streams(h2_backend *h2, uint32_t max_streams);
+// connections of http that start with the client preface become sessions
+int h2_attach(h2_backend *h2, struct evhttp *http);
+// call from the evhttp bevcb on each new bufferevent of an attached evhttp
+void h2_watch(struct bufferevent *bev);
+// answers an HTTP/1.1 request carrying Upgrade: h2c with 101 and serves it
+// as stream 1. returns -1 and leaves req alone when it is not one or the
+// upgrade fails
+int h2_upgrade(h2_backend *h2, struct evhttp_request *req,
+               const char *method);
+// GOAWAY to every session, each closes after its open streams. stats.active
+// reaches 0 when they are all gone
+void h2_drain(h2_backend *h2);
+void h2_get_stats(const h2_backend *h2, h2_stats *stats);
+
+#endif // LANYT_H2_H
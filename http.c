@@ -1,25 +1,59 @@
 
+#include "accesslog.h"
+#include "cache.h"
+#include "capture.h"
+#include "decode.h"
 #include "quickjs-libc.h"
+#include "trace.h"
 #include "util.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #define export_fn __declspec(dllexport)
 #else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #define export_fn __attribute__((visibility("default")))
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include <curl/curl.h>
 #include <cutils.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include <quickjs.h>
 
+#ifdef HTTP_OPENSSL
+#include <event2/bufferevent_ssl.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#ifdef HTTP_URING
+#include "uring.h"
+#endif
+
+#ifdef HTTP_NGHTTP2
+#include "h2.h"
+#endif
+
 enum {
     HTTP_REQ_METHOD,
     HTTP_REQ_URI,
@@ -29,11 +63,21 @@ enum {
     HTTP_REQ_COUNT,
 };
 
+typedef struct http_recycle http_recycle;
+
 // http request object
 typedef struct {
     JSContext *ctx;
     char *str_fields[HTTP_REQ_PARAMS];
     JSValue js_fields[HTTP_REQ_COUNT - HTTP_REQ_PARAMS];
+    // incoming body moved out of evhttp, always ends with '\0'
+    struct evbuffer *body_buf;
+    // outgoing binary body, an ArrayBuffer sent as is
+    JSValue body_ab;
+    // outgoing body streamed from this file
+    char *body_file;
+    // where the finalizer returns it, NULL when not recycled
+    http_recycle *recycle;
 } http_req;
 
 static const char *http_req_fields[] = {
@@ -43,17 +87,12 @@ static const char *http_req_fields[] = {
 // 只在载入时修改一次
 static JSClassID http_req_class_id = 0;
 
+static void http_req_release(http_req *req);
+
 static void http_req_finalizer(JSRuntime *rt, JSValue val) {
     http_req *req = JS_GetOpaque(val, http_req_class_id);
-    if (req) {
-        for (size_t i = 0; i < HTTP_REQ_PARAMS; ++i) {
-            js_free(req->ctx, req->str_fields[i]);
-        }
-        for (size_t i = 0; i < HTTP_REQ_COUNT - HTTP_REQ_PARAMS; ++i) {
-            JS_FreeValue(req->ctx, req->js_fields[i]);
-        }
-        js_free(req->ctx, req);
-    }
+    if (req)
+        http_req_release(req);
 }
 
 static JSClassDef http_req_class = {
@@ -91,6 +130,7 @@ static JSValue http_req_ctor(JSContext *ctx, JSValueConst new_target, int argc,
     for (int i = 0; i < HTTP_REQ_COUNT - HTTP_REQ_PARAMS; ++i) {
         req->js_fields[i] = JS_UNDEFINED;
     }
+    req->body_ab = JS_UNDEFINED;
 
     JS_SetOpaque(obj, req);
     if (argc > 0) {
@@ -112,6 +152,20 @@ fail:
     return JS_EXCEPTION;
 }
 
+// NUL-terminated body, NULL if there is none. a body spread over several
+// chains is made contiguous once, JSON parsing needs it in one piece
+static const char *http_req_body(http_req *req, size_t *len) {
+    if (req->str_fields[HTTP_REQ_BODY]) {
+        *len = strlen(req->str_fields[HTTP_REQ_BODY]);
+        return req->str_fields[HTTP_REQ_BODY];
+    }
+    if (req->body_buf) {
+        *len = evbuffer_get_length(req->body_buf) - 1;
+        return (const char *)evbuffer_pullup(req->body_buf, -1);
+    }
+    return NULL;
+}
+
 // return json object
 static JSValue http_req_get(JSContext *ctx, JSValueConst this_val, int argc,
                             JSValueConst *argv) {
@@ -130,20 +184,99 @@ static JSValue http_req_get(JSContext *ctx, JSValueConst this_val, int argc,
                                       JS_PROP_C_W_E);
         }
     }
+    if (!req->str_fields[HTTP_REQ_BODY] && req->body_buf) {
+        size_t len;
+        const char *body = http_req_body(req, &len);
+        JS_DefinePropertyValueStr(ctx, obj, http_req_fields[HTTP_REQ_BODY],
+                                  JS_NewStringLen(ctx, body, len),
+                                  JS_PROP_C_W_E);
+    }
+    if (JS_IsObject(req->body_ab)) {
+        JS_DefinePropertyValueStr(ctx, obj, http_req_fields[HTTP_REQ_BODY],
+                                  JS_DupValue(ctx, req->body_ab),
+                                  JS_PROP_C_W_E);
+    } else if (req->body_file) {
+        JSValue file = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, file, "file",
+                                  JS_NewString(ctx, req->body_file),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, http_req_fields[HTTP_REQ_BODY],
+                                  file, JS_PROP_C_W_E);
+    }
     for (size_t i = 0; i < HTTP_REQ_COUNT - HTTP_REQ_PARAMS; ++i) {
         if (!JS_IsUndefined(req->js_fields[i])) {
             JS_DefinePropertyValueStr(ctx, obj,
                                       http_req_fields[i + HTTP_REQ_PARAMS],
-                                      req->js_fields[i], JS_PROP_C_W_E);
+                                      JS_DupValue(ctx, req->js_fields[i]),
+                                      JS_PROP_C_W_E);
         }
     }
     return obj;
 }
 
+// parse the body straight from its bytes, skipping the JS string
+static JSValue http_req_json(JSContext *ctx, JSValueConst this_val, int argc,
+                             JSValueConst *argv) {
+    http_req *req = JS_GetOpaque2(ctx, this_val, http_req_class_id);
+    const char *body;
+    size_t len;
+    if (!req)
+        return JS_EXCEPTION;
+    body = http_req_body(req, &len);
+    if (!body)
+        return JS_ThrowTypeError(ctx, "json(), request has no body");
+    return JS_ParseJSON(ctx, body, len, "<body>");
+}
+
+// a body set later replaces whichever kind was set before
+static void http_req_clear_body(JSContext *ctx, http_req *req) {
+    js_free(ctx, req->str_fields[HTTP_REQ_BODY]);
+    req->str_fields[HTTP_REQ_BODY] = NULL;
+    if (req->body_buf) {
+        evbuffer_free(req->body_buf);
+        req->body_buf = NULL;
+    }
+    JS_FreeValue(ctx, req->body_ab);
+    req->body_ab = JS_UNDEFINED;
+    js_free(ctx, req->body_file);
+    req->body_file = NULL;
+}
+
+// body as ArrayBuffer or {file: path}
+static JSValue http_req_set_body(JSContext *ctx, http_req *req,
+                                 JSValueConst v) {
+    JSValue file = JS_GetPropertyStr(ctx, v, "file");
+    const char *path;
+    size_t len;
+
+    if (JS_IsString(file)) {
+        path = JS_ToCString(ctx, file);
+        JS_FreeValue(ctx, file);
+        if (!path)
+            return JS_EXCEPTION;
+        http_req_clear_body(ctx, req);
+        req->body_file = js_strdup(ctx, path);
+        JS_FreeCString(ctx, path);
+        if (!req->body_file)
+            return JS_EXCEPTION;
+        return JS_UNDEFINED;
+    }
+    JS_FreeValue(ctx, file);
+    if (!JS_GetArrayBuffer(ctx, &len, v)) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return JS_ThrowTypeError(ctx, "request([val]), val.body must be "
+                                      "string, ArrayBuffer or {file}");
+    }
+    http_req_clear_body(ctx, req);
+    req->body_ab = JS_DupValue(ctx, v);
+    return JS_UNDEFINED;
+}
+
 static JSValue http_req_set(JSContext *ctx, JSValueConst this_val, int argc,
                             JSValueConst *argv) {
     http_req *req = JS_GetOpaque2(ctx, this_val, http_req_class_id);
     JSValue v, val;
+    const char *str;
     if (!req)
         return JS_EXCEPTION;
     if (argc < 1) {
@@ -160,12 +293,33 @@ static JSValue http_req_set(JSContext *ctx, JSValueConst this_val, int argc,
         v = JS_GetPropertyStr(ctx, val, http_req_fields[i]);
         if (JS_IsUndefined(v))
             continue;
+        if (i == HTTP_REQ_BODY && JS_IsObject(v)) {
+            if (JS_IsException(http_req_set_body(ctx, req, v))) {
+                JS_FreeValue(ctx, v);
+                return JS_EXCEPTION;
+            }
+            JS_FreeValue(ctx, v);
+            continue;
+        }
         if (!JS_IsString(v)) {
+            JS_FreeValue(ctx, v);
             JS_ThrowTypeError(ctx,
                               "request([val]), val's fields must be string");
             return JS_EXCEPTION;
         }
-        req->str_fields[i] = (char *)JS_ToCString(ctx, v);
+        str = JS_ToCString(ctx, v);
+        JS_FreeValue(ctx, v);
+        if (!str)
+            return JS_EXCEPTION;
+        // freed with js_free like the fields set natively
+        if (i == HTTP_REQ_BODY)
+            http_req_clear_body(ctx, req);
+        else
+            js_free(ctx, req->str_fields[i]);
+        req->str_fields[i] = js_strdup(ctx, str);
+        JS_FreeCString(ctx, str);
+        if (!req->str_fields[i])
+            return JS_EXCEPTION;
     }
     for (int i = 0; i < HTTP_REQ_COUNT - HTTP_REQ_PARAMS; ++i) {
         v = JS_GetPropertyStr(ctx, val, http_req_fields[i + HTTP_REQ_PARAMS]);
@@ -184,8 +338,25 @@ static JSValue http_req_set(JSContext *ctx, JSValueConst this_val, int argc,
 static const JSCFunctionListEntry http_req_proto_funcs[] = {
     JS_CFUNC_DEF("get", 0, http_req_get),
     JS_CFUNC_DEF("set", 1, http_req_set),
+    JS_CFUNC_DEF("json", 0, http_req_json),
 };
 
+// curl measurements of a fetch, times in us from the start of the transfer
+typedef struct {
+    int64_t dns;
+    int64_t connect;
+    int64_t tls;
+    int64_t pretransfer;
+    int64_t ttfb;
+    int64_t total;
+    int reused;
+    // 10, 11, 20 or 30
+    int http_version;
+    int64_t bytes_up;
+    int64_t bytes_down;
+    char *url;
+} fetch_timing;
+
 // http response object
 typedef struct {
     JSContext *ctx;
@@ -193,18 +364,212 @@ typedef struct {
     char *reason;
     char *body;
     JSValue headers;
+    // serialized into the output buffer at reply time
+    JSValue json;
+    // version chosen by the handler, a match answers 304 before the body is
+    // serialized
+    char *etag;
+    // set on fetch results
+    size_t body_len;
+    const char *cache;
+    int fetched;
+    int retries;
+    int hedges;
+    // NULL for cache hits
+    fetch_timing *timing;
+    // where the finalizer returns it, NULL when not recycled
+    http_recycle *recycle;
 } http_res;
 
+// set({recycle}), free lists of request and response structs and of
+// evbuffers on the loop thread. every struct handed out holds a reference,
+// so it can outlive the server. this saves allocator calls, not GC runs:
+// the structs stay in malloc_size while they wait on a list
+struct http_recycle {
+    int refs;
+    // cleared once the server stops recycling, structs are freed then
+    int on;
+    size_t max;
+    http_req **reqs;
+    size_t reqs_len;
+    http_res **ress;
+    size_t ress_len;
+    struct evbuffer **bufs;
+    size_t bufs_len;
+    uint64_t reused;
+    uint64_t allocated;
+};
+
+// the server's while one of its handlers runs, for response() to take from
+static _Thread_local http_recycle *recycle_current;
+
+static http_recycle *recycle_new(size_t max) {
+    http_recycle *rc = calloc(1, sizeof(*rc));
+    if (!rc)
+        return NULL;
+    rc->reqs = calloc(max, sizeof(*rc->reqs));
+    rc->ress = calloc(max, sizeof(*rc->ress));
+    rc->bufs = calloc(max, sizeof(*rc->bufs));
+    if (!rc->reqs || !rc->ress || !rc->bufs) {
+        free(rc->reqs);
+        free(rc->ress);
+        free(rc->bufs);
+        free(rc);
+        return NULL;
+    }
+    rc->refs = 1;
+    rc->on = 1;
+    rc->max = max;
+    return rc;
+}
+
+static void recycle_trim(http_recycle *rc) {
+    while (rc->reqs_len) {
+        http_req *req = rc->reqs[--rc->reqs_len];
+        js_free(req->ctx, req);
+    }
+    while (rc->ress_len) {
+        http_res *res = rc->ress[--rc->ress_len];
+        js_free(res->ctx, res);
+    }
+    while (rc->bufs_len) {
+        evbuffer_free(rc->bufs[--rc->bufs_len]);
+    }
+}
+
+static void recycle_unref(http_recycle *rc) {
+    if (--rc->refs)
+        return;
+    recycle_trim(rc);
+    free(rc->reqs);
+    free(rc->ress);
+    free(rc->bufs);
+    free(rc);
+}
+
+// the server lets go, objects still out free their structs when collected
+static void recycle_drop(http_recycle *rc) {
+    rc->on = 0;
+    recycle_trim(rc);
+    recycle_unref(rc);
+}
+
+static struct evbuffer *recycle_buf_get(http_recycle *rc) {
+    if (rc && rc->bufs_len) {
+        rc->reused++;
+        return rc->bufs[--rc->bufs_len];
+    }
+    if (rc)
+        rc->allocated++;
+    return evbuffer_new();
+}
+
+// drained first, references in it are let go as usual
+static void recycle_buf_put(http_recycle *rc, struct evbuffer *buf) {
+    if (!buf)
+        return;
+    if (rc && rc->on && rc->bufs_len < rc->max) {
+        evbuffer_drain(buf, evbuffer_get_length(buf));
+        rc->bufs[rc->bufs_len++] = buf;
+        return;
+    }
+    evbuffer_free(buf);
+}
+
+// back to what js_mallocz and the constructor leave
+static void http_req_clear(http_req *req) {
+    for (size_t i = 0; i < HTTP_REQ_PARAMS; ++i) {
+        js_free(req->ctx, req->str_fields[i]);
+        req->str_fields[i] = NULL;
+    }
+    for (size_t i = 0; i < HTTP_REQ_COUNT - HTTP_REQ_PARAMS; ++i) {
+        JS_FreeValue(req->ctx, req->js_fields[i]);
+        req->js_fields[i] = JS_UNDEFINED;
+    }
+    recycle_buf_put(req->recycle, req->body_buf);
+    req->body_buf = NULL;
+    JS_FreeValue(req->ctx, req->body_ab);
+    req->body_ab = JS_UNDEFINED;
+    js_free(req->ctx, req->body_file);
+    req->body_file = NULL;
+}
+
+static void http_req_release(http_req *req) {
+    http_recycle *rc = req->recycle;
+    http_req_clear(req);
+    if (rc && rc->on && rc->reqs_len < rc->max) {
+        rc->reqs[rc->reqs_len++] = req;
+        req->recycle = NULL;
+    } else {
+        js_free(req->ctx, req);
+    }
+    if (rc)
+        recycle_unref(rc);
+}
+
+// a cleared struct for route_call
+static http_req *recycle_req_get(http_recycle *rc, JSContext *ctx) {
+    http_req *req;
+    if (rc->reqs_len) {
+        req = rc->reqs[--rc->reqs_len];
+        rc->reused++;
+    } else {
+        req = js_mallocz(ctx, sizeof(*req));
+        if (!req)
+            return NULL;
+        req->ctx = ctx;
+        for (int i = 0; i < HTTP_REQ_COUNT - HTTP_REQ_PARAMS; ++i) {
+            req->js_fields[i] = JS_UNDEFINED;
+        }
+        req->body_ab = JS_UNDEFINED;
+        rc->allocated++;
+    }
+    req->recycle = rc;
+    rc->refs++;
+    return req;
+}
+
+// back to a new response(), status 200 and nothing else
+static void http_res_clear(http_res *res) {
+    JSContext *ctx = res->ctx;
+    http_recycle *rc = res->recycle;
+
+    js_free(ctx, res->reason);
+    js_free(ctx, res->body);
+    JS_FreeValue(ctx, res->headers);
+    JS_FreeValue(ctx, res->json);
+    js_free(ctx, res->etag);
+    if (res->timing) {
+        js_free(ctx, res->timing->url);
+        js_free(ctx, res->timing);
+    }
+    memset(res, 0, sizeof(*res));
+    res->ctx = ctx;
+    res->recycle = rc;
+    res->status = 200;
+    res->headers = JS_UNDEFINED;
+    res->json = JS_UNDEFINED;
+}
+
+static void http_res_release(http_res *res) {
+    http_recycle *rc = res->recycle;
+    http_res_clear(res);
+    if (rc && rc->on && rc->ress_len < rc->max) {
+        rc->ress[rc->ress_len++] = res;
+        res->recycle = NULL;
+    } else {
+        js_free(res->ctx, res);
+    }
+    if (rc)
+        recycle_unref(rc);
+}
+
 static JSClassID http_res_class_id = 0;
 
 static void http_res_finalizer(JSRuntime *rt, JSValue val) {
     http_res *res = JS_GetOpaque(val, http_res_class_id);
-    if (res) {
-        js_free(res->ctx, res->reason);
-        js_free(res->ctx, res->body);
-        JS_FreeValue(res->ctx, res->headers);
-        js_free(res->ctx, res);
-    }
+    if (res)
+        http_res_release(res);
 }
 
 static JSClassDef http_res_class = {
@@ -232,16 +597,30 @@ static JSValue http_res_ctor(JSContext *ctx, JSValueConst new_target, int argc,
         JS_ThrowTypeError(ctx, "prototype property is not an object");
         goto fail;
     }
-    res = js_mallocz(ctx, sizeof(*res));
-    if (!res) {
-        JS_ThrowOutOfMemory(ctx);
-        goto fail;
+    if (recycle_current && recycle_current->ress_len) {
+        res = recycle_current->ress[--recycle_current->ress_len];
+        recycle_current->reused++;
+    } else {
+        res = js_mallocz(ctx, sizeof(*res));
+        if (!res) {
+            JS_ThrowOutOfMemory(ctx);
+            goto fail;
+        }
+        if (recycle_current)
+            recycle_current->allocated++;
     }
     res->ctx = ctx;
     res->status = 200;
     res->headers = JS_UNDEFINED;
+    res->json = JS_UNDEFINED;
+    if (recycle_current) {
+        res->recycle = recycle_current;
+        recycle_current->refs++;
+    }
 
     JS_SetOpaque(obj, res);
+    // the finalizer owns it from here
+    res = NULL;
     if (argc > 0) {
         if (JS_IsObject(argv[0])) {
             if (JS_IsException(http_res_set(ctx, obj, argc, argv))) {
@@ -261,6 +640,41 @@ fail:
     return JS_EXCEPTION;
 }
 
+static JSValue fetch_timing_to_obj(JSContext *ctx, const fetch_timing *t) {
+    JSValue obj = JS_NewObject(ctx);
+    if (JS_IsException(obj))
+        return obj;
+    JS_DefinePropertyValueStr(ctx, obj, "dnsUs", JS_NewInt64(ctx, t->dns),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "connectUs",
+                              JS_NewInt64(ctx, t->connect), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "tlsUs", JS_NewInt64(ctx, t->tls),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "pretransferUs",
+                              JS_NewInt64(ctx, t->pretransfer), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "ttfbUs", JS_NewInt64(ctx, t->ttfb),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "totalUs", JS_NewInt64(ctx, t->total),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "reused", JS_NewBool(ctx, t->reused),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, obj, "httpVersion",
+        JS_NewString(ctx, t->http_version == 30   ? "3"
+                          : t->http_version == 20 ? "2"
+                          : t->http_version == 10 ? "1.0"
+                                                  : "1.1"),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "bytesUp",
+                              JS_NewInt64(ctx, t->bytes_up), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "bytesDown",
+                              JS_NewInt64(ctx, t->bytes_down), JS_PROP_C_W_E);
+    if (t->url)
+        JS_DefinePropertyValueStr(ctx, obj, "url", JS_NewString(ctx, t->url),
+                                  JS_PROP_C_W_E);
+    return obj;
+}
+
 static JSValue http_res_get(JSContext *ctx, JSValueConst this_val, int argc,
                             JSValueConst *argv) {
     http_res *res = JS_GetOpaque2(ctx, this_val, http_res_class_id);
@@ -277,12 +691,34 @@ static JSValue http_res_get(JSContext *ctx, JSValueConst this_val, int argc,
         JS_DefinePropertyValueStr(
             ctx, obj, "reason", JS_NewString(ctx, res->reason), JS_PROP_C_W_E);
     if (res->body)
-        JS_DefinePropertyValueStr(ctx, obj, "body",
-                                  JS_NewString(ctx, res->body), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, obj, "body",
+            res->body_len ? JS_NewStringLen(ctx, res->body, res->body_len)
+                          : JS_NewString(ctx, res->body),
+            JS_PROP_C_W_E);
+    if (res->etag)
+        JS_DefinePropertyValueStr(ctx, obj, "etag",
+                                  JS_NewString(ctx, res->etag), JS_PROP_C_W_E);
+    if (res->cache)
+        JS_DefinePropertyValueStr(ctx, obj, "cache",
+                                  JS_NewString(ctx, res->cache), JS_PROP_C_W_E);
+    if (res->fetched) {
+        JS_DefinePropertyValueStr(ctx, obj, "retries",
+                                  JS_NewInt32(ctx, res->retries), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "hedges",
+                                  JS_NewInt32(ctx, res->hedges), JS_PROP_C_W_E);
+    }
+    if (res->timing)
+        JS_DefinePropertyValueStr(ctx, obj, "timings",
+                                  fetch_timing_to_obj(ctx, res->timing),
+                                  JS_PROP_C_W_E);
 
     if (!JS_IsUndefined(res->headers))
-        JS_DefinePropertyValueStr(ctx, obj, "headers", res->headers,
-                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "headers",
+                                  JS_DupValue(ctx, res->headers), JS_PROP_C_W_E);
+    if (!JS_IsUndefined(res->json))
+        JS_DefinePropertyValueStr(ctx, obj, "json",
+                                  JS_DupValue(ctx, res->json), JS_PROP_C_W_E);
 
     return obj;
 }
@@ -333,6 +769,7 @@ static JSValue http_res_set(JSContext *ctx, JSValueConst this_val, int argc,
         if (JS_IsString(v)) {
             js_free(ctx, res->body);
             res->body = (char *)JS_ToCString(ctx, v);
+            res->body_len = 0;
         } else {
             JS_FreeValue(ctx, v);
             JS_ThrowTypeError(ctx, "response([val]), val.body must be string");
@@ -352,12 +789,78 @@ static JSValue http_res_set(JSContext *ctx, JSValueConst this_val, int argc,
             return JS_EXCEPTION;
         }
     }
+
+    v = JS_GetPropertyStr(ctx, val, "json");
+    if (!JS_IsUndefined(v)) {
+        JS_FreeValue(ctx, res->json);
+        res->json = v;
+    }
+
+    v = JS_GetPropertyStr(ctx, val, "etag");
+    if (JS_IsString(v)) {
+        const char *str = JS_ToCString(ctx, v);
+        JS_FreeValue(ctx, v);
+        if (!str)
+            return JS_EXCEPTION;
+        js_free(ctx, res->etag);
+        res->etag = js_strdup(ctx, str);
+        JS_FreeCString(ctx, str);
+        if (!res->etag)
+            return JS_EXCEPTION;
+    } else if (!JS_IsUndefined(v)) {
+        JS_FreeValue(ctx, v);
+        JS_ThrowTypeError(ctx, "response([val]), val.etag must be string");
+        return JS_EXCEPTION;
+    }
     return JS_UNDEFINED;
 }
 
+static void json_cleanup(const void *data, size_t len, void *arg) {
+    JS_FreeCString(arg, data);
+}
+
+// stringify res->json and hand the bytes to buf by reference
+static int http_res_add_json(JSContext *ctx, http_res *res,
+                             struct evbuffer *buf) {
+    JSValue str;
+    const char *p;
+    size_t len;
+
+    str = JS_JSONStringify(ctx, res->json, JS_UNDEFINED, JS_UNDEFINED);
+    if (JS_IsException(str))
+        return -1;
+    p = JS_ToCStringLen(ctx, &len, str);
+    JS_FreeValue(ctx, str);
+    if (!p)
+        return -1;
+    if (evbuffer_add_reference(buf, p, len, json_cleanup, ctx) < 0) {
+        JS_FreeCString(ctx, p);
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+// back to a new response, then set(val) when given
+static JSValue http_res_reset(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+    http_res *res = JS_GetOpaque2(ctx, this_val, http_res_class_id);
+    if (!res)
+        return JS_EXCEPTION;
+    http_res_clear(res);
+    if (argc > 0 && !JS_IsUndefined(argv[0])) {
+        if (!JS_IsObject(argv[0]))
+            return JS_ThrowTypeError(ctx, "reset([val]), val must be object");
+        if (JS_IsException(http_res_set(ctx, this_val, argc, argv)))
+            return JS_EXCEPTION;
+    }
+    return JS_DupValue(ctx, this_val);
+}
+
 static const JSCFunctionListEntry http_res_proto_funcs[] = {
     JS_CFUNC_DEF("get", 0, http_res_get),
     JS_CFUNC_DEF("set", 1, http_res_set),
+    JS_CFUNC_DEF("reset", 1, http_res_reset),
 };
 
 // to str, like "key1=value1&key2=value2"
@@ -389,7 +892,7 @@ static JSValue params_helper(JSContext *ctx, http_req *req, char **params_str) {
         str_buf1 = js_malloc(ctx, cnt_buf1);
         if (!str_buf1)
             goto fail2;
-        urlencode(key, str_buf1 + cnt, cnt_buf1);
+        urlencode(key, str_buf1, cnt_buf1);
         cnt += cnt_buf1;
 
         cnt_buf2 = calculate_encoded_size(value) + 1;
@@ -509,57 +1012,48 @@ static JSValue ev_params_to_obj(JSContext *ctx, struct evkeyvalq *params) {
     return obj;
 }
 
-// to str, like "Header1: Value1\r\nHeader2: Value2\r\n"
+// one curl_slist entry per header, like "Header1: Value1"
 static JSValue headers_helper(JSContext *ctx, http_req *req,
-                              char **headers_str) {
-    JSValue val;
+                              struct curl_slist **list) {
+    JSValue val = JS_UNDEFINED;
+    JSValueConst headers = req->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS];
     JSPropertyEnum *tab;
     uint32_t len;
-    uint64_t cnt = 0;
-    char *header_name, *header_value;
-    if (JS_GetOwnPropertyNames(
-            ctx, &tab, &len, req->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS],
-            JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+    const char *header_name = NULL, *header_value = NULL;
+    char *line;
+    struct curl_slist *tmp;
+    size_t size;
+
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, headers,
+                               JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
         return JS_EXCEPTION;
     }
     for (uint32_t i = 0; i < len; ++i) {
-        val = JS_GetProperty(ctx,
-                             req->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS],
-                             tab[i].atom);
+        val = JS_GetProperty(ctx, headers, tab[i].atom);
         if (!JS_IsString(val)) {
             JS_ThrowTypeError(ctx, "Header's value must be a string");
-            goto fail1;
+            goto fail;
         }
-
-        header_name = (char *)JS_AtomToCString(ctx, tab[i].atom);
-        header_value = (char *)JS_ToCString(ctx, val);
-        if (!header_name || !header_value) {
+        header_name = JS_AtomToCString(ctx, tab[i].atom);
+        header_value = JS_ToCString(ctx, val);
+        if (!header_name || !header_value)
+            goto fail;
+        // 2 for ": "
+        size = strlen(header_name) + strlen(header_value) + 3;
+        line = js_malloc(ctx, size);
+        if (!line)
+            goto fail;
+        snprintf(line, size, "%s: %s", header_name, header_value);
+        tmp = curl_slist_append(*list, line);
+        js_free(ctx, line);
+        if (!tmp) {
             JS_ThrowOutOfMemory(ctx);
             goto fail;
         }
-        // 2 for ": " and 2 for "\r\n"
-        cnt += strlen(header_name) + strlen(header_value) + 5;
-        if (*headers_str) {
-            *headers_str = js_realloc(ctx, *headers_str, cnt);
-            if (!*headers_str)
-                goto fail2;
-        } else {
-            *headers_str = js_mallocz(ctx, cnt);
-            if (!*headers_str) {
-            fail2:
-                js_free(ctx, header_name);
-                js_free(ctx, header_value);
-                goto fail;
-            }
-        }
-        strcat(*headers_str, header_name);
-        strcat(*headers_str, ": ");
-        strcat(*headers_str, header_value);
-        strcat(*headers_str, "\r\n");
-
-        js_free(ctx, header_name);
-        js_free(ctx, header_value);
-
+        *list = tmp;
+        JS_FreeCString(ctx, header_name);
+        JS_FreeCString(ctx, header_value);
+        header_name = header_value = NULL;
         JS_FreeValue(ctx, val);
     }
 
@@ -569,8 +1063,9 @@ static JSValue headers_helper(JSContext *ctx, http_req *req,
     js_free(ctx, tab);
     return JS_UNDEFINED;
 fail:
+    JS_FreeCString(ctx, header_name);
+    JS_FreeCString(ctx, header_value);
     JS_FreeValue(ctx, val);
-fail1:
     for (uint32_t i = 0; i < len; ++i) {
         JS_FreeAtom(ctx, tab[i].atom);
     }
@@ -578,589 +1073,5888 @@ fail1:
     return JS_EXCEPTION;
 }
 
-static JSValue headers_to_obj(JSContext *ctx, const char *headers_str) {
+static JSValue ev_headers_to_obj(JSContext *ctx, struct evkeyvalq *headers) {
     JSValue obj = JS_UNDEFINED;
-    char *p, *q, *name, *value;
-    if (!headers_str)
+    if (!headers)
         return JS_UNDEFINED;
     obj = JS_NewObject(ctx);
     if (JS_IsException(obj))
         return JS_EXCEPTION;
-    p = (char *)headers_str;
-    while (*p) {
-        q = strchr(p, ':');
-        if (!q)
-            break;
-        name = js_mallocz(ctx, q - p + 1);
-        if (!name)
-            goto fail;
-        memcpy(name, p, q - p);
-        p = q + 1;
-        while (*p == ' ')
-            p++;
-        q = strchr(p, '\r');
-        if (!q) {
-            js_free(ctx, name);
-            break;
-        }
-        value = js_mallocz(ctx, q - p + 1);
-        if (!value) {
-            js_free(ctx, name);
-            goto fail;
-        }
-        memcpy(value, p, q - p);
-        p = q + 2;
-        JS_DefinePropertyValueStr(ctx, obj, name, JS_NewString(ctx, value),
+    for (struct evkeyval *p = headers->tqh_first; p; p = p->next.tqe_next) {
+        JS_DefinePropertyValueStr(ctx, obj, p->key, JS_NewString(ctx, p->value),
                                   JS_PROP_C_W_E);
-        js_free(ctx, name);
-        js_free(ctx, value);
     }
     return obj;
-fail:
-    JS_FreeValue(ctx, obj);
-    return JS_EXCEPTION;
 }
 
-static JSValue ev_headers_to_obj(JSContext *ctx, struct evkeyvalq *headers) {
-    JSValue obj = JS_UNDEFINED;
-    if (!headers)
-        return JS_UNDEFINED;
-    obj = JS_NewObject(ctx);
-    if (JS_IsException(obj))
+// request object built from plain strings, for handlers that do not run on
+// an evhttp request. body, ending with '\0', is taken over
+static JSValue http_req_new(JSContext *ctx, const char *method,
+                            const char *uri, struct evkeyvalq *headers,
+                            struct evbuffer *body) {
+    http_req *req_obj;
+    struct evkeyvalq params;
+    JSValue obj;
+
+    req_obj = js_mallocz(ctx, sizeof(*req_obj));
+    if (!req_obj) {
+        if (body)
+            evbuffer_free(body);
         return JS_EXCEPTION;
-    for (struct evkeyval *p = headers->tqh_first; p; p = p->next.tqe_next) {
-        JS_DefinePropertyValueStr(ctx, obj, p->key, JS_NewString(ctx, p->value),
-                                  JS_PROP_C_W_E);
     }
+    req_obj->ctx = ctx;
+    req_obj->str_fields[HTTP_REQ_METHOD] = js_strdup(ctx, method);
+    req_obj->str_fields[HTTP_REQ_URI] = js_strdup(ctx, uri);
+    evhttp_parse_query_str(uri, &params);
+    req_obj->js_fields[HTTP_REQ_PARAMS - HTTP_REQ_PARAMS] =
+        ev_params_to_obj(ctx, &params);
+    evhttp_clear_headers(&params);
+    req_obj->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS] =
+        ev_headers_to_obj(ctx, headers);
+    req_obj->body_buf = body;
+    req_obj->body_ab = JS_UNDEFINED;
+
+    obj = JS_NewObjectClass(ctx, http_req_class_id);
+    if (JS_IsException(obj)) {
+        JS_FreeValue(ctx, req_obj->js_fields[0]);
+        JS_FreeValue(ctx, req_obj->js_fields[1]);
+        for (size_t i = 0; i < HTTP_REQ_PARAMS; ++i) {
+            js_free(ctx, req_obj->str_fields[i]);
+        }
+        if (req_obj->body_buf)
+            evbuffer_free(req_obj->body_buf);
+        js_free(ctx, req_obj);
+        return JS_EXCEPTION;
+    }
+    JS_SetOpaque(obj, req_obj);
     return obj;
 }
 
+static int opt_number(JSContext *ctx, JSValueConst obj, const char *name,
+                      double *out);
+static int opt_bool(JSContext *ctx, JSValueConst obj, const char *name,
+                    int *out);
+
+// one transfer of http_fetch
+typedef struct {
+    CURL *curl;
+    struct curl_slist *headers;
+    char *params_str;
+    struct evbuffer *body;
+    struct evkeyvalq resp_headers;
+    int done;
+    CURLcode result;
+    // streamed upload of req.body.file
+    FILE *upload;
+} fetch_xfer;
+
+// per call options of http_fetch
+typedef struct {
+    int64_t timeout_ms;
+    int64_t connect_timeout_ms;
+    int retries;
+    int64_t backoff_ms;
+    // -1 off, 0 waits for the observed p95
+    int64_t hedge_ms;
+    // CURL_HTTP_VERSION_*
+    long http_version;
+} fetch_opts;
+
+// latency of successful fetches, feeds the p95 hedge delay
+static pthread_mutex_t fetch_lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static util_hist fetch_lat;
+
 static size_t write_callback(void *ptr, size_t size, size_t nmemb, void *data) {
-    http_res *res = data;
+    fetch_xfer *x = data;
     size_t realsize = size * nmemb;
-    res->body = js_realloc(res->ctx, res->body, realsize + 1);
-    if (!res->body)
+    if (evbuffer_add(x->body, ptr, realsize) < 0)
         return 0;
-    memcpy(res->body, ptr, realsize);
-    res->body[realsize] = 0;
     return realsize;
 }
 
+// called once per header line, a status line starts a new response
 static size_t header_callback(void *ptr, size_t size, size_t nmemb,
                               void *data) {
-    char *res = data;
-    size_t realsize = size * nmemb;
-    res = realloc(res, realsize + 1);
-    if (!res)
+    fetch_xfer *x = data;
+    size_t realsize = size * nmemb, n = realsize;
+    const char *line = ptr, *colon, *value;
+    char name[256], *copy;
+
+    if (n >= 5 && !memcmp(line, "HTTP/", 5)) {
+        evhttp_clear_headers(&x->resp_headers);
+        return realsize;
+    }
+    while (n && (line[n - 1] == '\r' || line[n - 1] == '\n'))
+        n--;
+    colon = memchr(line, ':', n);
+    if (!colon || colon - line >= (ptrdiff_t)sizeof(name))
+        return realsize;
+    memcpy(name, line, colon - line);
+    name[colon - line] = '\0';
+    value = colon + 1;
+    while (value < line + n && *value == ' ')
+        value++;
+    copy = malloc(line + n - value + 1);
+    if (!copy)
         return 0;
-    memcpy(res, ptr, realsize);
-    res[realsize] = 0;
+    memcpy(copy, value, line + n - value);
+    copy[line + n - value] = '\0';
+    evhttp_add_header(&x->resp_headers, name, copy);
+    free(copy);
     return realsize;
 }
 
-static JSValue http_fetch(JSContext *ctx, JSValueConst this_val, int argc,
-                          JSValueConst *argv) {
-    http_req *req;
-    http_res *res;
-    CURL *curl;
-    CURLcode ret;
-    struct curl_slist *headers = NULL;
-    char *headers_str, *params_str, *back_headers_str = NULL;
-    JSValue obj;
-    JSValueConst args[1];
+// curl hands us its own upload buffer, memory stays flat for any file size
+static size_t read_callback(char *ptr, size_t size, size_t nmemb,
+                            void *data) {
+    fetch_xfer *x = data;
+    size_t n = fread(ptr, size, nmemb, x->upload);
+    if (n < nmemb && ferror(x->upload))
+        return CURL_READFUNC_ABORT;
+    return n * size;
+}
 
-    if (argc < 1)
-        return JS_ThrowTypeError(ctx, "fetch([req]), req must be object");
-    req = JS_GetOpaque2(ctx, argv[0], http_req_class_id);
-    if (!req)
-        return JS_ThrowTypeError(ctx, "fetch([req]), req must be object");
+// rewinds the file when curl resends the body, after a redirect for example
+static int seek_callback(void *data, curl_off_t offset, int origin) {
+    fetch_xfer *x = data;
+#ifdef _WIN32
+    return _fseeki64(x->upload, offset, origin) ? CURL_SEEKFUNC_CANTSEEK
+                                                 : CURL_SEEKFUNC_OK;
+#else
+    return fseeko(x->upload, (off_t)offset, origin) ? CURL_SEEKFUNC_CANTSEEK
+                                                     : CURL_SEEKFUNC_OK;
+#endif
+}
 
-    curl = curl_easy_init();
-    if (!curl)
-        return JS_ThrowTypeError(ctx, "curl_easy_init failed");
+static void fetch_xfer_free(JSContext *ctx, fetch_xfer *x) {
+    if (x->curl)
+        curl_easy_cleanup(x->curl);
+    if (x->upload)
+        fclose(x->upload);
+    curl_slist_free_all(x->headers);
+    js_free(ctx, x->params_str);
+    if (x->body)
+        evbuffer_free(x->body);
+    evhttp_clear_headers(&x->resp_headers);
+}
 
-    if (req->str_fields[HTTP_REQ_URI]) {
-        curl_easy_setopt(curl, CURLOPT_URL, req->str_fields[HTTP_REQ_URI]);
-    } else {
-        curl_easy_cleanup(curl);
-        return JS_ThrowTypeError(ctx, "fetch([req]), req.uri must be string");
-    }
+static int fetch_xfer_open(JSContext *ctx, const char *path, fetch_xfer *x) {
+    int64_t size;
 
-    if (req->str_fields[HTTP_REQ_METHOD])
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST,
-                         req->str_fields[HTTP_REQ_METHOD]);
-    if (req->str_fields[HTTP_REQ_BODY])
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS,
-                         req->str_fields[HTTP_REQ_BODY]);
+    x->upload = fopen(path, "rb");
+    if (!x->upload) {
+        JS_ThrowTypeError(ctx, "fetch, cannot open %s", path);
+        return -1;
+    }
+#ifdef _WIN32
+    _fseeki64(x->upload, 0, SEEK_END);
+    size = _ftelli64(x->upload);
+#else
+    fseeko(x->upload, 0, SEEK_END);
+    size = (int64_t)ftello(x->upload);
+#endif
+    rewind(x->upload);
+    curl_easy_setopt(x->curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(x->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)size);
+    curl_easy_setopt(x->curl, CURLOPT_READFUNCTION, read_callback);
+    curl_easy_setopt(x->curl, CURLOPT_READDATA, x);
+    curl_easy_setopt(x->curl, CURLOPT_SEEKFUNCTION, seek_callback);
+    curl_easy_setopt(x->curl, CURLOPT_SEEKDATA, x);
+    return 0;
+}
 
+static int fetch_xfer_init(JSContext *ctx, http_req *req, const fetch_opts *o,
+                           http_cached *cached, int64_t deadline,
+                           fetch_xfer *x) {
+    const char *body;
+    size_t body_len;
+    struct curl_slist *tmp;
+    char line[512];
+    int64_t left;
+
+    memset(x, 0, sizeof(*x));
+    x->resp_headers.tqh_last = &x->resp_headers.tqh_first;
+    x->body = evbuffer_new();
+    x->curl = curl_easy_init();
+    if (!x->body || !x->curl) {
+        JS_ThrowInternalError(ctx, "curl_easy_init failed");
+        return -1;
+    }
+    curl_easy_setopt(x->curl, CURLOPT_URL, req->str_fields[HTTP_REQ_URI]);
+    if (req->str_fields[HTTP_REQ_METHOD])
+        curl_easy_setopt(x->curl, CURLOPT_CUSTOMREQUEST,
+                         req->str_fields[HTTP_REQ_METHOD]);
+    body = http_req_body(req, &body_len);
+    if (!body && JS_IsObject(req->body_ab))
+        body = (const char *)JS_GetArrayBuffer(ctx, &body_len, req->body_ab);
+    if (body) {
+        curl_easy_setopt(x->curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t)body_len);
+        curl_easy_setopt(x->curl, CURLOPT_POSTFIELDS, body);
+    } else if (req->body_file) {
+        if (fetch_xfer_open(ctx, req->body_file, x) < 0)
+            return -1;
+    }
     if (!JS_IsUndefined(req->js_fields[HTTP_REQ_PARAMS - HTTP_REQ_PARAMS])) {
-        if (JS_IsException(params_helper(ctx, req, &params_str))) {
-            curl_easy_cleanup(curl);
-            return JS_EXCEPTION;
-        }
-        if (params_str) {
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, params_str);
-        }
+        if (JS_IsException(params_helper(ctx, req, &x->params_str)))
+            return -1;
+        if (x->params_str)
+            curl_easy_setopt(x->curl, CURLOPT_POSTFIELDS, x->params_str);
     }
-    if (!JS_IsUndefined(req->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS])) {
-        if (JS_IsException(headers_helper(ctx, req, &headers_str))) {
-            js_free(ctx, params_str);
-            curl_easy_cleanup(curl);
-            return JS_EXCEPTION;
+    if (!JS_IsUndefined(req->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS]) &&
+        JS_IsException(headers_helper(ctx, req, &x->headers)))
+        return -1;
+    if (cached) {
+        // stale entry, ask the origin whether it is still valid
+        if (cached->etag) {
+            snprintf(line, sizeof(line), "If-None-Match: %s", cached->etag);
+            if ((tmp = curl_slist_append(x->headers, line)))
+                x->headers = tmp;
         }
-        if (headers_str) {
-            headers = curl_slist_append(headers, headers_str);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        if (cached->last_modified) {
+            snprintf(line, sizeof(line), "If-Modified-Since: %s",
+                     cached->last_modified);
+            if ((tmp = curl_slist_append(x->headers, line)))
+                x->headers = tmp;
         }
     }
+    if (x->headers)
+        curl_easy_setopt(x->curl, CURLOPT_HTTPHEADER, x->headers);
 
-    res = js_mallocz(ctx, sizeof(*res));
-    if (!res) {
-        JS_ThrowOutOfMemory(ctx);
-        return JS_EXCEPTION;
+    curl_easy_setopt(x->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(x->curl, CURLOPT_HTTP_VERSION, o->http_version);
+    // rather wait for a connection that can multiplex than open another,
+    // hedges turn it back off
+    curl_easy_setopt(x->curl, CURLOPT_PIPEWAIT, 1L);
+    if (deadline) {
+        // 0 would mean no timeout, callers stop at the deadline
+        left = (deadline - util_now_us() + 999) / 1000;
+        curl_easy_setopt(x->curl, CURLOPT_TIMEOUT_MS,
+                         left > 0 ? (long)left : 1L);
     }
-    res->ctx = ctx;
-    res->body = NULL;
-    res->headers = JS_UNDEFINED;
+    if (o->connect_timeout_ms)
+        curl_easy_setopt(x->curl, CURLOPT_CONNECTTIMEOUT_MS,
+                         (long)o->connect_timeout_ms);
+    curl_easy_setopt(x->curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(x->curl, CURLOPT_WRITEDATA, x);
+    curl_easy_setopt(x->curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(x->curl, CURLOPT_HEADERDATA, x);
+    return 0;
+}
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, res);
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, back_headers_str);
+static JSValue fetch_res_new(JSContext *ctx, long status,
+                             struct evkeyvalq *headers, const char *body,
+                             size_t body_len, const char *cache) {
+    http_res *res;
+    JSValue obj;
 
-    ret = curl_easy_perform(curl);
-    if (ret != CURLE_OK) {
-        JS_ThrowTypeError(ctx, "curl_easy_perform failed: %s",
-                          curl_easy_strerror(ret));
-        js_free(ctx, params_str);
-        js_free(ctx, headers_str);
+    res = js_mallocz(ctx, sizeof(*res));
+    if (!res)
+        return JS_ThrowOutOfMemory(ctx);
+    res->ctx = ctx;
+    res->status = (int)status;
+    res->headers = ev_headers_to_obj(ctx, headers);
+    res->json = JS_UNDEFINED;
+    res->cache = cache;
+    res->fetched = 1;
+    res->body = js_malloc(ctx, body_len + 1);
+    if (!res->body || JS_IsException(res->headers))
         goto fail;
-    }
-
-    js_free(ctx, params_str);
-    js_free(ctx, headers_str);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &res->status);
-    if (back_headers_str) {
-        res->headers = headers_to_obj(ctx, back_headers_str);
-        free(back_headers_str);
-    }
-
-    curl_easy_cleanup(curl);
+    memcpy(res->body, body, body_len);
+    res->body[body_len] = '\0';
+    res->body_len = body_len;
 
     obj = JS_NewObjectClass(ctx, http_res_class_id);
     if (JS_IsException(obj))
         goto fail;
     JS_SetOpaque(obj, res);
-    args[0] = obj;
-
-    curl_slist_free_all(headers);
-
     return obj;
 fail:
     js_free(ctx, res->body);
     JS_FreeValue(ctx, res->headers);
     js_free(ctx, res);
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
     return JS_EXCEPTION;
 }
 
-typedef struct http_server_cb http_server_cb;
-typedef struct {
-    JSContext *ctx;
-    struct event_base *base;
-    struct evhttp *http;
-    JSValue *callbacks;
-    size_t callbacks_len;
-    http_server_cb *cbs;
-    size_t cbs_len;
-#ifdef _WIN32
-    WSADATA wsaData;
-#endif
-} http_server;
+// request header of any case, free with JS_FreeCString. NULL when not set
+static const char *fetch_header(JSContext *ctx, http_req *req,
+                                const char *name, size_t name_len) {
+    JSValueConst headers = req->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS];
+    JSPropertyEnum *tab;
+    uint32_t len;
+    const char *key, *value = NULL;
+    JSValue val;
 
-struct http_server_cb {
-    JSContext *ctx;
-    http_server *server;
-    JSValue server_this;
-    size_t callback_index;
-};
+    if (!JS_IsObject(headers))
+        return NULL;
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, headers,
+                               JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return NULL;
+    }
+    for (uint32_t i = 0; i < len && !value; ++i) {
+        key = JS_AtomToCString(ctx, tab[i].atom);
+        if (key && strlen(key) == name_len &&
+            !evutil_ascii_strncasecmp(key, name, name_len)) {
+            val = JS_GetProperty(ctx, headers, tab[i].atom);
+            if (JS_IsString(val))
+                value = JS_ToCString(ctx, val);
+            JS_FreeValue(ctx, val);
+        }
+        JS_FreeCString(ctx, key);
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        JS_FreeAtom(ctx, tab[i].atom);
+    }
+    js_free(ctx, tab);
+    return value;
+}
 
-static JSClassID http_server_class_id = 0;
+// only plain GETs go through the cache, params are sent as a body. the
+// cache is shared, so nothing sent with credentials
+static int fetch_cacheable(JSContext *ctx, http_req *req) {
+    static const char *creds[] = {"Authorization", "Cookie",
+                                  "Proxy-Authorization"};
+    const char *method = req->str_fields[HTTP_REQ_METHOD];
+    const char *value;
+    size_t len;
 
-static void http_server_finalizer(JSRuntime *rt, JSValue val) {
-    http_server *server = JS_GetOpaque(val, http_server_class_id);
-    if (server) {
-        evhttp_free(server->http);
-        event_base_free(server->base);
-        for (size_t i = 0; i < server->callbacks_len; ++i) {
-            JS_FreeValue(server->ctx, server->callbacks[i]);
+    if ((method && strcmp(method, "GET")) || http_req_body(req, &len) ||
+        JS_IsObject(req->body_ab) || req->body_file ||
+        !JS_IsUndefined(req->js_fields[HTTP_REQ_PARAMS - HTTP_REQ_PARAMS]))
+        return 0;
+    for (size_t i = 0; i < countof(creds); ++i) {
+        if ((value = fetch_header(ctx, req, creds[i], strlen(creds[i])))) {
+            JS_FreeCString(ctx, value);
+            return 0;
         }
-        js_free(server->ctx, server->callbacks);
-        js_free(server->ctx, server->cbs);
-        js_free(server->ctx, server);
-#ifdef _WIN32
-        WSACleanup();
-#endif
     }
+    return 1;
 }
 
-static JSClassDef http_server_class = {
-    .class_name = "server",
-    .finalizer = http_server_finalizer,
-};
+// uri and then a line per header named in vary with the request's value,
+// so each variant has its own entry
+static char *fetch_cache_key(JSContext *ctx, http_req *req, const char *uri,
+                             const char *vary) {
+    struct evbuffer *buf = evbuffer_new();
+    const char *value;
+    char *key = NULL;
+    size_t len;
 
-static JSValue http_server_ctor(JSContext *ctx, JSValueConst new_target,
-                                int argc, JSValueConst *argv) {
-    JSValue obj = JS_UNDEFINED;
-    http_server *server = NULL;
-    JSValue proto;
-    JSClassID class_id;
+    if (!buf)
+        return NULL;
+    evbuffer_add(buf, uri, strlen(uri));
+    for (const char *p = vary; p && *p; p += len) {
+        p += strspn(p, " \t,");
+        len = strcspn(p, " \t,");
+        if (!len)
+            continue;
+        value = fetch_header(ctx, req, p, len);
+        evbuffer_add_printf(buf, "\n%.*s:%s", (int)len, p, value ? value : "");
+        JS_FreeCString(ctx, value);
+    }
+    len = evbuffer_get_length(buf);
+    if ((key = malloc(len + 1))) {
+        evbuffer_remove(buf, key, len);
+        key[len] = '\0';
+    }
+    evbuffer_free(buf);
+    return key;
+}
 
-    class_id = http_server_class_id;
-    proto = JS_GetPropertyStr(ctx, new_target, "prototype");
-    if (JS_IsException(proto))
-        goto fail;
-    if (JS_IsObject(proto)) {
-        obj = JS_NewObjectProtoClass(ctx, proto, class_id);
-        if (JS_IsException(obj))
-            goto fail;
+// per host latency, enabled by fetchSet({hostStats: true})
+typedef struct fetch_host {
+    struct fetch_host *next;
+    char *host;
+    uint64_t reused;
+    util_hist total;
+    util_hist ttfb;
+    util_hist connect;
+} fetch_host;
+
+#define FETCH_MAX_HOSTS 256
+
+static pthread_mutex_t fetch_hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+static fetch_host *fetch_hosts;
+static int fetch_hosts_len;
+static int fetch_hosts_on;
+
+static void fetch_timing_read(CURL *curl, fetch_timing *t) {
+    curl_off_t v;
+    long l;
+    char *url = NULL;
+
+#define TIME_INFO(info, field)                                                 \
+    if (curl_easy_getinfo(curl, info, &v) == CURLE_OK)                         \
+        t->field = (int64_t)v;
+    TIME_INFO(CURLINFO_NAMELOOKUP_TIME_T, dns)
+    TIME_INFO(CURLINFO_CONNECT_TIME_T, connect)
+    TIME_INFO(CURLINFO_APPCONNECT_TIME_T, tls)
+    TIME_INFO(CURLINFO_PRETRANSFER_TIME_T, pretransfer)
+    TIME_INFO(CURLINFO_STARTTRANSFER_TIME_T, ttfb)
+    TIME_INFO(CURLINFO_TOTAL_TIME_T, total)
+    TIME_INFO(CURLINFO_SIZE_UPLOAD_T, bytes_up)
+    TIME_INFO(CURLINFO_SIZE_DOWNLOAD_T, bytes_down)
+#undef TIME_INFO
+    // no new connection means an old one was reused
+    if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &l) == CURLE_OK)
+        t->reused = l == 0;
+    if (curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &l) == CURLE_OK)
+        t->http_version = l == CURL_HTTP_VERSION_3   ? 30
+                          : l == CURL_HTTP_VERSION_2_0 ? 20
+                          : l == CURL_HTTP_VERSION_1_0 ? 10
+                                                       : 11;
+    if (curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &l) == CURLE_OK)
+        t->bytes_up += l;
+    if (curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &l) == CURLE_OK)
+        t->bytes_down += l;
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    // only valid until the handle is cleaned up
+    t->url = url;
+}
+
+static void fetch_hosts_add(const fetch_timing *t) {
+    struct evhttp_uri *uri;
+    const char *host;
+    fetch_host *h;
+
+    if (!fetch_hosts_on || !t->url)
+        return;
+    uri = evhttp_uri_parse(t->url);
+    if (!uri)
+        return;
+    host = evhttp_uri_get_host(uri);
+    pthread_mutex_lock(&fetch_hosts_lock);
+    for (h = fetch_hosts; h && host && strcmp(h->host, host); h = h->next)
+        ;
+    if (!h && host && fetch_hosts_len < FETCH_MAX_HOSTS &&
+        (h = calloc(1, sizeof(*h)))) {
+        if ((h->host = strdup(host))) {
+            h->next = fetch_hosts;
+            fetch_hosts = h;
+            fetch_hosts_len++;
+        } else {
+            free(h);
+            h = NULL;
+        }
+    }
+    if (h) {
+        util_hist_add(&h->total, (uint64_t)t->total);
+        util_hist_add(&h->ttfb, (uint64_t)t->ttfb);
+        if (t->reused)
+            h->reused++;
+        else
+            util_hist_add(&h->connect, (uint64_t)t->connect);
+    }
+    pthread_mutex_unlock(&fetch_hosts_lock);
+    evhttp_uri_free(uri);
+}
+
+static void fetch_hosts_clear(void) {
+    fetch_host *h, *next;
+    pthread_mutex_lock(&fetch_hosts_lock);
+    for (h = fetch_hosts; h; h = next) {
+        next = h->next;
+        free(h->host);
+        free(h);
+    }
+    fetch_hosts = NULL;
+    fetch_hosts_len = 0;
+    pthread_mutex_unlock(&fetch_hosts_lock);
+}
+
+static JSValue hist_to_obj(JSContext *ctx, const util_hist *hist) {
+    JSValue obj = JS_NewObject(ctx);
+    if (JS_IsException(obj))
+        return obj;
+    JS_DefinePropertyValueStr(ctx, obj, "count", JS_NewInt64(ctx, hist->count),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, obj, "avg",
+        JS_NewInt64(ctx, hist->count ? hist->sum / hist->count : 0),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, obj, "p50", JS_NewInt64(ctx, util_hist_quantile(hist, 0.5)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, obj, "p95", JS_NewInt64(ctx, util_hist_quantile(hist, 0.95)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, obj, "p99", JS_NewInt64(ctx, util_hist_quantile(hist, 0.99)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "max", JS_NewInt64(ctx, hist->max),
+                              JS_PROP_C_W_E);
+    return obj;
+}
+
+static int fetch_idempotent(http_req *req) {
+    static const char *methods[] = {"GET", "HEAD", "PUT", "DELETE", "OPTIONS"};
+    const char *method = req->str_fields[HTTP_REQ_METHOD];
+    if (!method)
+        return 1;
+    for (size_t i = 0; i < countof(methods); ++i) {
+        if (!strcmp(method, methods[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static int fetch_opts_parse(JSContext *ctx, JSValueConst obj, fetch_opts *o) {
+    JSValue v;
+    double d;
+    int ret;
+
+    memset(o, 0, sizeof(*o));
+    o->backoff_ms = 50;
+    o->hedge_ms = -1;
+    o->http_version = CURL_HTTP_VERSION_2TLS;
+    if (JS_IsUndefined(obj))
+        return 0;
+    if (!JS_IsObject(obj)) {
+        JS_ThrowTypeError(ctx, "fetch([req], [opts]), opts must be object");
+        return -1;
+    }
+    if ((ret = opt_number(ctx, obj, "timeoutMs", &d)) < 0)
+        return -1;
+    if (ret)
+        o->timeout_ms = (int64_t)d;
+    if ((ret = opt_number(ctx, obj, "connectTimeoutMs", &d)) < 0)
+        return -1;
+    if (ret)
+        o->connect_timeout_ms = (int64_t)d;
+    if ((ret = opt_number(ctx, obj, "retries", &d)) < 0)
+        return -1;
+    if (ret)
+        o->retries = d > 0 ? (int)d : 0;
+    if ((ret = opt_number(ctx, obj, "retryBackoffMs", &d)) < 0)
+        return -1;
+    if (ret)
+        o->backoff_ms = (int64_t)d;
+
+    // number of ms, or "p95"
+    v = JS_GetPropertyStr(ctx, obj, "hedgeMs");
+    if (JS_IsString(v)) {
+        const char *str = JS_ToCString(ctx, v);
+        ret = str && !strcmp(str, "p95");
+        JS_FreeCString(ctx, str);
+        JS_FreeValue(ctx, v);
+        if (!ret) {
+            JS_ThrowTypeError(ctx, "opts.hedgeMs must be number or \"p95\"");
+            return -1;
+        }
+        o->hedge_ms = 0;
     } else {
-        JS_ThrowTypeError(ctx, "prototype property is not an object");
-        goto fail;
+        JS_FreeValue(ctx, v);
+        if ((ret = opt_number(ctx, obj, "hedgeMs", &d)) < 0)
+            return -1;
+        if (ret)
+            o->hedge_ms = d > 0 ? (int64_t)d : 0;
     }
-    server = js_mallocz(ctx, sizeof(*server));
-    if (!server) {
+
+    // "2" negotiates h2 over tls, "h2c" assumes the origin speaks it
+    v = JS_GetPropertyStr(ctx, obj, "http");
+    if (!JS_IsUndefined(v)) {
+        const char *str = JS_IsString(v) ? JS_ToCString(ctx, v) : NULL;
+        JS_FreeValue(ctx, v);
+        if (str && !strcmp(str, "1.1"))
+            o->http_version = CURL_HTTP_VERSION_1_1;
+        else if (str && !strcmp(str, "2"))
+            o->http_version = CURL_HTTP_VERSION_2TLS;
+        else if (str && !strcmp(str, "h2c"))
+            o->http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+        else
+            o->http_version = 0;
+        JS_FreeCString(ctx, str);
+        if (!o->http_version) {
+            JS_ThrowTypeError(ctx, "opts.http must be \"1.1\", \"2\" or "
+                                   "\"h2c\"");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// when to send the duplicate request, -1 for never
+static int64_t fetch_hedge_at(const fetch_opts *o, int64_t start) {
+    uint64_t p95 = 0;
+    if (o->hedge_ms < 0)
+        return -1;
+    if (o->hedge_ms > 0)
+        return start + o->hedge_ms * 1000;
+    pthread_mutex_lock(&fetch_lat_lock);
+    // too few samples to tell the tail
+    if (fetch_lat.count >= 20)
+        p95 = util_hist_quantile(&fetch_lat, 0.95);
+    pthread_mutex_unlock(&fetch_lat_lock);
+    return p95 ? start + (int64_t)p95 : -1;
+}
+
+// per thread, the connections it caches outlive a fetch. transfers to one
+// origin that run side by side share an HTTP/2 connection
+static pthread_key_t fetch_multi_key;
+static pthread_once_t fetch_multi_once = PTHREAD_ONCE_INIT;
+static long fetch_max_streams = 100;
+static struct {
+    uint64_t requests;
+    uint64_t multiplexed;
+    uint64_t connections;
+} fetch_h2;
+
+static void fetch_multi_free(void *multi) { curl_multi_cleanup(multi); }
+
+static void fetch_multi_key_new(void) {
+    pthread_key_create(&fetch_multi_key, fetch_multi_free);
+}
+
+static CURLM *fetch_multi(void) {
+    static _Thread_local long streams;
+    long max = __atomic_load_n(&fetch_max_streams, __ATOMIC_RELAXED);
+    CURLM *multi;
+
+    pthread_once(&fetch_multi_once, fetch_multi_key_new);
+    multi = pthread_getspecific(fetch_multi_key);
+    if (!multi) {
+        if (!(multi = curl_multi_init()))
+            return NULL;
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        pthread_setspecific(fetch_multi_key, multi);
+        streams = 0;
+    }
+    // fetchSet may have changed it since
+    if (streams != max) {
+        curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max);
+        streams = max;
+    }
+    return multi;
+}
+
+// a request that ran next to others of the same fetchAll on an HTTP/2
+// connection it did not open counts as multiplexed. one fetch after another
+// on a kept connection does not
+static void fetch_h2_add(const fetch_timing *t, int overlapped) {
+    if (t->http_version != 20)
+        return;
+    __atomic_fetch_add(&fetch_h2.requests, 1, __ATOMIC_RELAXED);
+    if (!t->reused)
+        __atomic_fetch_add(&fetch_h2.connections, 1, __ATOMIC_RELAXED);
+    else if (overlapped)
+        __atomic_fetch_add(&fetch_h2.multiplexed, 1, __ATOMIC_RELAXED);
+}
+
+// curl's measurements onto a fetched response, overlapped when other
+// transfers were in flight at the same time
+static void fetch_res_timing(JSContext *ctx, JSValue obj, CURL *curl,
+                             int overlapped) {
+    fetch_timing timing = {0};
+    http_res *res;
+
+    fetch_timing_read(curl, &timing);
+    fetch_hosts_add(&timing);
+    fetch_h2_add(&timing, overlapped);
+    if (!(res = JS_GetOpaque(obj, http_res_class_id)))
+        return;
+    res->timing = js_malloc(ctx, sizeof(timing));
+    if (res->timing) {
+        *res->timing = timing;
+        res->timing->url = timing.url ? js_strdup(ctx, timing.url) : NULL;
+    }
+}
+
+// one attempt, maybe hedged. returns the index of the winning transfer,
+// -1 when all failed (*err set), -2 on a js exception
+static int fetch_attempt(JSContext *ctx, http_req *req, const fetch_opts *o,
+                         http_cached *cached, int64_t deadline,
+                         fetch_xfer x[2], int *n, int *hedges, CURLcode *err) {
+    CURLM *multi;
+    CURLMsg *msg;
+    int running, left, winner = -1, done = 0, i;
+    int64_t start = util_now_us(), hedge_at, now, wait;
+
+    multi = fetch_multi();
+    if (!multi) {
         JS_ThrowOutOfMemory(ctx);
+        return -2;
+    }
+    hedge_at = fetch_hedge_at(o, start);
+    if (deadline && start >= deadline) {
+        *err = CURLE_OPERATION_TIMEDOUT;
+        return -1;
+    }
+    if (fetch_xfer_init(ctx, req, o, cached, deadline, &x[(*n)++]) < 0) {
+        winner = -2;
+        goto done;
+    }
+    curl_multi_add_handle(multi, x[0].curl);
+    *err = CURLE_OK;
+
+    for (;;) {
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            for (i = 0; i < *n && x[i].curl != msg->easy_handle; ++i)
+                ;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            x[i].done = 1;
+            done++;
+            if (msg->data.result != CURLE_OK)
+                *err = msg->data.result;
+            else if (winner < 0)
+                winner = i;
+        }
+        if (winner >= 0)
+            break;
+        now = util_now_us();
+        if (hedge_at >= 0 && *n < 2 && now >= hedge_at &&
+            (!deadline || now < deadline)) {
+            if (fetch_xfer_init(ctx, req, o, cached, deadline, &x[(*n)++]) <
+                0) {
+                winner = -2;
+                break;
+            }
+            // on a connection of its own, not behind the slow one
+            curl_easy_setopt(x[1].curl, CURLOPT_PIPEWAIT, 0L);
+            curl_easy_setopt(x[1].curl, CURLOPT_FRESH_CONNECT, 1L);
+            curl_multi_add_handle(multi, x[1].curl);
+            (*hedges)++;
+            continue;
+        }
+        // everything sent has failed, no point in hedging further
+        if (done == *n)
+            break;
+        wait = 1000;
+        if (hedge_at >= 0 && *n < 2 && (hedge_at - now) / 1000 + 1 < wait)
+            wait = (hedge_at - now) / 1000 + 1;
+        curl_multi_poll(multi, NULL, 0, (int)wait, NULL);
+    }
+
+    if (winner >= 0) {
+        pthread_mutex_lock(&fetch_lat_lock);
+        util_hist_add(&fetch_lat, (uint64_t)(util_now_us() - start));
+        pthread_mutex_unlock(&fetch_lat_lock);
+    }
+done:
+    // cancels the loser
+    for (i = 0; i < *n; ++i) {
+        if (x[i].curl && !x[i].done)
+            curl_multi_remove_handle(multi, x[i].curl);
+    }
+    return winner;
+}
+
+// full jitter, never past the deadline
+static void fetch_backoff(const fetch_opts *o, int attempt, int64_t deadline) {
+    static _Thread_local uint64_t seed;
+    int64_t cap = o->backoff_ms * 1000 << (attempt < 16 ? attempt : 16), us;
+
+    if (!seed)
+        seed = (uint64_t)util_now_us() | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    us = cap > 0 ? (int64_t)(seed % (uint64_t)cap) : 0;
+    if (deadline && util_now_us() + us > deadline)
+        us = deadline - util_now_us();
+    if (us > 0)
+        util_sleep_us(us);
+}
+
+static JSValue http_fetch(JSContext *ctx, JSValueConst this_val, int argc,
+                          JSValueConst *argv) {
+    http_req *req;
+    http_cached *cached = NULL, *entry;
+    fetch_xfer x[2];
+    fetch_opts o;
+    CURLcode err = CURLE_OK;
+    long status = 0;
+    int state = CACHE_BYPASS, n = 0, winner, retries = 0, hedges = 0;
+    int64_t deadline = 0, trace_start = 0;
+    const char *uri, *resp_vary;
+    char *key = NULL, *vary = NULL;
+    http_res *res;
+    JSValue obj;
+
+    if (argc < 1)
+        return JS_ThrowTypeError(ctx, "fetch([req]), req must be object");
+    req = JS_GetOpaque2(ctx, argv[0], http_req_class_id);
+    if (!req)
+        return JS_ThrowTypeError(ctx, "fetch([req]), req must be object");
+    uri = req->str_fields[HTTP_REQ_URI];
+    if (!uri)
+        return JS_ThrowTypeError(ctx, "fetch([req]), req.uri must be string");
+    if (fetch_opts_parse(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, &o) < 0)
+        return JS_EXCEPTION;
+    // duplicates of a non idempotent request are not safe
+    if (!fetch_idempotent(req)) {
+        o.retries = 0;
+        o.hedge_ms = -1;
+    }
+    if (o.timeout_ms > 0)
+        deadline = util_now_us() + o.timeout_ms * 1000;
+
+    // child span of the handler that calls it
+    if (trace_active())
+        trace_start = util_now_us();
+
+    if (fetch_cacheable(ctx, req)) {
+        vary = cache_vary_get(uri);
+        if ((key = fetch_cache_key(ctx, req, uri, vary)))
+            state = cache_begin(key, &cached);
+        if (state == CACHE_HIT) {
+            obj = fetch_res_new(ctx, cached->status, &cached->headers,
+                                cached->body, cached->body_len, "hit");
+            cache_unref(cached);
+            free(key);
+            free(vary);
+            if (trace_start)
+                trace_span("fetch", trace_start, util_now_us(), uri);
+            return obj;
+        }
+    }
+
+    for (;;) {
+        winner = fetch_attempt(ctx, req, &o, cached, deadline, x, &n, &hedges,
+                               &err);
+        if (winner == -2)
+            goto fail;
+        if (winner >= 0) {
+            curl_easy_getinfo(x[winner].curl, CURLINFO_RESPONSE_CODE, &status);
+            if (status != 502 && status != 503 && status != 504)
+                break;
+        }
+        if (retries >= o.retries ||
+            (deadline && util_now_us() >= deadline))
+            break;
+        for (int i = 0; i < n; ++i)
+            fetch_xfer_free(ctx, &x[i]);
+        n = 0;
+        fetch_backoff(&o, retries++, deadline);
+    }
+    if (winner < 0) {
+        JS_ThrowTypeError(ctx, "curl_easy_perform failed: %s",
+                          curl_easy_strerror(err));
         goto fail;
     }
-#ifdef _WIN32
-    WSAStartup(MAKEWORD(2, 2), &server->wsaData);
-#endif
-    server->ctx = ctx;
-    server->base = event_base_new();
-    if (!server->base) {
-        JS_ThrowInternalError(ctx, "event_base_new failed");
+
+    if (state != CACHE_MISS) {
+        obj = fetch_res_new(ctx, status, &x[winner].resp_headers,
+                            (const char *)evbuffer_pullup(x[winner].body, -1),
+                            evbuffer_get_length(x[winner].body), NULL);
+    } else if (status == 304 && cached) {
+        cache_refresh(cached, &x[winner].resp_headers);
+        cache_end(key, cached);
+        obj = fetch_res_new(ctx, cached->status, &cached->headers,
+                            cached->body, cached->body_len, "revalidated");
+    } else {
+        entry = cache_entry_new(status, &x[winner].resp_headers,
+                                (const char *)evbuffer_pullup(x[winner].body, -1),
+                                evbuffer_get_length(x[winner].body));
+        resp_vary = evhttp_find_header(&x[winner].resp_headers, "Vary");
+        if ((!resp_vary) != (!vary) ||
+            (resp_vary && strcmp(resp_vary, vary))) {
+            // keyed on other headers, whoever waits fetches on their own
+            cache_end(key, NULL);
+            cache_vary_set(uri, resp_vary);
+            free(key);
+            key = fetch_cache_key(ctx, req, uri, resp_vary);
+        }
+        if (key)
+            cache_end(key, entry);
+        if (entry)
+            obj = fetch_res_new(ctx, entry->status, &entry->headers,
+                                entry->body, entry->body_len, "miss");
+        else
+            obj = JS_ThrowOutOfMemory(ctx);
+        cache_unref(entry);
+    }
+    fetch_res_timing(ctx, obj, x[winner].curl, 0);
+    if ((res = JS_GetOpaque(obj, http_res_class_id))) {
+        res->retries = retries;
+        res->hedges = hedges;
+    }
+    cache_unref(cached);
+    for (int i = 0; i < n; ++i)
+        fetch_xfer_free(ctx, &x[i]);
+    free(key);
+    free(vary);
+    if (trace_start)
+        trace_span("fetch", trace_start, util_now_us(), uri);
+    return obj;
+fail:
+    if (state == CACHE_MISS)
+        cache_end(key, NULL);
+    free(key);
+    free(vary);
+    cache_unref(cached);
+    for (int i = 0; i < n; ++i)
+        fetch_xfer_free(ctx, &x[i]);
+    if (trace_start)
+        trace_span("fetch", trace_start, util_now_us(), uri);
+    return JS_EXCEPTION;
+}
+
+// runs all of reqs at once on this thread's multi handle, so requests to one
+// origin are multiplexed over a single HTTP/2 connection. the cache, retries
+// and hedging are left out, like Promise.all the first failure throws
+static JSValue http_fetch_all(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+    fetch_xfer *x = NULL;
+    fetch_opts o;
+    CURLM *multi;
+    CURLMsg *msg;
+    JSValue arr = JS_UNDEFINED, v, obj;
+    http_req *req;
+    int64_t len = 0, n = 0, deadline = 0, trace_start = 0;
+    int running, left, done = 0, i;
+    long status;
+
+    if (argc < 1 || !JS_IsArray(ctx, argv[0]))
+        return JS_ThrowTypeError(ctx, "fetchAll([reqs]), reqs must be array");
+    if (JS_ToInt64(ctx, &len, JS_GetPropertyStr(ctx, argv[0], "length")))
+        return JS_EXCEPTION;
+    if (fetch_opts_parse(ctx, argc > 1 ? argv[1] : JS_UNDEFINED, &o) < 0)
+        return JS_EXCEPTION;
+    if (o.timeout_ms > 0)
+        deadline = util_now_us() + o.timeout_ms * 1000;
+    if (trace_active())
+        trace_start = util_now_us();
+    if (!(multi = fetch_multi()) ||
+        !(x = js_mallocz(ctx, (len ? len : 1) * sizeof(*x)))) {
+        JS_ThrowOutOfMemory(ctx);
         goto fail;
     }
-    server->http = evhttp_new(server->base);
-    if (!server->http) {
-        JS_ThrowInternalError(ctx, "evhttp_new failed");
+
+    for (; n < len; ++n) {
+        v = JS_GetPropertyUint32(ctx, argv[0], (uint32_t)n);
+        req = JS_GetOpaque(v, http_req_class_id);
+        JS_FreeValue(ctx, v);
+        if (!req || !req->str_fields[HTTP_REQ_URI]) {
+            JS_ThrowTypeError(ctx, "fetchAll, reqs[%lld] must be request",
+                              (long long)n);
+            goto fail;
+        }
+        if (fetch_xfer_init(ctx, req, &o, NULL, deadline, &x[n]) < 0) {
+            n++;
+            goto fail;
+        }
+        curl_multi_add_handle(multi, x[n].curl);
+    }
+    while (done < n) {
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            for (i = 0; i < n && x[i].curl != msg->easy_handle; ++i)
+                ;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            x[i].done = 1;
+            x[i].result = msg->data.result;
+            done++;
+        }
+        if (done < n)
+            curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (x[i].result != CURLE_OK) {
+            JS_ThrowTypeError(ctx, "fetchAll, reqs[%d] failed: %s", i,
+                              curl_easy_strerror(x[i].result));
+            goto fail;
+        }
+    }
+    arr = JS_NewArray(ctx);
+    if (JS_IsException(arr))
+        goto fail;
+    for (i = 0; i < n; ++i) {
+        status = 0;
+        curl_easy_getinfo(x[i].curl, CURLINFO_RESPONSE_CODE, &status);
+        obj = fetch_res_new(ctx, status, &x[i].resp_headers,
+                            (const char *)evbuffer_pullup(x[i].body, -1),
+                            evbuffer_get_length(x[i].body), NULL);
+        if (JS_IsException(obj))
+            goto fail;
+        fetch_res_timing(ctx, obj, x[i].curl, n > 1);
+        JS_SetPropertyUint32(ctx, arr, (uint32_t)i, obj);
+    }
+    for (i = 0; i < n; ++i)
+        fetch_xfer_free(ctx, &x[i]);
+    js_free(ctx, x);
+    if (trace_start)
+        trace_span("fetchAll", trace_start, util_now_us(), NULL);
+    return arr;
+fail:
+    JS_FreeValue(ctx, arr);
+    for (i = 0; i < n; ++i) {
+        if (x[i].curl && !x[i].done)
+            curl_multi_remove_handle(multi, x[i].curl);
+        fetch_xfer_free(ctx, &x[i]);
+    }
+    js_free(ctx, x);
+    if (trace_start)
+        trace_span("fetchAll", trace_start, util_now_us(), NULL);
+    return JS_EXCEPTION;
+}
+
+// module level fetch options, like {cache: {maxBytes}}
+static JSValue http_fetch_set(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+    JSValue cache;
+    double d;
+    int ret, on;
+
+    if (argc < 1 || !JS_IsObject(argv[0]))
+        return JS_ThrowTypeError(ctx, "fetchSet([val]), val must be object");
+    cache = JS_GetPropertyStr(ctx, argv[0], "cache");
+    if (JS_IsObject(cache)) {
+        ret = opt_number(ctx, cache, "maxBytes", &d);
+        JS_FreeValue(ctx, cache);
+        if (ret < 0)
+            return JS_EXCEPTION;
+        cache_configure(ret ? (size_t)d : 0);
+    } else if (JS_IsBool(cache) || JS_IsNull(cache)) {
+        // false/null turns it off
+        if (!JS_ToBool(ctx, cache))
+            cache_configure(0);
+    } else if (!JS_IsUndefined(cache)) {
+        JS_FreeValue(ctx, cache);
+        return JS_ThrowTypeError(ctx, "fetchSet([val]), val.cache must be "
+                                      "object");
+    }
+    if (opt_bool(ctx, argv[0], "hostStats", &on)) {
+        // turning it off drops what was collected
+        if (!on)
+            fetch_hosts_clear();
+        fetch_hosts_on = on;
+    }
+    // streams per HTTP/2 connection, each thread picks it up on its next fetch
+    if ((ret = opt_number(ctx, argv[0], "maxStreams", &d)) < 0)
+        return JS_EXCEPTION;
+    if (ret)
+        __atomic_store_n(&fetch_max_streams, d >= 1 ? (long)d : 1,
+                         __ATOMIC_RELAXED);
+    return JS_UNDEFINED;
+}
+
+static JSValue http_fetch_stats(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv) {
+    JSValue obj, cache, h2;
+    cache_stats st;
+
+    cache_get_stats(&st);
+    obj = JS_NewObject(ctx);
+    if (JS_IsException(obj))
+        return JS_EXCEPTION;
+    cache = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, cache, "hits", JS_NewInt64(ctx, st.hits),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "misses", JS_NewInt64(ctx, st.misses),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "revalidated",
+                              JS_NewInt64(ctx, st.revalidated), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "coalesced",
+                              JS_NewInt64(ctx, st.coalesced), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, cache, "hitRatio",
+        JS_NewFloat64(ctx, st.hits + st.misses
+                               ? (double)st.hits / (st.hits + st.misses)
+                               : 0),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "bytesSaved",
+                              JS_NewInt64(ctx, st.bytes_saved), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "entries",
+                              JS_NewInt64(ctx, st.entries), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "bytes", JS_NewInt64(ctx, st.bytes),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, cache, "maxBytes",
+                              JS_NewInt64(ctx, st.max_bytes), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "cache", cache, JS_PROP_C_W_E);
+
+    h2 = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(
+        ctx, h2, "requests",
+        JS_NewInt64(ctx, __atomic_load_n(&fetch_h2.requests, __ATOMIC_RELAXED)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, h2, "multiplexed",
+        JS_NewInt64(ctx,
+                    __atomic_load_n(&fetch_h2.multiplexed, __ATOMIC_RELAXED)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, h2, "connections",
+        JS_NewInt64(ctx,
+                    __atomic_load_n(&fetch_h2.connections, __ATOMIC_RELAXED)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, h2, "maxStreams",
+        JS_NewInt64(ctx, __atomic_load_n(&fetch_max_streams, __ATOMIC_RELAXED)),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "http2", h2, JS_PROP_C_W_E);
+
+    if (fetch_hosts_on) {
+        JSValue hosts = JS_NewObject(ctx), h;
+        pthread_mutex_lock(&fetch_hosts_lock);
+        for (fetch_host *fh = fetch_hosts; fh; fh = fh->next) {
+            h = JS_NewObject(ctx);
+            JS_DefinePropertyValueStr(ctx, h, "reused",
+                                      JS_NewInt64(ctx, fh->reused),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, h, "totalUs",
+                                      hist_to_obj(ctx, &fh->total),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, h, "ttfbUs",
+                                      hist_to_obj(ctx, &fh->ttfb),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, h, "connectUs",
+                                      hist_to_obj(ctx, &fh->connect),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, hosts, fh->host, h, JS_PROP_C_W_E);
+        }
+        pthread_mutex_unlock(&fetch_hosts_lock);
+        JS_DefinePropertyValueStr(ctx, obj, "hosts", hosts, JS_PROP_C_W_E);
+    }
+    return obj;
+}
+
+// read obj[name] as number, 0 when absent, -1 with exception
+static int opt_number(JSContext *ctx, JSValueConst obj, const char *name,
+                      double *out) {
+    JSValue v = JS_GetPropertyStr(ctx, obj, name);
+    if (JS_IsUndefined(v))
+        return 0;
+    if (!JS_IsNumber(v) || JS_ToFloat64(ctx, out, v)) {
+        JS_FreeValue(ctx, v);
+        JS_ThrowTypeError(ctx, "%s must be number", name);
+        return -1;
+    }
+    return 1;
+}
+
+static int opt_bool(JSContext *ctx, JSValueConst obj, const char *name,
+                    int *out) {
+    JSValue v = JS_GetPropertyStr(ctx, obj, name);
+    if (JS_IsUndefined(v))
+        return 0;
+    *out = JS_ToBool(ctx, v);
+    JS_FreeValue(ctx, v);
+    return 1;
+}
+
+enum {
+    // handler supplied tags only
+    ETAG_TAG = 1,
+    // and a hash of the body otherwise
+    ETAG_HASH,
+};
+
+#define ETAG_MAX 80
+
+// W/"tag" from a handler's version, quoted tags are kept as they are
+static void etag_from_tag(char *out, const char *tag) {
+    if (tag[0] == '"' || !strncmp(tag, "W/\"", 3))
+        snprintf(out, ETAG_MAX, "%s", tag);
+    else
+        snprintf(out, ETAG_MAX, "W/\"%.64s\"", tag);
+}
+
+static void etag_from_hash(char *out, uint64_t hash) {
+    snprintf(out, ETAG_MAX, "W/\"%016llx\"", (unsigned long long)hash);
+}
+
+static uint64_t etag_hash_buffer(struct evbuffer *buf) {
+    struct evbuffer_iovec stack[16], *v = stack;
+    util_xxh64_state st;
+    int n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+
+    if (n > 16 && !(v = malloc(n * sizeof(*v))))
+        return 0;
+    n = evbuffer_peek(buf, -1, NULL, v, n);
+    util_xxh64_init(&st, 0);
+    for (int i = 0; i < n; ++i)
+        util_xxh64_update(&st, v[i].iov_base, v[i].iov_len);
+    if (v != stack)
+        free(v);
+    return util_xxh64_digest(&st);
+}
+
+// weak comparison against every entry of an If-None-Match list
+static int etag_match(const char *inm, const char *etag) {
+    size_t len;
+    const char *q;
+
+    if (!strncmp(etag, "W/", 2))
+        etag += 2;
+    len = strlen(etag);
+    while (*inm) {
+        while (*inm == ' ' || *inm == '\t' || *inm == ',')
+            inm++;
+        if (*inm == '*')
+            return 1;
+        if (!strncmp(inm, "W/", 2))
+            inm += 2;
+        if (!strncmp(inm, etag, len) &&
+            (!inm[len] || inm[len] == ',' || inm[len] == ' ' ||
+             inm[len] == '\t'))
+            return 1;
+        if (*inm == '"' && (q = strchr(inm + 1, '"')))
+            inm = q + 1;
+        while (*inm && *inm != ',')
+            inm++;
+    }
+    return 0;
+}
+
+// serialized response, owns plain malloc memory so it is not tied to a context
+typedef struct {
+    int status;
+    char *reason;
+    struct evkeyvalq headers;
+    char *body;
+    size_t body_len;
+} http_res_data;
+
+static void http_res_data_free(http_res_data *data) {
+    if (!data)
+        return;
+    free(data->reason);
+    evhttp_clear_headers(&data->headers);
+    free(data->body);
+    free(data);
+}
+
+// status, reason, headers and body of res are copied out once. etag is
+// ETAG_* for a GET or HEAD, then inm is the request's If-None-Match
+static http_res_data *http_res_data_new(JSContext *ctx, http_res *res,
+                                        int etag, const char *inm) {
+    http_res_data *data;
+    JSPropertyEnum *tab = NULL;
+    uint32_t len = 0;
+    JSValue val;
+    const char *name, *value;
+    char tag[ETAG_MAX];
+
+    data = calloc(1, sizeof(*data));
+    if (!data) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    data->headers.tqh_last = &data->headers.tqh_first;
+    data->status = res->status;
+    if (res->reason && !(data->reason = strdup(res->reason)))
+        goto oom;
+    if (etag && res->status == 200 && res->etag) {
+        etag_from_tag(tag, res->etag);
+        if (evhttp_add_header(&data->headers, "ETag", tag) < 0)
+            goto oom;
+        if (inm && etag_match(inm, tag)) {
+            data->status = 304;
+            free(data->reason);
+            data->reason = NULL;
+        }
+    }
+    if (data->status == 304) {
+        // revalidated, the body is not serialized at all
+    } else if (!JS_IsUndefined(res->json)) {
+        struct evbuffer *buf = evbuffer_new();
+        if (!buf)
+            goto oom;
+        if (http_res_add_json(ctx, res, buf) < 0) {
+            evbuffer_free(buf);
+            goto fail;
+        }
+        data->body_len = evbuffer_get_length(buf);
+        data->body = malloc(data->body_len + 1);
+        if (!data->body) {
+            evbuffer_free(buf);
+            goto oom;
+        }
+        evbuffer_remove(buf, data->body, data->body_len);
+        data->body[data->body_len] = '\0';
+        evbuffer_free(buf);
+        evhttp_add_header(&data->headers, "Content-Type", "application/json");
+    } else if (res->body) {
+        data->body_len = strlen(res->body);
+        data->body = malloc(data->body_len + 1);
+        if (!data->body)
+            goto oom;
+        memcpy(data->body, res->body, data->body_len + 1);
+    }
+    if (etag == ETAG_HASH && data->status == 200 && !res->etag) {
+        etag_from_hash(tag, util_xxh64(data->body ? data->body : "",
+                                       data->body_len, 0));
+        if (evhttp_add_header(&data->headers, "ETag", tag) < 0)
+            goto oom;
+        if (inm && etag_match(inm, tag)) {
+            data->status = 304;
+            free(data->reason);
+            data->reason = NULL;
+            free(data->body);
+            data->body = NULL;
+            data->body_len = 0;
+        }
+    }
+    if (JS_IsUndefined(res->headers))
+        return data;
+
+    if (JS_GetOwnPropertyNames(ctx, &tab, &len, res->headers,
+                               JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) < 0)
+        goto fail;
+    for (uint32_t i = 0; i < len; ++i) {
+        val = JS_GetProperty(ctx, res->headers, tab[i].atom);
+        if (!JS_IsString(val)) {
+            JS_FreeValue(ctx, val);
+            JS_ThrowTypeError(ctx, "Header's value must be a string");
+            goto fail;
+        }
+        name = JS_AtomToCString(ctx, tab[i].atom);
+        value = JS_ToCString(ctx, val);
+        JS_FreeValue(ctx, val);
+        if (name && !JS_IsUndefined(res->json) &&
+            !evutil_ascii_strcasecmp(name, "Content-Type"))
+            evhttp_remove_header(&data->headers, "Content-Type");
+        if (!name || !value ||
+            evhttp_add_header(&data->headers, name, value) < 0) {
+            JS_FreeCString(ctx, name);
+            JS_FreeCString(ctx, value);
+            JS_ThrowTypeError(ctx, "invalid header");
+            goto fail;
+        }
+        JS_FreeCString(ctx, name);
+        JS_FreeCString(ctx, value);
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        JS_FreeAtom(ctx, tab[i].atom);
+    }
+    js_free(ctx, tab);
+    return data;
+oom:
+    JS_ThrowOutOfMemory(ctx);
+fail:
+    for (uint32_t i = 0; i < len; ++i) {
+        JS_FreeAtom(ctx, tab[i].atom);
+    }
+    js_free(ctx, tab);
+    http_res_data_free(data);
+    return NULL;
+}
+
+static void res_data_cleanup(const void *data, size_t len, void *arg) {
+    http_res_data_free(arg);
+}
+
+// the body is referenced, not copied. with own set data is freed once evhttp
+// is done with it
+static void http_res_data_send(struct evhttp_request *req,
+                               http_res_data *data, struct evbuffer *buf,
+                               int own) {
+    struct evkeyvalq *out = evhttp_request_get_output_headers(req);
+
+    for (struct evkeyval *p = data->headers.tqh_first; p; p = p->next.tqe_next) {
+        evhttp_add_header(out, p->key, p->value);
+    }
+    if (data->body_len)
+        evbuffer_add_reference(buf, data->body, data->body_len,
+                               own ? res_data_cleanup : NULL, data);
+    evhttp_send_reply(req, data->status, data->reason, buf);
+    // left untouched when the connection is already gone
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+    if (own && !data->body_len)
+        http_res_data_free(data);
+}
+
+typedef struct http_server_cb http_server_cb;
+typedef struct http_pool http_pool;
+static void pool_free(http_pool *pool);
+typedef struct http_proxy http_proxy;
+static void proxy_free(http_proxy *px);
+
+// one bound socket, evhttp owns the fd
+typedef struct {
+    char *name;
+    int tls;
+    evutil_socket_t fd;
+    struct evhttp_bound_socket *bound;
+    // unlinked when the server goes away
+    char *unix_path;
+} http_listener;
+
+// an incoming connection that sent a request, found again by its evcon
+typedef struct server_conn {
+    struct server_conn *next;
+    struct evhttp_connection *evcon;
+    void *server;
+} server_conn;
+
+enum {
+    SCHED_HIGH,
+    SCHED_NORMAL,
+    SCHED_LOW,
+    SCHED_COUNT,
+};
+
+static const char *sched_names[] = {"high", "normal", "low"};
+
+// a parsed request waiting for its turn, evhttp keeps req alive until the
+// reply even when the client goes away
+typedef struct sched_item {
+    struct sched_item *next;
+    struct evhttp_request *req;
+    http_server_cb *cb;
+    int64_t queued_at;
+} sched_item;
+
+typedef struct {
+    // queued in the routes of this class
+    size_t len;
+    int weight;
+    size_t max_queue;
+    // 0 waits forever
+    int64_t deadline_us;
+    // smooth weighted round robin credit
+    int64_t current;
+    uint64_t served;
+    uint64_t rejected;
+    uint64_t expired;
+    uint64_t cancelled;
+    util_hist wait;
+} sched_class;
+
+typedef struct {
+    JSContext *ctx;
+    struct event_base *base;
+    struct evhttp *http;
+    // tls listeners, shares routes with http
+    struct evhttp *https;
+#ifdef HTTP_OPENSSL
+    SSL_CTX *ssl_ctx;
+    struct {
+        uint64_t handshakes;
+        uint64_t resumed;
+        uint64_t ktls;
+    } tls;
+#endif
+    http_listener *listeners;
+    size_t listeners_len;
+    // open connections by evcon, a drain closes the idle ones
+    struct {
+        server_conn **buckets;
+        size_t cap;
+        size_t len;
+    } conns;
+    // dispatch returns once nothing is in flight or at the deadline
+    struct {
+        int on;
+        int64_t deadline;
+        struct event *ev;
+        uint64_t idle_closed;
+    } drain;
+    // handoff() waits on a unix socket for the next process
+    struct {
+        evutil_socket_t fd;
+        char *path;
+        struct event *ev;
+        evutil_socket_t peer;
+        struct event *peer_ev;
+        int64_t timeout_us;
+        uint64_t sent;
+    } handoff;
+    // HTTP_BACKEND_*, switched back when io_uring cannot be used
+    int backend;
+#ifdef HTTP_URING
+    uring_backend *uring;
+#endif
+#ifdef HTTP_NGHTTP2
+    // sessions already open outlive turning http2 off
+    h2_backend *h2;
+    int http2;
+#endif
+    JSValue *callbacks;
+    size_t callbacks_len;
+    http_server_cb **cbs;
+    size_t cbs_len;
+    struct http_server_fixed **fixed;
+    size_t fixed_len;
+    http_proxy **proxies;
+    size_t proxies_len;
+    // reused for every fixed reply, evhttp_send_reply drains it
+    struct evbuffer *fixed_buf;
+    // thread cpu time after which the running handler is interrupted
+    int64_t deadline;
+    int interrupted;
+    // interrupt polls, the clock is read every INTERRUPT_CLOCK_EVERY
+    unsigned polls;
+    // event loop stall watchdog, the thread reads the atomic fields
+    struct {
+        struct event *beat_ev;
+        int64_t interval_us;
+        int64_t threshold_us;
+        int64_t expected;
+        int64_t last_beat;
+        util_hist lag;
+        uint64_t stalls;
+        // the stalled route, asks the interrupt handler for its js stack
+        http_server_cb *capture;
+        int stop;
+        int running;
+        pthread_t thread;
+        http_server_cb *current;
+        const char *last_route;
+        int64_t last_stall_us;
+        char *last_stack;
+    } watchdog;
+    // inbound Content-Encoding, off hands the body over as it was sent
+    struct {
+        int off;
+        decode_limits limits;
+        uint64_t requests;
+        uint64_t encoded_bytes;
+        uint64_t decoded_bytes;
+        uint64_t rejected;
+    } decompress;
+    // per class queues, on once a route has a priority
+    struct {
+        int on;
+        struct event *ev;
+        sched_class classes[SCHED_COUNT];
+    } sched;
+    size_t inflight;
+    int workers;
+    http_pool *pool;
+    // set({recycle}), NULL when off
+    http_recycle *recycle;
+    // gc scheduling
+    struct {
+        size_t threshold;
+        // requests since the threshold was last put on top of the heap
+        uint32_t since_arm;
+        uint32_t every;
+        int idle;
+        int metrics;
+        uint32_t pending;
+        struct event *idle_ev;
+        uint64_t runs;
+        int64_t pause_total_us;
+        int64_t pause_max_us;
+        uint64_t samples;
+        int64_t growth_total;
+        int64_t growth_max;
+    } gc;
+#ifdef _WIN32
+    WSADATA wsaData;
+#endif
+} http_server;
+
+// the handler belongs to the runtime, this is the server that installed the
+// current one on this thread
+static _Thread_local http_server *interrupt_owner;
+
+struct http_server_cb {
+    JSContext *ctx;
+    http_server *server;
+    JSValue server_this;
+    size_t callback_index;
+    char *path;
+    // options
+    int64_t budget_us;
+    int offload;
+    size_t offload_route;
+    // ETAG_TAG, or ETAG_HASH to tag every 200 reply with a body hash
+    int etag;
+    // SCHED_*, used once the scheduler is on
+    int priority;
+    // its requests waiting in the class, and its share of the class
+    sched_item *queue_head, *queue_tail;
+    int weight;
+    int64_t current;
+    // stats
+    uint64_t requests;
+    uint64_t aborted;
+    uint64_t not_modified;
+};
+
+// only GET and HEAD are revalidated
+static int etag_kind(http_server_cb *cb, const char *method) {
+    if (strcmp(method, "GET") && strcmp(method, "HEAD"))
+        return 0;
+    return cb->etag;
+}
+
+typedef struct http_server_fixed {
+    http_server *server;
+    http_res_data *data;
+    char *path;
+} http_server_fixed;
+
+static JSClassID http_server_class_id = 0;
+
+enum {
+    HTTP_BACKEND_LIBEVENT,
+    HTTP_BACKEND_URING,
+};
+
+enum {
+    HTTP_PRIO_HIGH,
+    HTTP_PRIO_DEFAULT,
+    HTTP_PRIO_IDLE,
+    HTTP_PRIO_COUNT,
+};
+
+static void watchdog_stop(http_server *server) {
+    if (server->watchdog.running) {
+        __atomic_store_n(&server->watchdog.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(server->watchdog.thread, NULL);
+        server->watchdog.running = 0;
+    }
+    if (server->watchdog.beat_ev) {
+        event_free(server->watchdog.beat_ev);
+        server->watchdog.beat_ev = NULL;
+    }
+    free(server->watchdog.last_stack);
+    server->watchdog.last_stack = NULL;
+}
+
+static void handoff_close(http_server *server);
+
+static void http_server_finalizer(JSRuntime *rt, JSValue val) {
+    http_server *server = JS_GetOpaque(val, http_server_class_id);
+    if (server) {
+        watchdog_stop(server);
+        if (server->sched.ev)
+            event_free(server->sched.ev);
+        for (size_t i = 0; i < server->cbs_len; ++i) {
+            for (sched_item *it = server->cbs[i]->queue_head, *next; it;
+                 it = next) {
+                next = it->next;
+                free(it);
+            }
+        }
+#ifdef HTTP_URING
+        uring_stop(server->uring);
+#endif
+#ifdef HTTP_NGHTTP2
+        h2_free(server->h2);
+#endif
+        if (server->drain.ev)
+            event_free(server->drain.ev);
+        handoff_close(server);
+        evhttp_free(server->http);
+        if (server->https)
+            evhttp_free(server->https);
+        // closecb has taken every connection out by now
+        for (size_t i = 0; i < server->conns.cap; ++i) {
+            for (server_conn *c = server->conns.buckets[i], *next; c;
+                 c = next) {
+                next = c->next;
+                free(c);
+            }
+        }
+        free(server->conns.buckets);
+#ifdef HTTP_OPENSSL
+        if (server->ssl_ctx)
+            SSL_CTX_free(server->ssl_ctx);
+#endif
+        for (size_t i = 0; i < server->listeners_len; ++i) {
+#ifndef _WIN32
+            if (server->listeners[i].unix_path)
+                unlink(server->listeners[i].unix_path);
+#endif
+            js_free(server->ctx, server->listeners[i].unix_path);
+            js_free(server->ctx, server->listeners[i].name);
+        }
+        js_free(server->ctx, server->listeners);
+        pool_free(server->pool);
+        if (server->recycle)
+            recycle_drop(server->recycle);
+        for (size_t i = 0; i < server->proxies_len; ++i) {
+            proxy_free(server->proxies[i]);
+        }
+        js_free(server->ctx, server->proxies);
+        if (server->gc.idle_ev)
+            event_free(server->gc.idle_ev);
+        event_base_free(server->base);
+        for (size_t i = 0; i < server->callbacks_len; ++i) {
+            JS_FreeValue(server->ctx, server->callbacks[i]);
+        }
+        js_free(server->ctx, server->callbacks);
+        for (size_t i = 0; i < server->cbs_len; ++i) {
+            js_free(server->ctx, server->cbs[i]->path);
+            js_free(server->ctx, server->cbs[i]);
+        }
+        js_free(server->ctx, server->cbs);
+        // another server may have taken it over since
+        if (interrupt_owner == server) {
+            JS_SetInterruptHandler(rt, NULL, NULL);
+            interrupt_owner = NULL;
+        }
+        for (size_t i = 0; i < server->fixed_len; ++i) {
+            http_res_data_free(server->fixed[i]->data);
+            js_free(server->ctx, server->fixed[i]->path);
+            js_free(server->ctx, server->fixed[i]);
+        }
+        js_free(server->ctx, server->fixed);
+        if (server->fixed_buf)
+            evbuffer_free(server->fixed_buf);
+        js_free(server->ctx, server);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+}
+
+static JSClassDef http_server_class = {
+    .class_name = "server",
+    .finalizer = http_server_finalizer,
+};
+
+// requests between two looks at the heap, a collection QuickJS ran on its
+// own puts its 1.5x rule back in the meantime
+#define GC_ARM_EVERY 1024
+
+// lets the heap grow by gc.threshold from here before QuickJS collects.
+// JS_ComputeMemoryUsage walks the heap, so this runs after a collection
+// and every GC_ARM_EVERY requests, never per request
+static void gc_arm(http_server *server) {
+    JSRuntime *rt = JS_GetRuntime(server->ctx);
+    JSMemoryUsage usage;
+
+    server->gc.since_arm = 0;
+    if (!server->gc.threshold)
+        return;
+    JS_ComputeMemoryUsage(rt, &usage);
+    JS_SetGCThreshold(rt, usage.malloc_size + server->gc.threshold);
+}
+
+static void gc_run(http_server *server) {
+    int64_t start = util_now_us(), pause;
+    JS_RunGC(JS_GetRuntime(server->ctx));
+    pause = util_now_us() - start;
+    server->gc.pending = 0;
+    server->gc.runs++;
+    server->gc.pause_total_us += pause;
+    if (pause > server->gc.pause_max_us)
+        server->gc.pause_max_us = pause;
+    if (server->gc.threshold)
+        gc_arm(server);
+}
+
+// lowest priority, only runs when nothing else is active
+static void gc_idle_cb(evutil_socket_t fd, short what, void *arg) {
+    http_server *server = arg;
+    if (!server->inflight && server->gc.pending)
+        gc_run(server);
+}
+
+static size_t conn_hash(const struct evhttp_connection *evcon, size_t cap) {
+    return (size_t)(((uint64_t)(uintptr_t)evcon * 0x9e3779b97f4a7c15ULL) >>
+                    32) &
+           (cap - 1);
+}
+
+static server_conn **conn_find(http_server *server,
+                               const struct evhttp_connection *evcon) {
+    server_conn **p = &server->conns.buckets[conn_hash(evcon,
+                                                       server->conns.cap)];
+    while (*p && (*p)->evcon != evcon)
+        p = &(*p)->next;
+    return p;
+}
+
+static void conn_closed(struct evhttp_connection *evcon, void *arg) {
+    server_conn *c = arg;
+    http_server *server = c->server;
+    server_conn **p = conn_find(server, evcon);
+    if (*p) {
+        *p = c->next;
+        server->conns.len--;
+    }
+    free(c);
+}
+
+static int conn_grow(http_server *server) {
+    size_t cap = server->conns.cap ? server->conns.cap * 2 : 256, h;
+    server_conn **tab = calloc(cap, sizeof(*tab)), *c, *next;
+    if (!tab)
+        return -1;
+    for (size_t i = 0; i < server->conns.cap; ++i) {
+        for (c = server->conns.buckets[i]; c; c = next) {
+            next = c->next;
+            h = conn_hash(c->evcon, cap);
+            c->next = tab[h];
+            tab[h] = c;
+        }
+    }
+    free(server->conns.buckets);
+    server->conns.buckets = tab;
+    server->conns.cap = cap;
+    return 0;
+}
+
+// a reply sent while draining ends its connection
+static void drain_close(http_server *server, struct evhttp_request *req) {
+    struct evkeyvalq *out;
+    if (!server->drain.on)
+        return;
+    out = evhttp_request_get_output_headers(req);
+    evhttp_remove_header(out, "Connection");
+    evhttp_add_header(out, "Connection", "close");
+}
+
+// every request starts here, its connection is remembered until evhttp
+// frees it
+static void conn_track(http_server *server, struct evhttp_request *req) {
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    server_conn **p, *c;
+
+    drain_close(server, req);
+    if (!evcon)
+        return;
+    if (server->conns.cap && *conn_find(server, evcon))
+        return;
+    if (server->conns.len >= server->conns.cap && conn_grow(server) < 0)
+        return;
+    if (!(c = malloc(sizeof(*c))))
+        return;
+    c->evcon = evcon;
+    c->server = server;
+    p = &server->conns.buckets[conn_hash(evcon, server->conns.cap)];
+    c->next = *p;
+    *p = c;
+    server->conns.len++;
+    evhttp_connection_set_closecb(evcon, conn_closed, c);
+}
+
+// the connection now belongs to someone else, like an h2 session
+static void conn_forget(http_server *server,
+                        struct evhttp_connection *evcon) {
+    server_conn **p, *c;
+    if (!evcon || !server->conns.cap || !*(p = conn_find(server, evcon)))
+        return;
+    c = *p;
+    *p = c->next;
+    server->conns.len--;
+    free(c);
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+}
+
+// keep-alive connections waiting for their next request. the others get
+// Connection: close on their reply
+static void drain_close_idle(http_server *server) {
+    struct bufferevent *bev;
+    server_conn *c, *next;
+
+    for (size_t i = 0; i < server->conns.cap; ++i) {
+        for (c = server->conns.buckets[i]; c; c = next) {
+            next = c->next;
+            bev = evhttp_connection_get_bufferevent(c->evcon);
+            if (!(bufferevent_get_enabled(bev) & EV_READ) ||
+                evbuffer_get_length(bufferevent_get_input(bev)) ||
+                evbuffer_get_length(bufferevent_get_output(bev)))
+                continue;
+            server->drain.idle_closed++;
+            // closecb unlinks c
+            evhttp_connection_free(c->evcon);
+        }
+    }
+}
+
+static int drain_idle(http_server *server) {
+    if (server->inflight || server->conns.len)
+        return 0;
+    for (int i = 0; i < SCHED_COUNT; ++i) {
+        if (server->sched.classes[i].len)
+            return 0;
+    }
+#ifdef HTTP_NGHTTP2
+    if (server->h2) {
+        h2_stats hs;
+        h2_get_stats(server->h2, &hs);
+        if (hs.active)
+            return 0;
+    }
+#endif
+#ifdef HTTP_URING
+    if (server->uring) {
+        uring_stats us;
+        uring_get_stats(server->uring, &us);
+        if (us.conns)
+            return 0;
+    }
+#endif
+    return 1;
+}
+
+// how often a drain closes idle connections and checks for the end
+#define DRAIN_POLL_US 20000
+
+static void drain_cb(evutil_socket_t fd, short what, void *arg) {
+    http_server *server = arg;
+    drain_close_idle(server);
+    if (!drain_idle(server) && util_now_us() < server->drain.deadline)
+        return;
+    event_del(server->drain.ev);
+    event_base_loopbreak(server->base);
+}
+
+// stops accepting everywhere, the connections are closed from drain_cb so
+// this can run inside a handler
+static int drain_start(http_server *server, int64_t timeout_us) {
+    struct timeval tv = {0, DRAIN_POLL_US};
+
+    if (!server->drain.ev) {
+        server->drain.ev = event_new(server->base, -1, EV_PERSIST, drain_cb,
+                                     server);
+        if (!server->drain.ev)
+            return -1;
+    }
+    server->drain.deadline = util_now_us() + timeout_us;
+    if (!server->drain.on) {
+        server->drain.on = 1;
+        for (size_t i = 0; i < server->listeners_len; ++i) {
+            evconnlistener_disable(
+                evhttp_bound_socket_get_listener(server->listeners[i].bound));
+        }
+#ifdef HTTP_URING
+        if (server->uring)
+            uring_drain(server->uring);
+#endif
+#ifdef HTTP_NGHTTP2
+        if (server->h2)
+            h2_drain(server->h2);
+#endif
+    }
+    event_add(server->drain.ev, &tv);
+    event_active(server->drain.ev, EV_TIMEOUT, 0);
+    return 0;
+}
+
+static int http_server_interrupt(JSRuntime *rt, void *opaque);
+// QuickJS polls every 10000 or so instructions, reading the cpu clock is a
+// syscall, so budgets are checked on every 8th poll
+#define INTERRUPT_CLOCK_EVERY 8
+
+// {path, format, maxBytes, keep, ring, flushMs}, process wide
+static int access_log_set(JSContext *ctx, JSValueConst opts) {
+    static const char *formats[] = {"common", "combined", "json"};
+    access_log_config config = {.keep = 5};
+    JSValue v;
+    const char *str = NULL;
+    double d;
+    int ret = -1, n;
+
+    v = JS_GetPropertyStr(ctx, opts, "path");
+    if (JS_IsString(v))
+        config.path = JS_ToCString(ctx, v);
+    JS_FreeValue(ctx, v);
+    if (!config.path) {
+        JS_ThrowTypeError(ctx, "accessLog.path must be string");
+        return -1;
+    }
+    v = JS_GetPropertyStr(ctx, opts, "format");
+    if (!JS_IsUndefined(v)) {
+        str = JS_IsString(v) ? JS_ToCString(ctx, v) : NULL;
+        for (n = 0; str && n < (int)countof(formats); ++n) {
+            if (!strcmp(str, formats[n]))
+                break;
+        }
+        JS_FreeCString(ctx, str);
+        if (!str || n == (int)countof(formats)) {
+            JS_FreeValue(ctx, v);
+            JS_ThrowTypeError(ctx, "accessLog.format must be common, combined "
+                                   "or json");
+            goto done;
+        }
+        config.format = n;
+    }
+    JS_FreeValue(ctx, v);
+    if ((n = opt_number(ctx, opts, "maxBytes", &d)) < 0)
+        goto done;
+    if (n)
+        config.max_bytes = (uint64_t)d;
+    if ((n = opt_number(ctx, opts, "keep", &d)) < 0)
+        goto done;
+    if (n)
+        config.keep = (int)d;
+    if ((n = opt_number(ctx, opts, "ring", &d)) < 0)
+        goto done;
+    if (n)
+        config.ring = (size_t)d;
+    if ((n = opt_number(ctx, opts, "flushMs", &d)) < 0)
+        goto done;
+    if (n)
+        config.flush_ms = (int)d;
+    if (access_log_open(&config) < 0) {
+        JS_ThrowInternalError(ctx, "Failed to open access log %s: %s",
+                              config.path, strerror(errno));
+        goto done;
+    }
+    ret = 0;
+done:
+    JS_FreeCString(ctx, config.path);
+    return ret;
+}
+
+// {path, sample, maxBody, bufferBytes, flushMs, credentials}, process wide
+static int capture_set(JSContext *ctx, JSValueConst opts) {
+    capture_config config = {.sample = 1};
+    JSValue v;
+    double d;
+    int ret = -1, n;
+
+    v = JS_GetPropertyStr(ctx, opts, "path");
+    if (JS_IsString(v))
+        config.path = JS_ToCString(ctx, v);
+    JS_FreeValue(ctx, v);
+    if (!config.path) {
+        JS_ThrowTypeError(ctx, "capture.path must be string");
+        return -1;
+    }
+    if ((n = opt_number(ctx, opts, "sample", &d)) < 0)
+        goto done;
+    if (n) {
+        if (!(d > 0 && d <= 1)) {
+            JS_ThrowRangeError(ctx, "capture.sample must be in (0, 1]");
+            goto done;
+        }
+        config.sample = d;
+    }
+    if ((n = opt_number(ctx, opts, "maxBody", &d)) < 0)
+        goto done;
+    if (n)
+        config.max_body = (size_t)d;
+    if ((n = opt_number(ctx, opts, "bufferBytes", &d)) < 0)
+        goto done;
+    if (n)
+        config.buffer = (size_t)d;
+    if ((n = opt_number(ctx, opts, "flushMs", &d)) < 0)
+        goto done;
+    if (n)
+        config.flush_ms = (int)d;
+    if (opt_bool(ctx, opts, "credentials", &config.credentials) < 0)
+        goto done;
+    if (capture_open(&config) < 0) {
+        JS_ThrowInternalError(ctx, "Failed to open capture %s: %s",
+                              config.path, strerror(errno));
+        goto done;
+    }
+    ret = 0;
+done:
+    JS_FreeCString(ctx, config.path);
+    return ret;
+}
+
+// high priority timer, lateness is the time the loop was blocked
+static void watchdog_beat_cb(evutil_socket_t fd, short what, void *arg) {
+    http_server *server = arg;
+    int64_t now = util_now_us(), lag = 0;
+    if (server->watchdog.expected && now > server->watchdog.expected)
+        lag = now - server->watchdog.expected;
+    util_hist_add(&server->watchdog.lag, (uint64_t)lag);
+    server->watchdog.expected = now + server->watchdog.interval_us;
+    __atomic_store_n(&server->watchdog.last_beat, now, __ATOMIC_RELEASE);
+}
+
+static void *watchdog_main(void *arg) {
+    http_server *server = arg;
+    http_server_cb *cb;
+    int64_t beat, lag, reported = 0;
+
+    while (!__atomic_load_n(&server->watchdog.stop, __ATOMIC_ACQUIRE)) {
+        util_sleep_us(server->watchdog.interval_us);
+        beat = __atomic_load_n(&server->watchdog.last_beat, __ATOMIC_ACQUIRE);
+        // not dispatching yet
+        if (!beat)
+            continue;
+        lag = util_now_us() - beat - server->watchdog.interval_us;
+        // once per stall
+        if (lag < server->watchdog.threshold_us || beat == reported)
+            continue;
+        reported = beat;
+        cb = __atomic_load_n(&server->watchdog.current, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&server->watchdog.stalls, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&server->watchdog.last_route, cb ? cb->path : NULL,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&server->watchdog.last_stall_us, lag,
+                         __ATOMIC_RELAXED);
+        fprintf(stderr, "http: event loop stalled for %lldms in %s\n",
+                (long long)(lag / 1000), cb ? cb->path : "native code");
+        if (cb)
+            __atomic_store_n(&server->watchdog.capture, cb, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// {intervalMs, thresholdMs}
+static int watchdog_start(JSContext *ctx, http_server *server,
+                          JSValueConst opts) {
+    struct timeval tv;
+    double d;
+    int ret;
+
+    if (server->watchdog.running)
+        return 0;
+    server->watchdog.interval_us = 10000;
+    server->watchdog.threshold_us = 100000;
+    if ((ret = opt_number(ctx, opts, "intervalMs", &d)) < 0)
+        return -1;
+    if (ret && d > 0)
+        server->watchdog.interval_us = (int64_t)(d * 1000);
+    if ((ret = opt_number(ctx, opts, "thresholdMs", &d)) < 0)
+        return -1;
+    if (ret && d > 0)
+        server->watchdog.threshold_us = (int64_t)(d * 1000);
+
+    server->watchdog.beat_ev =
+        event_new(server->base, -1, EV_PERSIST, watchdog_beat_cb, server);
+    if (!server->watchdog.beat_ev) {
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    event_priority_set(server->watchdog.beat_ev, HTTP_PRIO_HIGH);
+    tv.tv_sec = server->watchdog.interval_us / 1000000;
+    tv.tv_usec = server->watchdog.interval_us % 1000000;
+    event_add(server->watchdog.beat_ev, &tv);
+    if (pthread_create(&server->watchdog.thread, NULL, watchdog_main,
+                       server)) {
+        event_free(server->watchdog.beat_ev);
+        server->watchdog.beat_ev = NULL;
+        JS_ThrowInternalError(ctx, "pthread_create failed");
+        return -1;
+    }
+    server->watchdog.running = 1;
+    // for stack traces of stalled handlers
+    JS_SetInterruptHandler(JS_GetRuntime(ctx), http_server_interrupt, server);
+    interrupt_owner = server;
+    return 0;
+}
+
+static void sched_drain_cb(evutil_socket_t fd, short what, void *arg);
+
+static int sched_enable(JSContext *ctx, http_server *server) {
+    if (server->sched.on)
+        return 0;
+    server->sched.ev = event_new(server->base, -1, 0, sched_drain_cb, server);
+    if (!server->sched.ev) {
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    server->sched.on = 1;
+    return 0;
+}
+
+// undoes sched_enable while no route has a priority yet
+static void sched_disable(http_server *server) {
+    event_free(server->sched.ev);
+    server->sched.ev = NULL;
+    server->sched.on = 0;
+}
+
+static int sched_class_of(JSContext *ctx, JSValueConst val) {
+    const char *name = JS_ToCString(ctx, val);
+    int ret = -1;
+    if (!name)
+        return -1;
+    for (int i = 0; i < SCHED_COUNT; ++i) {
+        if (!strcmp(name, sched_names[i]))
+            ret = i;
+    }
+    if (ret < 0)
+        JS_ThrowTypeError(ctx, "unknown priority %s", name);
+    JS_FreeCString(ctx, name);
+    return ret;
+}
+
+// {high: {weight, maxQueue, deadlineMs}, normal: ..., low: ...}
+static int sched_set(JSContext *ctx, http_server *server, JSValueConst opts) {
+    JSValue v;
+    double d;
+    int ret;
+
+    for (int i = 0; i < SCHED_COUNT; ++i) {
+        sched_class *c = &server->sched.classes[i];
+        v = JS_GetPropertyStr(ctx, opts, sched_names[i]);
+        if (JS_IsUndefined(v))
+            continue;
+        if (!JS_IsObject(v)) {
+            JS_FreeValue(ctx, v);
+            JS_ThrowTypeError(ctx, "scheduler.%s must be object",
+                              sched_names[i]);
+            return -1;
+        }
+        if ((ret = opt_number(ctx, v, "weight", &d)) < 0)
+            goto fail;
+        if (ret)
+            c->weight = d < 1 ? 1 : (int)d;
+        if ((ret = opt_number(ctx, v, "maxQueue", &d)) < 0)
+            goto fail;
+        if (ret)
+            c->max_queue = (size_t)d;
+        if ((ret = opt_number(ctx, v, "deadlineMs", &d)) < 0)
+            goto fail;
+        if (ret)
+            c->deadline_us = (int64_t)(d * 1000);
+        JS_FreeValue(ctx, v);
+    }
+    return sched_enable(ctx, server);
+fail:
+    JS_FreeValue(ctx, v);
+    return -1;
+}
+
+#ifdef HTTP_NGHTTP2
+static void h2_route(void *arg, h2_request *req, h2_reply *reply);
+
+// streams are served without an evhttp request, so new connections stay on
+// HTTP/1.1 while anything needs one: the scheduler, proxies, offloaded
+// routes, the access log or the capture
+static int server_h2_on(http_server *server) {
+    return server->http2 && !server->sched.on && !server->proxies_len &&
+           !server->pool && !access_log_enabled() && !capture_enabled();
+}
+
+// plain connections are checked for the h2 preface before evhttp parses them
+static struct bufferevent *h2_bevcb(struct event_base *base, void *arg) {
+    http_server *server = arg;
+    struct bufferevent *bev;
+
+    bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (bev && server_h2_on(server))
+        h2_watch(bev);
+    return bev;
+}
+#endif
+
+// true, false or {maxStreams}
+static int http2_set(JSContext *ctx, http_server *server, JSValueConst opts) {
+#ifdef HTTP_NGHTTP2
+    double d;
+    int ret;
+
+    if (JS_IsBool(opts) && !JS_ToBool(ctx, opts)) {
+        server->http2 = 0;
+        return 0;
+    }
+    if (!server->h2) {
+        server->h2 = h2_new(h2_route, server);
+        if (!server->h2 || h2_attach(server->h2, server->http) < 0 ||
+            (server->https && h2_attach(server->h2, server->https) < 0)) {
+            JS_ThrowOutOfMemory(ctx);
+            return -1;
+        }
+        evhttp_set_bevcb(server->http, h2_bevcb, server);
+    }
+    if (JS_IsObject(opts)) {
+        if ((ret = opt_number(ctx, opts, "maxStreams", &d)) < 0)
+            return -1;
+        if (ret)
+            h2_set_max_streams(server->h2, (uint32_t)d);
+    }
+    server->http2 = 1;
+    return 0;
+#else
+    if (JS_IsBool(opts) && !JS_ToBool(ctx, opts))
+        return 0;
+    JS_ThrowInternalError(ctx, "built without http2 support");
+    return -1;
+#endif
+}
+
+#define RECYCLE_MAX 256
+
+// true, false or {max}, max structs and buffers kept of each kind
+static int recycle_set(JSContext *ctx, http_server *server,
+                       JSValueConst opts) {
+    double d = RECYCLE_MAX;
+    int ret;
+
+    if (JS_IsObject(opts)) {
+        if ((ret = opt_number(ctx, opts, "max", &d)) < 0)
+            return -1;
+        if (ret && d < 1) {
+            JS_ThrowRangeError(ctx, "recycle.max must be at least 1");
+            return -1;
+        }
+    }
+    // objects still out let go of the old one as they are collected
+    if (server->recycle) {
+        recycle_drop(server->recycle);
+        server->recycle = NULL;
+    }
+    if (JS_IsBool(opts) && !JS_ToBool(ctx, opts))
+        return 0;
+    server->recycle = recycle_new((size_t)d);
+    if (!server->recycle) {
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+// server options, like {gc: {threshold, every, idle, metrics}, trace: {sample}}
+static JSValue http_server_set(JSContext *ctx, JSValueConst this_val, int argc,
+                               JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    JSValue val, gc;
+    double d;
+    int ret;
+    if (!server)
+        return JS_EXCEPTION;
+    if (argc < 1 || !JS_IsObject(argv[0]))
+        return JS_ThrowTypeError(ctx, "set([val]), val must be object");
+    val = argv[0];
+
+    if ((ret = opt_number(ctx, val, "workers", &d)) < 0)
+        return JS_EXCEPTION;
+    if (ret)
+        server->workers = (int)d;
+
+    gc = JS_GetPropertyStr(ctx, val, "backend");
+    if (JS_IsString(gc)) {
+        const char *str = JS_ToCString(ctx, gc);
+        if (!str)
+            goto fail;
+        if (!strcmp(str, "uring")) {
+            server->backend = HTTP_BACKEND_URING;
+        } else if (!strcmp(str, "libevent")) {
+            server->backend = HTTP_BACKEND_LIBEVENT;
+        } else {
+            JS_ThrowTypeError(ctx, "unknown backend %s", str);
+            JS_FreeCString(ctx, str);
+            goto fail;
+        }
+        JS_FreeCString(ctx, str);
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.backend must be string");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "gc");
+    if (JS_IsObject(gc)) {
+        if ((ret = opt_number(ctx, gc, "threshold", &d)) < 0)
+            goto fail;
+        if (ret) {
+            server->gc.threshold = (size_t)d;
+            gc_arm(server);
+        }
+        if ((ret = opt_number(ctx, gc, "every", &d)) < 0)
+            goto fail;
+        if (ret)
+            server->gc.every = (uint32_t)d;
+        opt_bool(ctx, gc, "idle", &server->gc.idle);
+        opt_bool(ctx, gc, "metrics", &server->gc.metrics);
+        if (server->gc.idle && !server->gc.idle_ev) {
+            server->gc.idle_ev =
+                event_new(server->base, -1, 0, gc_idle_cb, server);
+            if (!server->gc.idle_ev) {
+                JS_ThrowOutOfMemory(ctx);
+                goto fail;
+            }
+            event_priority_set(server->gc.idle_ev, HTTP_PRIO_IDLE);
+        }
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.gc must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "accessLog");
+    if (JS_IsObject(gc)) {
+        if (access_log_set(ctx, gc) < 0)
+            goto fail;
+    } else if (JS_IsBool(gc) || JS_IsNull(gc)) {
+        if (!JS_ToBool(ctx, gc))
+            access_log_close();
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.accessLog must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "capture");
+    if (JS_IsObject(gc)) {
+        if (capture_set(ctx, gc) < 0)
+            goto fail;
+    } else if (JS_IsBool(gc) || JS_IsNull(gc)) {
+        if (!JS_ToBool(ctx, gc))
+            capture_close();
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.capture must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "watchdog");
+    if (JS_IsObject(gc)) {
+        if (watchdog_start(ctx, server, gc) < 0)
+            goto fail;
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.watchdog must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "decompress");
+    if (JS_IsObject(gc)) {
+        server->decompress.off = 0;
+        if ((ret = opt_number(ctx, gc, "maxBytes", &d)) < 0)
+            goto fail;
+        if (ret)
+            server->decompress.limits.max_size = (size_t)d;
+        if ((ret = opt_number(ctx, gc, "maxRatio", &d)) < 0)
+            goto fail;
+        if (ret)
+            server->decompress.limits.max_ratio = d;
+    } else if (JS_IsBool(gc)) {
+        server->decompress.off = !JS_ToBool(ctx, gc);
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.decompress must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "http2");
+    if (JS_IsObject(gc) || JS_IsBool(gc)) {
+        if (http2_set(ctx, server, gc) < 0)
+            goto fail;
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.http2 must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "recycle");
+    if (JS_IsObject(gc) || JS_IsBool(gc)) {
+        if (recycle_set(ctx, server, gc) < 0)
+            goto fail;
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.recycle must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    gc = JS_GetPropertyStr(ctx, val, "scheduler");
+    if (JS_IsObject(gc)) {
+        if (sched_set(ctx, server, gc) < 0)
+            goto fail;
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.scheduler must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+
+    // tracing is process wide, each thread records into its own ring
+    gc = JS_GetPropertyStr(ctx, val, "trace");
+    if (JS_IsObject(gc)) {
+        double sample = 0, events = 0;
+        if (opt_number(ctx, gc, "sample", &sample) < 0 ||
+            opt_number(ctx, gc, "events", &events) < 0)
+            goto fail;
+        trace_configure(sample, (size_t)events);
+    } else if (!JS_IsUndefined(gc)) {
+        JS_ThrowTypeError(ctx, "set([val]), val.trace must be object");
+        goto fail;
+    }
+    JS_FreeValue(ctx, gc);
+    return JS_UNDEFINED;
+fail:
+    JS_FreeValue(ctx, gc);
+    return JS_EXCEPTION;
+}
+
+static JSValue http_server_ctor(JSContext *ctx, JSValueConst new_target,
+                                int argc, JSValueConst *argv) {
+    JSValue obj = JS_UNDEFINED;
+    http_server *server = NULL;
+    JSValue proto;
+    JSClassID class_id;
+
+    class_id = http_server_class_id;
+    proto = JS_GetPropertyStr(ctx, new_target, "prototype");
+    if (JS_IsException(proto))
+        goto fail;
+    if (JS_IsObject(proto)) {
+        obj = JS_NewObjectProtoClass(ctx, proto, class_id);
+        if (JS_IsException(obj))
+            goto fail;
+    } else {
+        JS_ThrowTypeError(ctx, "prototype property is not an object");
+        goto fail;
+    }
+    server = js_mallocz(ctx, sizeof(*server));
+    if (!server) {
+        JS_ThrowOutOfMemory(ctx);
+        goto fail;
+    }
+#ifdef _WIN32
+    WSAStartup(MAKEWORD(2, 2), &server->wsaData);
+#endif
+    server->ctx = ctx;
+    server->base = event_base_new();
+    if (!server->base) {
+        JS_ThrowInternalError(ctx, "event_base_new failed");
+        goto fail;
+    }
+    // new events get HTTP_PRIO_DEFAULT
+    event_base_priority_init(server->base, HTTP_PRIO_COUNT);
+    server->decompress.limits.max_size = 8 << 20;
+    server->decompress.limits.max_ratio = 100;
+    server->handoff.fd = server->handoff.peer = -1;
+    for (int i = 0; i < SCHED_COUNT; ++i) {
+        server->sched.classes[i].weight = i == SCHED_HIGH     ? 8
+                                          : i == SCHED_NORMAL ? 4
+                                                              : 1;
+        server->sched.classes[i].max_queue = 1024;
+    }
+    server->http = evhttp_new(server->base);
+    if (!server->http) {
+        JS_ThrowInternalError(ctx, "evhttp_new failed");
         goto fail;
     }
     JS_SetOpaque(obj, server);
+    if (argc > 0) {
+        if (JS_IsObject(argv[0])) {
+            if (JS_IsException(http_server_set(ctx, obj, argc, argv))) {
+                JS_FreeValue(ctx, proto);
+                JS_FreeValue(ctx, obj);
+                return JS_EXCEPTION;
+            }
+        } else {
+            JS_ThrowTypeError(ctx, "server([val]), val must be object");
+            goto fail;
+        }
+    }
+    JS_FreeValue(ctx, proto);
+    return obj;
+fail:
     JS_FreeValue(ctx, proto);
+    JS_FreeValue(ctx, obj);
+    js_free(ctx, server);
+    return JS_EXCEPTION;
+}
+
+static void callback_helper(struct evhttp_request *req, void *arg);
+static void fixed_callback(struct evhttp_request *req, void *arg);
+static void proxy_gencb(struct evhttp_request *req, void *arg);
+
+// registers a route on every frontend
+static int server_set_cb(http_server *server, const char *path,
+                         void (*cb)(struct evhttp_request *, void *),
+                         void *arg) {
+    if (evhttp_set_cb(server->http, path, cb, arg) < 0)
+        return -1;
+    if (server->https && evhttp_set_cb(server->https, path, cb, arg) < 0) {
+        evhttp_del_cb(server->http, path);
+        return -1;
+    }
+    return 0;
+}
+
+static void server_set_gencb(http_server *server,
+                             void (*cb)(struct evhttp_request *, void *),
+                             void *arg) {
+    evhttp_set_gencb(server->http, cb, arg);
+    if (server->https)
+        evhttp_set_gencb(server->https, cb, arg);
+}
+
+// another evhttp with the routes registered so far
+static struct evhttp *server_frontend_new(http_server *server) {
+    struct evhttp *http = evhttp_new(server->base);
+    if (!http)
+        return NULL;
+    for (size_t i = 0; i < server->cbs_len; ++i) {
+        evhttp_set_cb(http, server->cbs[i]->path, callback_helper,
+                      server->cbs[i]);
+    }
+    for (size_t i = 0; i < server->fixed_len; ++i) {
+        evhttp_set_cb(http, server->fixed[i]->path, fixed_callback,
+                      server->fixed[i]);
+    }
+    if (server->proxies_len)
+        evhttp_set_gencb(http, proxy_gencb, server);
+    return http;
+}
+
+#ifdef HTTP_OPENSSL
+static void tls_info_cb(const SSL *ssl, int where, int ret) {
+    http_server *server;
+    if (!(where & SSL_CB_HANDSHAKE_DONE))
+        return;
+    server = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    server->tls.handshakes++;
+    if (SSL_session_reused((SSL *)ssl))
+        server->tls.resumed++;
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        server->tls.ktls++;
+}
+
+static struct bufferevent *tls_bevcb(struct event_base *base, void *arg) {
+    http_server *server = arg;
+    struct bufferevent *bev;
+    SSL *ssl = SSL_new(server->ssl_ctx);
+    if (!ssl)
+        return NULL;
+    // evhttp sets the fd once accepted
+    bev = bufferevent_openssl_socket_new(base, -1, ssl,
+                                         BUFFEREVENT_SSL_ACCEPTING,
+                                         BEV_OPT_CLOSE_ON_FREE);
+#ifdef HTTP_NGHTTP2
+    if (bev && server_h2_on(server))
+        h2_watch(bev);
+#endif
+    return bev;
+}
+
+#ifdef HTTP_NGHTTP2
+// h2 when it is on and the client offers it, HTTP/1.1 otherwise
+static int tls_alpn_cb(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    http_server *server = arg;
+    int h2 = server_h2_on(server);
+    const unsigned char *p = h2 ? protos : protos + 3;
+    unsigned int len = sizeof(protos) - 1 - (h2 ? 0 : 3);
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, p, len, in,
+                              inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+// tls options, like {cert, key, sessionCacheSize, tickets, ktls}
+static int tls_setup(JSContext *ctx, http_server *server, JSValueConst opts) {
+    static const unsigned char sid_ctx[] = "lanyt-http";
+    const char *cert = NULL, *key = NULL;
+    JSValue v;
+    SSL_CTX *ssl_ctx;
+    double d;
+    int ret, on;
+
+    // the first tls listen decides the certificate
+    if (server->ssl_ctx)
+        return 0;
+    v = JS_GetPropertyStr(ctx, opts, "cert");
+    cert = JS_IsString(v) ? JS_ToCString(ctx, v) : NULL;
+    JS_FreeValue(ctx, v);
+    v = JS_GetPropertyStr(ctx, opts, "key");
+    key = JS_IsString(v) ? JS_ToCString(ctx, v) : NULL;
+    JS_FreeValue(ctx, v);
+    if (!cert || !key) {
+        JS_ThrowTypeError(ctx, "listen, opts.cert and opts.key must be string");
+        goto fail;
+    }
+
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (!ssl_ctx) {
+        JS_ThrowInternalError(ctx, "SSL_CTX_new failed");
+        goto fail;
+    }
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ssl_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ssl_ctx) != 1) {
+        JS_ThrowInternalError(ctx, "Failed to load %s / %s: %s", cert, key,
+                              ERR_reason_error_string(ERR_get_error()));
+        SSL_CTX_free(ssl_ctx);
+        goto fail;
+    }
+
+    // resumption by session id, kept in memory
+    SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+    if ((ret = opt_number(ctx, opts, "sessionCacheSize", &d)) < 0) {
+        SSL_CTX_free(ssl_ctx);
+        goto fail;
+    }
+    SSL_CTX_sess_set_cache_size(ssl_ctx, ret ? (long)d : 20480);
+    // stateless resumption, ticket keys are generated per process
+    if (opt_bool(ctx, opts, "tickets", &on) && !on)
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+#ifdef SSL_OP_ENABLE_KTLS
+    // only kicks in when the kernel has the tls module and the cipher fits
+    if (!opt_bool(ctx, opts, "ktls", &on) || on)
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_app_data(ssl_ctx, server);
+    SSL_CTX_set_info_callback(ssl_ctx, tls_info_cb);
+#ifdef HTTP_NGHTTP2
+    SSL_CTX_set_alpn_select_cb(ssl_ctx, tls_alpn_cb, server);
+#endif
+    server->ssl_ctx = ssl_ctx;
+    JS_FreeCString(ctx, cert);
+    JS_FreeCString(ctx, key);
+    return 0;
+fail:
+    JS_FreeCString(ctx, cert);
+    JS_FreeCString(ctx, key);
+    return -1;
+}
+#endif
+
+// socket tuning for listen, the accepted sockets inherit most of it
+typedef struct {
+    int backlog;
+    int nodelay;
+    int defer_accept;
+    int fast_open;
+    int reuse_port;
+    int sndbuf;
+    int rcvbuf;
+} listen_opts;
+
+static int listen_opts_parse(JSContext *ctx, JSValueConst obj,
+                             listen_opts *o) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } ints[] = {
+        {"backlog", offsetof(listen_opts, backlog)},
+        {"deferAccept", offsetof(listen_opts, defer_accept)},
+        {"fastOpen", offsetof(listen_opts, fast_open)},
+        {"sndBuf", offsetof(listen_opts, sndbuf)},
+        {"rcvBuf", offsetof(listen_opts, rcvbuf)},
+    };
+    double d;
+    int ret;
+
+    memset(o, 0, sizeof(*o));
+    o->backlog = 1024;
+    if (!JS_IsObject(obj))
+        return 0;
+    for (size_t i = 0; i < countof(ints); ++i) {
+        if ((ret = opt_number(ctx, obj, ints[i].name, &d)) < 0)
+            return -1;
+        if (ret)
+            *(int *)((char *)o + ints[i].offset) = (int)d;
+    }
+    opt_bool(ctx, obj, "nodelay", &o->nodelay);
+    opt_bool(ctx, obj, "reusePort", &o->reuse_port);
+    return 0;
+}
+
+#define SETSOCKOPT(fd, level, name, val)                                       \
+    do {                                                                       \
+        int v_ = (val);                                                        \
+        setsockopt(fd, level, name, (const char *)&v_, sizeof(v_));            \
+    } while (0)
+
+static void listen_tune(evutil_socket_t fd, int family, const listen_opts *o) {
+    if (o->sndbuf > 0)
+        SETSOCKOPT(fd, SOL_SOCKET, SO_SNDBUF, o->sndbuf);
+    if (o->rcvbuf > 0)
+        SETSOCKOPT(fd, SOL_SOCKET, SO_RCVBUF, o->rcvbuf);
+    if (family != AF_INET && family != AF_INET6)
+        return;
+    if (o->nodelay)
+        SETSOCKOPT(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef TCP_DEFER_ACCEPT
+    // seconds to wait for the first bytes before waking accept
+    if (o->defer_accept > 0)
+        SETSOCKOPT(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, o->defer_accept);
+#endif
+#ifdef TCP_FASTOPEN
+    // length of the pending fast open queue
+    if (o->fast_open > 0)
+        SETSOCKOPT(fd, IPPROTO_TCP, TCP_FASTOPEN, o->fast_open);
+#endif
+}
+
+// bound and listening socket for address:port or unix:path, -1 on error
+static evutil_socket_t listen_socket(JSContext *ctx, const char *address,
+                                     int port, const listen_opts *o) {
+    struct evutil_addrinfo hints, *ai = NULL;
+    evutil_socket_t fd = -1;
+    char port_str[16];
+    int err;
+
+#ifndef _WIN32
+    if (!strncmp(address, "unix:", 5)) {
+        struct sockaddr_un sun;
+        struct stat st;
+        const char *path = address + 5;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            JS_ThrowRangeError(ctx, "unix socket path too long: %s", path);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+        // left over from a previous run only if nobody accepts on it, a
+        // full backlog still means a live server
+        if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0)
+                goto fail;
+            evutil_make_socket_nonblocking(fd);
+            err = connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+                      ? errno
+                      : 0;
+            evutil_closesocket(fd);
+            fd = -1;
+            if (err == ECONNREFUSED) {
+                unlink(path);
+            } else if (!err || err == EAGAIN) {
+                JS_ThrowInternalError(ctx, "Failed to listen on %s: in use",
+                                      address);
+                return -1;
+            }
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            goto fail;
+        listen_tune(fd, AF_UNIX, o);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+            goto fail;
+        goto done;
+    }
+#endif
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = EVUTIL_AI_PASSIVE | EVUTIL_AI_ADDRCONFIG;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if ((err = evutil_getaddrinfo(address, port_str, &hints, &ai)) != 0) {
+        JS_ThrowInternalError(ctx, "Failed to resolve %s: %s", address,
+                              evutil_gai_strerror(err));
+        return -1;
+    }
+    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        goto fail;
+    evutil_make_listen_socket_reuseable(fd);
+    if (o->reuse_port)
+        evutil_make_listen_socket_reuseable_port(fd);
+    listen_tune(fd, ai->ai_family, o);
+    if (bind(fd, ai->ai_addr, (int)ai->ai_addrlen) < 0)
+        goto fail;
+#ifndef _WIN32
+done:
+#endif
+    if (listen(fd, o->backlog) < 0 || evutil_make_socket_nonblocking(fd) < 0)
+        goto fail;
+    evutil_make_socket_closeonexec(fd);
+    if (ai)
+        evutil_freeaddrinfo(ai);
+    return fd;
+fail:
+    JS_ThrowInternalError(ctx, "Failed to listen on %s:%d: %s", address, port,
+                          evutil_socket_error_to_string(
+                              EVUTIL_SOCKET_ERROR()));
+    if (fd >= 0)
+        evutil_closesocket(fd);
+    if (ai)
+        evutil_freeaddrinfo(ai);
+    return -1;
+}
+
+static int listen_has_tls(JSContext *ctx, JSValueConst opts) {
+    JSValue v = JS_GetPropertyStr(ctx, opts, "cert");
+    int ret = !JS_IsUndefined(v);
+    JS_FreeValue(ctx, v);
+    return ret;
+}
+
+// the evhttp a listener goes to, https is set up by the first tls one
+static struct evhttp *server_frontend(JSContext *ctx, http_server *server,
+                                      JSValueConst opts, int tls) {
+    if (!tls)
+        return server->http;
+#ifdef HTTP_OPENSSL
+    if (tls_setup(ctx, server, opts) < 0)
+        return NULL;
+    if (!server->https) {
+        server->https = server_frontend_new(server);
+        if (!server->https) {
+            JS_ThrowInternalError(ctx, "evhttp_new failed");
+            return NULL;
+        }
+        evhttp_set_bevcb(server->https, tls_bevcb, server);
+#ifdef HTTP_NGHTTP2
+        if (server->h2 && h2_attach(server->h2, server->https) < 0) {
+            JS_ThrowInternalError(ctx, "h2_attach failed");
+            return NULL;
+        }
+#endif
+    }
+    return server->https;
+#else
+    JS_ThrowInternalError(ctx, "built without tls support");
+    return NULL;
+#endif
+}
+
+// a socket that is already listening, made ready for evhttp
+static int listen_adopt(JSContext *ctx, evutil_socket_t fd,
+                        const listen_opts *o) {
+    struct sockaddr_storage ss;
+    ev_socklen_t ss_len = sizeof(ss);
+    if (getsockname(fd, (struct sockaddr *)&ss, &ss_len) < 0) {
+        JS_ThrowTypeError(ctx, "listen, %d is not a socket", (int)fd);
+        return -1;
+    }
+    // already listening, this only applies the backlog
+    if (listen(fd, o->backlog) < 0) {
+        JS_ThrowInternalError(ctx, "listen, %d: %s", (int)fd,
+                              evutil_socket_error_to_string(
+                                  EVUTIL_SOCKET_ERROR()));
+        return -1;
+    }
+    evutil_make_socket_nonblocking(fd);
+    listen_tune(fd, ss.ss_family, o);
+    return 0;
+}
+
+// accepts on fd, which stays open on failure. unix_path is unlinked when
+// the server goes away
+static int server_listener_add(JSContext *ctx, http_server *server,
+                               struct evhttp *http, evutil_socket_t fd,
+                               const char *name, const char *unix_path) {
+    http_listener *tab, *l;
+
+    tab = js_realloc(ctx, server->listeners,
+                     (server->listeners_len + 1) * sizeof(*tab));
+    if (!tab)
+        return -1;
+    server->listeners = tab;
+    l = &tab[server->listeners_len];
+    memset(l, 0, sizeof(*l));
+    l->bound = evhttp_accept_socket_with_handle(http, fd);
+    if (!l->bound) {
+        JS_ThrowInternalError(ctx, "Failed to accept on %s", name);
+        return -1;
+    }
+    l->fd = fd;
+    l->name = js_strdup(ctx, name);
+    l->tls = http != server->http;
+    if (unix_path)
+        l->unix_path = js_strdup(ctx, unix_path);
+    server->listeners_len++;
+    return 0;
+}
+
+// listen(address, port, [opts]), listen("unix:/path", [opts]) or
+// listen(fd, [opts]) for a socket that is already listening
+static JSValue http_server_listen(JSContext *ctx, JSValueConst this_val,
+                                  int argc, JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    struct evhttp *http;
+    JSValueConst opts = JS_UNDEFINED;
+    listen_opts o;
+    const char *address = NULL;
+    char name[64];
+    int port = 0, fd_arg = -1;
+    evutil_socket_t fd;
+    if (!server)
+        return JS_EXCEPTION;
+    if (argc < 1)
+        return JS_ThrowTypeError(ctx, "listen([address, port]), address and "
+                                      "port must be string and number");
+
+    if (JS_IsNumber(argv[0])) {
+        if (JS_ToInt32(ctx, &fd_arg, argv[0]))
+            return JS_EXCEPTION;
+        opts = argc > 1 ? argv[1] : JS_UNDEFINED;
+    } else if (JS_IsString(argv[0])) {
+        address = JS_ToCString(ctx, argv[0]);
+        if (!address)
+            return JS_EXCEPTION;
+        if (!strncmp(address, "unix:", 5)) {
+            opts = argc > 1 ? argv[1] : JS_UNDEFINED;
+        } else {
+            if (argc < 2 || !JS_IsNumber(argv[1]) ||
+                JS_ToInt32(ctx, &port, argv[1])) {
+                JS_FreeCString(ctx, address);
+                return JS_ThrowTypeError(ctx, "listen([address, port]), "
+                                              "address and port must be "
+                                              "string and number");
+            }
+            opts = argc > 2 ? argv[2] : JS_UNDEFINED;
+        }
+    } else {
+        return JS_ThrowTypeError(ctx, "listen([address, port]), address and "
+                                      "port must be string and number");
+    }
+    if (!JS_IsUndefined(opts) && !JS_IsObject(opts)) {
+        JS_FreeCString(ctx, address);
+        return JS_ThrowTypeError(ctx, "listen, opts must be object");
+    }
+    if (listen_opts_parse(ctx, opts, &o) < 0)
+        goto fail;
+
+    http = server_frontend(ctx, server, opts,
+                           JS_IsObject(opts) && listen_has_tls(ctx, opts));
+    if (!http)
+        goto fail;
+    if (fd_arg >= 0) {
+        // inherited, like systemd socket activation, options still apply
+        fd = fd_arg;
+        if (listen_adopt(ctx, fd, &o) < 0)
+            goto fail;
+        snprintf(name, sizeof(name), "fd:%d", fd_arg);
+    } else {
+        fd = listen_socket(ctx, address, port, &o);
+        if (fd < 0)
+            goto fail;
+        if (port)
+            snprintf(name, sizeof(name), "%.40s:%d", address, port);
+        else
+            snprintf(name, sizeof(name), "%.60s", address);
+    }
+    if (server_listener_add(ctx, server, http, fd, name,
+                            address && !strncmp(address, "unix:", 5)
+                                ? address + 5
+                                : NULL) < 0) {
+        if (fd_arg < 0)
+            evutil_closesocket(fd);
+        goto fail;
+    }
+    JS_FreeCString(ctx, address);
+    return JS_UNDEFINED;
+fail:
+    JS_FreeCString(ctx, address);
+    return JS_EXCEPTION;
+}
+
+static const char *evhttp_cmd_str[] = {
+    "GET",     "POST",  "HEAD",    "PUT",   "DELETE",
+    "OPTIONS", "TRACE", "CONNECT", "PATCH",
+};
+
+static const char *evhttp_cmd_type_to_str(enum evhttp_cmd_type type) {
+    size_t i = 0;
+    if (type < EVHTTP_REQ_GET || type > EVHTTP_REQ_PATCH)
+        return NULL;
+    for (i = 0; i < countof(evhttp_cmd_str); ++i) {
+        if (type & (1 << i))
+            return evhttp_cmd_str[i];
+    }
+    return NULL;
+}
+
+// runs on the loop thread in the middle of the stalled handler
+static void watchdog_capture(http_server *server) {
+    JSContext *ctx = server->ctx;
+    JSValue global, ctor, err, stack;
+    const char *str;
+
+    global = JS_GetGlobalObject(ctx);
+    ctor = JS_GetPropertyStr(ctx, global, "Error");
+    err = JS_CallConstructor(ctx, ctor, 0, NULL);
+    stack = JS_GetPropertyStr(ctx, err, "stack");
+    str = JS_IsString(stack) ? JS_ToCString(ctx, stack) : NULL;
+    if (str) {
+        fprintf(stderr, "http: stalled handler stack:\n%s", str);
+        free(server->watchdog.last_stack);
+        server->watchdog.last_stack = strdup(str);
+        JS_FreeCString(ctx, str);
+    }
+    JS_FreeValue(ctx, stack);
+    JS_FreeValue(ctx, err);
+    JS_FreeValue(ctx, ctor);
+    JS_FreeValue(ctx, global);
+}
+
+static int http_server_interrupt(JSRuntime *rt, void *opaque) {
+    http_server *server = opaque;
+    http_server_cb *cb =
+        __atomic_load_n(&server->watchdog.capture, __ATOMIC_ACQUIRE);
+    // only while the route that stalled is still the one running
+    if (cb) {
+        __atomic_store_n(&server->watchdog.capture, NULL, __ATOMIC_RELAXED);
+        if (cb == server->watchdog.current)
+            watchdog_capture(server);
+    }
+    if (!server->deadline || ++server->polls % INTERRUPT_CLOCK_EVERY ||
+        util_cputime_us() < server->deadline)
+        return 0;
+    server->interrupted = 1;
+    return 1;
+}
+
+// calls the route with its cpu budget and takes req_obj. aborted is set, and
+// the exception dropped, when the budget ran out
+static JSValue route_invoke(http_server_cb *cb, JSValue req_obj,
+                            int *aborted) {
+    http_server *owner = interrupt_owner;
+    http_recycle *prev;
+    JSValue ret;
+
+    cb->requests++;
+    if (cb->budget_us > 0 && owner != cb->server) {
+        // the handler is per runtime, take it over for this call
+        JS_SetInterruptHandler(JS_GetRuntime(cb->ctx), http_server_interrupt,
+                               cb->server);
+        interrupt_owner = cb->server;
+    }
+    if (cb->budget_us > 0)
+        cb->server->deadline = util_cputime_us() + cb->budget_us;
+    // handlers may run nested from another server's
+    prev = recycle_current;
+    recycle_current = cb->server->recycle;
+    ret = JS_Call(cb->ctx, cb->server->callbacks[cb->callback_index],
+                  cb->server_this, 1, (JSValueConst *)&req_obj);
+    recycle_current = prev;
+    cb->server->deadline = 0;
+    if (interrupt_owner != owner) {
+        // give it back, another server's watchdog may rely on it
+        JS_SetInterruptHandler(JS_GetRuntime(cb->ctx),
+                               owner ? http_server_interrupt : NULL, owner);
+        interrupt_owner = owner;
+    }
+    JS_FreeValue(cb->ctx, req_obj);
+    *aborted = 0;
+    if (cb->server->interrupted) {
+        cb->server->interrupted = 0;
+        if (JS_IsException(ret)) {
+            JS_FreeValue(cb->ctx, JS_GetException(cb->ctx));
+            cb->aborted++;
+            *aborted = 1;
+        }
+    }
+    return ret;
+}
+
+// t is the trace start of the request, 0 when it is not sampled
+static void route_call(struct evhttp_request *req, http_server_cb *cb,
+                       int64_t t) {
+    JSAtom atom;
+    JSValue argv[1], ret, key, value;
+    http_req *req_obj;
+    http_res *res_obj;
+    http_recycle *rc = cb->server->recycle;
+    const char *uri_str, *method_str;
+    struct evkeyvalq *headers, uri_params;
+    struct evbuffer *buf;
+    size_t len, idx = 0;
+    int aborted, etag;
+    const char *inm;
+    char tag[ETAG_MAX];
+
+    uri_str = evhttp_request_get_uri(req);
+    enum evhttp_cmd_type method = evhttp_request_get_command(req);
+    method_str = evhttp_cmd_type_to_str(method);
+    if (!method_str || !uri_str) {
+        JS_ThrowInternalError(cb->ctx, "method_str or uri_str is NULL");
+        js_std_dump_error(cb->ctx);
+        return;
+    }
+    evhttp_parse_query_str(uri_str, &uri_params);
+    headers = evhttp_request_get_input_headers(req);
+    trace_phase("parse", &t);
+
+    if (rc)
+        req_obj = recycle_req_get(rc, cb->ctx);
+    else
+        req_obj = js_mallocz(cb->ctx, sizeof(*req_obj));
+    if (!req_obj) {
+        js_std_dump_error(cb->ctx);
+        return;
+    }
+    req_obj->ctx = cb->ctx;
+    req_obj->str_fields[HTTP_REQ_URI] = js_strdup(cb->ctx, uri_str);
+    req_obj->str_fields[HTTP_REQ_METHOD] = js_strdup(cb->ctx, method_str);
+    buf = evhttp_request_get_input_buffer(req);
+    len = evbuffer_get_length(buf);
+    if (len > 0 && (method == EVHTTP_REQ_POST || method == EVHTTP_REQ_PUT ||
+                    method == EVHTTP_REQ_PATCH)) {
+        // move the chains instead of copying the bytes
+        req_obj->body_buf = recycle_buf_get(rc);
+        if (!req_obj->body_buf || evbuffer_add_buffer(req_obj->body_buf, buf) ||
+            evbuffer_add(req_obj->body_buf, "", 1)) {
+            http_req_release(req_obj);
+            JS_ThrowOutOfMemory(cb->ctx);
+            js_std_dump_error(cb->ctx);
+            return;
+        }
+    }
+    req_obj->js_fields[HTTP_REQ_PARAMS - HTTP_REQ_PARAMS] =
+        ev_params_to_obj(cb->ctx, &uri_params);
+    req_obj->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS] =
+        ev_headers_to_obj(cb->ctx, headers);
+    trace_phase("marshal", &t);
+
+    argv[0] = JS_NewObjectClass(cb->ctx, http_req_class_id);
+    if (JS_IsException(argv[0])) {
+        http_req_release(req_obj);
+        js_std_dump_error(cb->ctx);
+        return;
+    }
+    JS_SetOpaque(argv[0], req_obj);
+    trace_phase("create", &t);
+
+    ret = route_invoke(cb, argv[0], &aborted);
+    trace_phase("call", &t);
+    // the handler may have started a drain
+    drain_close(cb->server, req);
+    if (aborted) {
+        evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+        return;
+    }
+
+    if (!JS_IsObject(ret)) {
+        js_std_dump_error(cb->ctx);
+        JS_FreeValue(cb->ctx, ret);
+        return;
+    }
+    res_obj = JS_GetOpaque(ret, http_res_class_id);
+    if (!res_obj) {
+        JS_ThrowInternalError(cb->ctx, "callback must return response object");
+        js_std_dump_error(cb->ctx);
+        JS_FreeValue(cb->ctx, ret);
+        return;
+    }
+    buf = recycle_buf_get(rc);
+    if (!buf) {
+        JS_ThrowOutOfMemory(cb->ctx);
+        js_std_dump_error(cb->ctx);
+        JS_FreeValue(cb->ctx, ret);
+        return;
+    }
+    // if (JS_GetPropertyLength(cb->ctx, (int64_t *)&len, res_obj->headers) ==
+    //     -1) {
+    //     js_std_dump_error(cb->ctx);
+    //     return;
+    // }
+    while (!JS_IsUndefined(res_obj->headers)) {
+        key = JS_GetPropertyUint32(cb->ctx, res_obj->headers, idx++);
+        if (JS_IsUndefined(key))
+            break;
+        if (JS_IsException(key)) {
+            js_std_dump_error(cb->ctx);
+            goto done;
+        }
+        atom = JS_ValueToAtom(cb->ctx, key);
+        if (unlikely(atom == JS_ATOM_NULL)) {
+            js_std_dump_error(cb->ctx);
+            goto done;
+        }
+        value = JS_GetProperty(cb->ctx, res_obj->headers, atom);
+        JS_FreeAtom(cb->ctx, atom);
+        if (JS_IsException(value)) {
+            js_std_dump_error(cb->ctx);
+            goto done;
+        }
+        evhttp_add_header(evhttp_request_get_output_headers(req),
+                          JS_ToCString(cb->ctx, key),
+                          JS_ToCString(cb->ctx, value));
+        JS_FreeValue(cb->ctx, key);
+        JS_FreeValue(cb->ctx, value);
+    }
+    etag = res_obj->status == 200 ? etag_kind(cb, method_str) : 0;
+    inm = etag ? evhttp_find_header(headers, "If-None-Match") : NULL;
+    if (etag && res_obj->etag) {
+        // the handler's version decides before anything is serialized
+        etag_from_tag(tag, res_obj->etag);
+        evhttp_add_header(evhttp_request_get_output_headers(req), "ETag", tag);
+        if (inm && etag_match(inm, tag)) {
+            cb->not_modified++;
+            evhttp_send_reply(req, 304, NULL, NULL);
+            trace_phase("send", &t);
+            goto done;
+        }
+        etag = 0;
+    }
+    if (!JS_IsUndefined(res_obj->json)) {
+        if (http_res_add_json(cb->ctx, res_obj, buf) < 0) {
+            js_std_dump_error(cb->ctx);
+            goto done;
+        }
+        if (!evhttp_find_header(evhttp_request_get_output_headers(req),
+                                "Content-Type"))
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                              "Content-Type", "application/json");
+    } else if (res_obj->body)
+        evbuffer_add(buf, res_obj->body, strlen(res_obj->body));
+    if (etag == ETAG_HASH) {
+        etag_from_hash(tag, etag_hash_buffer(buf));
+        evhttp_add_header(evhttp_request_get_output_headers(req), "ETag", tag);
+        if (inm && etag_match(inm, tag)) {
+            cb->not_modified++;
+            evbuffer_drain(buf, evbuffer_get_length(buf));
+            trace_phase("serialize", &t);
+            evhttp_send_reply(req, 304, NULL, NULL);
+            trace_phase("send", &t);
+            goto done;
+        }
+    }
+    trace_phase("serialize", &t);
+    evhttp_send_reply(req, res_obj->status, res_obj->reason, buf);
+    trace_phase("send", &t);
+done:
+    recycle_buf_put(rc, buf);
+    JS_FreeValue(cb->ctx, ret);
+}
+
+static void http_server_request_done(http_server *server) {
+    server->gc.pending++;
+    if (server->gc.threshold && ++server->gc.since_arm >= GC_ARM_EVERY)
+        gc_arm(server);
+    if (server->gc.every && server->gc.pending >= server->gc.every)
+        gc_run(server);
+    else if (server->gc.idle_ev && !server->inflight)
+        event_active(server->gc.idle_ev, EV_TIMEOUT, 0);
+}
+
+static const char *http_export_names[] = {
+    "request",
+    "response",
+    "fetch",
+    "server",
+    "fetchSet",
+    "fetchStats",
+    "fetchAll",
+};
+
+static void http_new_exports(JSContext *ctx, JSValue *exports);
+static int http_new_classes(JSRuntime *rt);
+
+// offload pool, handlers run on worker threads in their own runtime. the
+// request and response cross threads as plain C data
+typedef struct http_job {
+    struct http_job *next;
+    http_server_cb *cb;
+    size_t route;
+    int64_t budget_us;
+    struct evhttp_request *req;
+    char *method;
+    char *uri;
+    struct evkeyvalq headers;
+    struct evbuffer *body;
+    http_res_data *res;
+    int aborted;
+} http_job;
+
+struct http_pool {
+    http_server *server;
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    http_job *head, *tail;
+    http_job *done;
+    int stop;
+    // handler source per offloaded route, compiled lazily by each worker
+    char **srcs;
+    size_t srcs_len;
+    evutil_socket_t wake[2];
+    struct event *wake_ev;
+    size_t queued;
+    uint64_t completed;
+};
+
+typedef struct {
+    int64_t deadline;
+    int interrupted;
+    unsigned polls;
+} http_worker;
+
+static void http_job_free(http_job *job) {
+    free(job->method);
+    free(job->uri);
+    evhttp_clear_headers(&job->headers);
+    if (job->body)
+        evbuffer_free(job->body);
+    http_res_data_free(job->res);
+    free(job);
+}
+
+static void pool_wake(http_pool *pool) {
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(pool->wake[1], &one, sizeof(one)) < 0)
+        return;
+#else
+    send(pool->wake[1], "", 1, 0);
+#endif
+}
+
+static int worker_interrupt(JSRuntime *rt, void *opaque) {
+    http_worker *w = opaque;
+    if (!w->deadline || ++w->polls % INTERRUPT_CLOCK_EVERY ||
+        util_cputime_us() < w->deadline)
+        return 0;
+    w->interrupted = 1;
+    return 1;
+}
+
+static JSContext *worker_ctx_new(http_worker *w) {
+    JSRuntime *rt;
+    JSContext *ctx;
+    JSValue global, http, exports[countof(http_export_names)];
+
+    rt = JS_NewRuntime();
+    if (!rt)
+        return NULL;
+    ctx = JS_NewContext(rt);
+    if (!ctx || http_new_classes(rt) < 0) {
+        if (ctx)
+            JS_FreeContext(ctx);
+        JS_FreeRuntime(rt);
+        return NULL;
+    }
+    JS_SetInterruptHandler(rt, worker_interrupt, w);
+    js_std_add_helpers(ctx, 0, NULL);
+    http_new_exports(ctx, exports);
+    http = JS_NewObject(ctx);
+    for (size_t i = 0; i < countof(http_export_names); ++i) {
+        JS_DefinePropertyValueStr(ctx, http, http_export_names[i], exports[i],
+                                  JS_PROP_C_W_E);
+    }
+    global = JS_GetGlobalObject(ctx);
+    JS_DefinePropertyValueStr(ctx, global, "http", http, JS_PROP_C_W_E);
+    JS_FreeValue(ctx, global);
+    return ctx;
+}
+
+static JSValue worker_compile(JSContext *ctx, const char *src) {
+    size_t len = strlen(src);
+    char *code = malloc(len + 3);
+    JSValue fn;
+    if (!code)
+        return JS_ThrowOutOfMemory(ctx);
+    code[0] = '(';
+    memcpy(code + 1, src, len);
+    code[len + 1] = ')';
+    code[len + 2] = '\0';
+    fn = JS_Eval(ctx, code, len + 2, "<offload>", JS_EVAL_TYPE_GLOBAL);
+    free(code);
+    if (!JS_IsException(fn) && !JS_IsFunction(ctx, fn)) {
+        JS_FreeValue(ctx, fn);
+        return JS_ThrowTypeError(ctx, "offloaded handler is not a function");
+    }
+    return fn;
+}
+
+static void worker_run(JSContext *ctx, http_worker *w, JSValueConst fn,
+                       http_job *job, int64_t t) {
+    http_res *res_obj;
+    JSValue obj, ret;
+
+    obj = http_req_new(ctx, job->method, job->uri, &job->headers, job->body);
+    job->body = NULL;
+    if (JS_IsException(obj)) {
+        js_std_dump_error(ctx);
+        return;
+    }
+    trace_phase("marshal", &t);
+
+    if (job->budget_us > 0)
+        w->deadline = util_cputime_us() + job->budget_us;
+    ret = JS_Call(ctx, fn, JS_UNDEFINED, 1, (JSValueConst *)&obj);
+    w->deadline = 0;
+    trace_phase("call", &t);
+    JS_FreeValue(ctx, obj);
+    if (JS_IsException(ret)) {
+        if (w->interrupted) {
+            w->interrupted = 0;
+            job->aborted = 1;
+            JS_FreeValue(ctx, JS_GetException(ctx));
+        } else {
+            js_std_dump_error(ctx);
+        }
+        return;
+    }
+    w->interrupted = 0;
+    res_obj = JS_GetOpaque(ret, http_res_class_id);
+    if (!res_obj) {
+        JS_ThrowInternalError(ctx, "callback must return response object");
+        js_std_dump_error(ctx);
+    } else if (!(job->res = http_res_data_new(
+                     ctx, res_obj, etag_kind(job->cb, job->method),
+                     evhttp_find_header(&job->headers, "If-None-Match")))) {
+        js_std_dump_error(ctx);
+    }
+    JS_FreeValue(ctx, ret);
+    trace_phase("serialize", &t);
+}
+
+static void *pool_worker(void *arg) {
+    http_pool *pool = arg;
+    http_worker w = {0};
+    JSContext *ctx = worker_ctx_new(&w);
+    JSValue *fns = NULL, *tab;
+    size_t fns_len = 0;
+    const char *src;
+    http_job *job;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (!pool->head) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pool->queued--;
+        src = job->route < pool->srcs_len ? pool->srcs[job->route] : NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (ctx && job->route >= fns_len &&
+            (tab = realloc(fns, (job->route + 1) * sizeof(JSValue)))) {
+            fns = tab;
+            while (fns_len <= job->route)
+                fns[fns_len++] = JS_UNDEFINED;
+        }
+        if (ctx && job->route < fns_len) {
+            if (JS_IsUndefined(fns[job->route]) && src) {
+                fns[job->route] = worker_compile(ctx, src);
+                if (JS_IsException(fns[job->route])) {
+                    js_std_dump_error(ctx);
+                    fns[job->route] = JS_UNDEFINED;
+                }
+            }
+            if (!JS_IsUndefined(fns[job->route])) {
+                int64_t start = trace_begin_request();
+                worker_run(ctx, &w, fns[job->route], job, start);
+                trace_end_request(start, job->cb->path);
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        pthread_mutex_unlock(&pool->lock);
+        pool_wake(pool);
+    }
+
+    if (ctx) {
+        JSRuntime *rt = JS_GetRuntime(ctx);
+        for (size_t i = 0; i < fns_len; ++i) {
+            JS_FreeValue(ctx, fns[i]);
+        }
+        JS_FreeContext(ctx);
+        JS_FreeRuntime(rt);
+    }
+    free(fns);
+    return NULL;
+}
+
+// runs on the server loop, replies for finished jobs
+static void pool_wake_cb(evutil_socket_t fd, short what, void *arg) {
+    http_pool *pool = arg;
+    http_server *server = pool->server;
+    http_job *job, *next;
+    char tmp[64];
+
+#ifdef __linux__
+    ssize_t n = read(fd, tmp, sizeof(uint64_t));
+    (void)n;
+#else
+    while (recv(fd, tmp, sizeof(tmp), 0) > 0)
+        ;
+#endif
+    pthread_mutex_lock(&pool->lock);
+    job = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        drain_close(server, job->req);
+        if (job->aborted) {
+            job->cb->aborted++;
+            evhttp_send_reply(job->req, 503, "Service Unavailable", NULL);
+        } else if (job->res) {
+            if (job->res->status == 304)
+                job->cb->not_modified++;
+            http_res_data_send(job->req, job->res, server->fixed_buf, 1);
+            job->res = NULL;
+        } else {
+            evhttp_send_error(job->req, HTTP_INTERNAL, NULL);
+        }
+        pool->completed++;
+        server->inflight--;
+        http_job_free(job);
+        http_server_request_done(server);
+    }
+}
+
+static void pool_free(http_pool *pool) {
+    http_job *job, *next;
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    // evhttp is already gone, the requests must not be touched
+    for (job = pool->head; job; job = next) {
+        next = job->next;
+        http_job_free(job);
+    }
+    for (job = pool->done; job; job = next) {
+        next = job->next;
+        http_job_free(job);
+    }
+    for (size_t i = 0; i < pool->srcs_len; ++i) {
+        free(pool->srcs[i]);
+    }
+    free(pool->srcs);
+    if (pool->wake_ev)
+        event_free(pool->wake_ev);
+    if (pool->wake[0] >= 0)
+        evutil_closesocket(pool->wake[0]);
+    if (pool->wake[1] >= 0 && pool->wake[1] != pool->wake[0])
+        evutil_closesocket(pool->wake[1]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+}
+
+static http_pool *pool_new(JSContext *ctx, http_server *server, int nthreads) {
+    http_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        JS_ThrowOutOfMemory(ctx);
+        return NULL;
+    }
+    pool->server = server;
+    pool->wake[0] = pool->wake[1] = -1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+#ifdef __linux__
+    pool->wake[0] = pool->wake[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->wake[0] < 0)
+        goto fail;
+#else
+    if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pool->wake) < 0)
+        goto fail;
+    evutil_make_socket_nonblocking(pool->wake[0]);
+#endif
+    if (!server->fixed_buf && !(server->fixed_buf = evbuffer_new()))
+        goto fail;
+    pool->wake_ev = event_new(server->base, pool->wake[0], EV_READ | EV_PERSIST,
+                              pool_wake_cb, pool);
+    if (!pool->wake_ev || event_add(pool->wake_ev, NULL) < 0)
+        goto fail;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool->threads)
+        goto fail;
+    for (; pool->nthreads < nthreads; ++pool->nthreads) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, pool_worker,
+                           pool))
+            goto fail;
+    }
+    return pool;
+fail:
+    pool_free(pool);
+    JS_ThrowInternalError(ctx, "failed to start offload pool");
+    return NULL;
+}
+
+static int pool_add_route(JSContext *ctx, http_pool *pool, JSValueConst fn,
+                          size_t *route) {
+    JSValue str;
+    const char *src;
+    char **tab, *copy;
+
+    str = JS_ToString(ctx, fn);
+    if (JS_IsException(str))
+        return -1;
+    src = JS_ToCString(ctx, str);
+    JS_FreeValue(ctx, str);
+    if (!src)
+        return -1;
+    copy = strdup(src);
+    JS_FreeCString(ctx, src);
+    if (!copy) {
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    tab = realloc(pool->srcs, (pool->srcs_len + 1) * sizeof(char *));
+    if (tab) {
+        pool->srcs = tab;
+        *route = pool->srcs_len;
+        pool->srcs[pool->srcs_len++] = copy;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!tab) {
+        free(copy);
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+static void offload_submit(struct evhttp_request *req, http_server_cb *cb) {
+    http_pool *pool = cb->server->pool;
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    struct evbuffer *buf = evhttp_request_get_input_buffer(req);
+    const char *method = evhttp_cmd_type_to_str(evhttp_request_get_command(req));
+    http_job *job;
+
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    job->headers.tqh_last = &job->headers.tqh_first;
+    job->cb = cb;
+    job->route = cb->offload_route;
+    job->budget_us = cb->budget_us;
+    job->req = req;
+    job->method = strdup(method ? method : "GET");
+    job->uri = strdup(evhttp_request_get_uri(req));
+    if (!job->method || !job->uri)
+        goto fail;
+    for (struct evkeyval *p = headers->tqh_first; p; p = p->next.tqe_next) {
+        if (evhttp_add_header(&job->headers, p->key, p->value) < 0)
+            goto fail;
+    }
+    if (evbuffer_get_length(buf) > 0) {
+        job->body = evbuffer_new();
+        if (!job->body || evbuffer_add_buffer(job->body, buf) ||
+            evbuffer_add(job->body, "", 1))
+            goto fail;
+    }
+
+    cb->requests++;
+    cb->server->inflight++;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+fail:
+    http_job_free(job);
+    evhttp_send_error(req, HTTP_INTERNAL, NULL);
+}
+
+// gc, watchdog and trace bookkeeping around a handler on the loop thread,
+// returns the trace start
+static int64_t route_enter(http_server_cb *cb, int64_t *heap) {
+    http_server *server = cb->server;
+    JSRuntime *rt = JS_GetRuntime(cb->ctx);
+    JSMemoryUsage usage;
+
+    if (server->gc.metrics) {
+        JS_ComputeMemoryUsage(rt, &usage);
+        *heap = usage.malloc_size;
+    }
+    server->inflight++;
+    __atomic_store_n(&server->watchdog.current, cb, __ATOMIC_RELEASE);
+    return trace_begin_request();
+}
+
+static void route_leave(http_server_cb *cb, int64_t heap, int64_t start) {
+    http_server *server = cb->server;
+    JSMemoryUsage usage;
+
+    __atomic_store_n(&server->watchdog.current, NULL, __ATOMIC_RELEASE);
+    // a stall the handler never polled through is not the next one's
+    __atomic_store_n(&server->watchdog.capture, NULL, __ATOMIC_RELEASE);
+    trace_end_request(start, cb->path);
+    server->inflight--;
+    if (server->gc.metrics) {
+        JS_ComputeMemoryUsage(JS_GetRuntime(cb->ctx), &usage);
+        heap = usage.malloc_size - heap;
+        server->gc.samples++;
+        server->gc.growth_total += heap;
+        if (heap > server->gc.growth_max)
+            server->gc.growth_max = heap;
+    }
+    http_server_request_done(server);
+}
+
+// swaps a Content-Encoding body for the decoded one. returns 0, or the
+// status to reject the request with
+static int body_decode(http_server *server, struct evkeyvalq *headers,
+                       struct evbuffer *body) {
+    const char *enc = evhttp_find_header(headers, "Content-Encoding");
+    size_t len = evbuffer_get_length(body);
+    struct evbuffer *out;
+    char num[24];
+    int ret;
+
+    if (!enc || !len || server->decompress.off || !strcasecmp(enc, "identity"))
+        return 0;
+    if (!(out = evbuffer_new()))
+        return HTTP_INTERNAL;
+    ret = decode_body(enc, body, out, &server->decompress.limits);
+    if (ret == DECODE_OK) {
+        server->decompress.requests++;
+        server->decompress.encoded_bytes += len;
+        server->decompress.decoded_bytes += evbuffer_get_length(out);
+        evbuffer_drain(body, len);
+        evbuffer_add_buffer(body, out);
+        evhttp_remove_header(headers, "Content-Encoding");
+        evhttp_remove_header(headers, "Content-Length");
+        snprintf(num, sizeof(num), "%zu", evbuffer_get_length(body));
+        evhttp_add_header(headers, "Content-Length", num);
+    } else {
+        server->decompress.rejected++;
+    }
+    evbuffer_free(out);
+    switch (ret) {
+    case DECODE_OK:
+        return 0;
+    case DECODE_UNSUPPORTED:
+        return 415;
+    case DECODE_TOO_LARGE:
+        return 413;
+    case DECODE_CORRUPT:
+        return HTTP_BADREQUEST;
+    default:
+        return HTTP_INTERNAL;
+    }
+}
+
+static void route_run(struct evhttp_request *req, http_server_cb *cb) {
+    int64_t heap = 0, start;
+
+    if (cb->offload) {
+        offload_submit(req, cb);
+        return;
+    }
+    start = route_enter(cb, &heap);
+    route_call(req, cb, start);
+    route_leave(cb, heap, start);
+}
+
+static void sched_push(http_server *server, struct evhttp_request *req,
+                       http_server_cb *cb) {
+    sched_class *c = &server->sched.classes[cb->priority];
+    sched_item *it;
+
+    if (c->len >= c->max_queue || !(it = malloc(sizeof(*it)))) {
+        c->rejected++;
+        evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+        return;
+    }
+    it->next = NULL;
+    it->req = req;
+    it->cb = cb;
+    it->queued_at = util_now_us();
+    if (cb->queue_tail)
+        cb->queue_tail->next = it;
+    else
+        cb->queue_head = it;
+    cb->queue_tail = it;
+    c->len++;
+    // after the rest of this iteration's reads have been parsed
+    if (!event_pending(server->sched.ev, EV_TIMEOUT, NULL))
+        event_active(server->sched.ev, EV_TIMEOUT, 0);
+}
+
+// smooth weighted round robin over the classes that have work
+static sched_class *sched_pick(http_server *server) {
+    sched_class *best = NULL;
+    int64_t total = 0;
+
+    for (int i = 0; i < SCHED_COUNT; ++i) {
+        sched_class *c = &server->sched.classes[i];
+        if (!c->len)
+            continue;
+        c->current += c->weight;
+        total += c->weight;
+        if (!best || c->current > best->current)
+            best = c;
+    }
+    if (best)
+        best->current -= total;
+    return best;
+}
+
+// the same between the routes of the class that have work
+static http_server_cb *sched_pick_route(http_server *server, int priority) {
+    http_server_cb *best = NULL;
+    int64_t total = 0;
+
+    for (size_t i = 0; i < server->cbs_len; ++i) {
+        http_server_cb *cb = server->cbs[i];
+        if (cb->priority != priority || !cb->queue_head)
+            continue;
+        cb->current += cb->weight;
+        total += cb->weight;
+        if (!best || cb->current > best->current)
+            best = cb;
+    }
+    if (best)
+        best->current -= total;
+    return best;
+}
+
+#define SCHED_DRAIN_MAX 32
+
+static void sched_drain_cb(evutil_socket_t fd, short what, void *arg) {
+    http_server *server = arg;
+    http_server_cb *cb;
+    sched_class *c;
+    sched_item *it;
+    int64_t now, wait;
+
+    for (int n = 0; n < SCHED_DRAIN_MAX && (c = sched_pick(server)); ++n) {
+        cb = sched_pick_route(server, (int)(c - server->sched.classes));
+        it = cb->queue_head;
+        cb->queue_head = it->next;
+        if (!cb->queue_head)
+            cb->queue_tail = NULL;
+        c->len--;
+        now = util_now_us();
+        wait = now - it->queued_at;
+        util_hist_add(&c->wait, wait);
+        if (!evhttp_request_get_connection(it->req)) {
+            // the client is gone, replying only frees the request
+            c->cancelled++;
+            evhttp_send_reply(it->req, 503, "Service Unavailable", NULL);
+        } else if (c->deadline_us && wait > c->deadline_us) {
+            c->expired++;
+            evhttp_send_reply(it->req, 503, "Service Unavailable", NULL);
+        } else {
+            c->served++;
+            route_run(it->req, it->cb);
+        }
+        free(it);
+    }
+    // the rest waits for the next loop iteration so new input gets parsed
+    for (int i = 0; i < SCHED_COUNT; ++i) {
+        if (server->sched.classes[i].len) {
+            struct timeval tv = {0, 0};
+            event_add(server->sched.ev, &tv);
+            break;
+        }
+    }
+}
+
+#ifdef HTTP_NGHTTP2
+// h2c only on plain connections, tls ones negotiate h2 with ALPN
+static int server_h2_upgrade(http_server *server,
+                             struct evhttp_request *req) {
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    if (!server_h2_on(server) || !evcon ||
+        evhttp_connection_get_server(evcon) != server->http)
+        return -1;
+    if (h2_upgrade(server->h2, req,
+                   evhttp_cmd_type_to_str(evhttp_request_get_command(req))))
+        return -1;
+    conn_forget(server, evcon);
+    return 0;
+}
+#endif
+
+static void callback_helper(struct evhttp_request *req, void *arg) {
+    http_server_cb *cb = arg;
+    int status;
+
+#ifdef HTTP_NGHTTP2
+    if (!server_h2_upgrade(cb->server, req))
+        return;
+#endif
+    conn_track(cb->server, req);
+    access_log_begin(req);
+    capture_request(req);
+    status = body_decode(cb->server, evhttp_request_get_input_headers(req),
+                         evhttp_request_get_input_buffer(req));
+    if (status) {
+        if (status == 415)
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                              "Accept-Encoding", decode_accepted());
+        evhttp_send_error(req, status, NULL);
+        return;
+    }
+    if (cb->server->sched.on)
+        sched_push(cb->server, req, cb);
+    else
+        route_run(req, cb);
+}
+
+// route options, like {budgetMs: 50}
+static int http_server_cb_set(JSContext *ctx, http_server_cb *cb,
+                              JSValueConst opts) {
+    JSValue v;
+    double d;
+    int ret;
+
+    if (JS_IsUndefined(opts))
+        return 0;
+    if (!JS_IsObject(opts)) {
+        JS_ThrowTypeError(ctx, "on([path, handler, opts]), opts must be object");
+        return -1;
+    }
+    if ((ret = opt_number(ctx, opts, "budgetMs", &d)) < 0)
+        return -1;
+    if (ret)
+        cb->budget_us = (int64_t)(d * 1000);
+    opt_bool(ctx, opts, "offload", &cb->offload);
+    if (opt_bool(ctx, opts, "etag", &ret) > 0 && ret)
+        cb->etag = ETAG_HASH;
+
+    v = JS_GetPropertyStr(ctx, opts, "priority");
+    if (!JS_IsUndefined(v)) {
+        cb->priority = sched_class_of(ctx, v);
+        JS_FreeValue(ctx, v);
+        if (cb->priority < 0 || sched_enable(ctx, cb->server) < 0)
+            return -1;
+    }
+    // share of the class between its routes, the class weight is set with
+    // scheduler.{class}.weight
+    if ((ret = opt_number(ctx, opts, "weight", &d)) < 0)
+        return -1;
+    if (ret)
+        cb->weight = d < 1 ? 1 : (int)d;
+    return 0;
+}
+
+static JSValue http_server_on(JSContext *ctx, JSValueConst this_val, int argc,
+                              JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    char *path;
+    JSValue call_back, *callbacks;
+    http_server_cb *cb, **cbs;
+    http_pool *pool;
+    int sched_on;
+
+    if (!server)
+        return JS_EXCEPTION;
+    if (argc < 2)
+        return JS_ThrowTypeError(ctx, "on([path, handler]), path and handler "
+                                      "must be string and function");
+    if (!JS_ToCString(ctx, argv[0]) || !JS_IsFunction(ctx, argv[1]))
+        return JS_ThrowTypeError(ctx, "on([path, handler]), path and handler "
+                                      "must be string and function");
+
+    path = (char *)JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+
+    callbacks = js_realloc(ctx, server->callbacks,
+                           (server->callbacks_len + 1) * sizeof(JSValue));
+    if (!callbacks) {
+        js_free(ctx, path);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    server->callbacks = callbacks;
+    call_back = JS_DupValue(ctx, argv[1]);
+    server->callbacks[server->callbacks_len] = call_back;
+    server->callbacks_len++;
+    // put back on failure
+    pool = server->pool;
+    sched_on = server->sched.on;
+
+    cbs = js_realloc(ctx, server->cbs,
+                     (server->cbs_len + 1) * sizeof(http_server_cb *));
+    cb = js_mallocz(ctx, sizeof(http_server_cb));
+    if (cbs)
+        server->cbs = cbs;
+    if (!cbs || !cb || !(cb->path = js_strdup(ctx, path))) {
+        JS_ThrowOutOfMemory(ctx);
+        goto fail;
+    }
+    cb->ctx = ctx;
+    cb->server = server;
+    cb->server_this = this_val;
+    cb->callback_index = server->callbacks_len - 1;
+    cb->etag = ETAG_TAG;
+    cb->priority = SCHED_NORMAL;
+    cb->weight = 1;
+    if (http_server_cb_set(ctx, cb, argc > 2 ? argv[2] : JS_UNDEFINED) < 0)
+        goto fail;
+    if (cb->offload) {
+        if (!server->pool &&
+            !(server->pool = pool_new(ctx, server,
+                                      server->workers > 0 ? server->workers
+                                                          : 4)))
+            goto fail;
+        if (pool_add_route(ctx, server->pool, argv[1], &cb->offload_route) <
+            0)
+            goto fail;
+    }
+    if (server_set_cb(server, path, callback_helper, cb) < 0) {
+        JS_ThrowInternalError(ctx, "Failed to set callback for path: %s",
+                              path);
+        goto fail;
+    }
+    server->cbs[server->cbs_len++] = cb;
+    js_free(ctx, path);
+    return JS_UNDEFINED;
+fail:
+    // nothing refers to the route yet
+    if (cb)
+        js_free(ctx, cb->path);
+    js_free(ctx, cb);
+    server->callbacks_len--;
+    JS_FreeValue(ctx, call_back);
+    if (!pool && server->pool) {
+        pool_free(server->pool);
+        server->pool = NULL;
+    }
+    if (!sched_on && server->sched.on)
+        sched_disable(server);
+    js_free(ctx, path);
+    return JS_EXCEPTION;
+}
+
+// answered from the pre-serialized data, no JS involved
+static void fixed_callback(struct evhttp_request *req, void *arg) {
+    http_server_fixed *fixed = arg;
+#ifdef HTTP_NGHTTP2
+    if (!server_h2_upgrade(fixed->server, req))
+        return;
+#endif
+    conn_track(fixed->server, req);
+    access_log_begin(req);
+    capture_request(req);
+    http_res_data_send(req, fixed->data, fixed->server->fixed_buf, 0);
+}
+
+static JSValue http_server_fixed_add(JSContext *ctx, JSValueConst this_val,
+                                     int argc, JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    http_server_fixed *fixed, **tab;
+    http_res *res;
+    const char *path;
+
+    if (!server)
+        return JS_EXCEPTION;
+    if (argc < 2 || !(res = JS_GetOpaque(argv[1], http_res_class_id)))
+        return JS_ThrowTypeError(ctx, "fixed([path, response]), path and "
+                                      "response must be string and response");
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+
+    if (!server->fixed_buf && !(server->fixed_buf = evbuffer_new())) {
+        JS_FreeCString(ctx, path);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    tab = js_realloc(ctx, server->fixed,
+                     (server->fixed_len + 1) * sizeof(*server->fixed));
+    if (!tab) {
+        JS_FreeCString(ctx, path);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    server->fixed = tab;
+    fixed = js_mallocz(ctx, sizeof(*fixed));
+    if (!fixed) {
+        JS_FreeCString(ctx, path);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    fixed->server = server;
+    fixed->data = http_res_data_new(ctx, res, 0, NULL);
+    if (!fixed->data) {
+        js_free(ctx, fixed);
+        JS_FreeCString(ctx, path);
+        return JS_EXCEPTION;
+    }
+    fixed->path = js_strdup(ctx, path);
+    if (!fixed->path || server_set_cb(server, path, fixed_callback, fixed) < 0) {
+        http_res_data_free(fixed->data);
+        js_free(ctx, fixed->path);
+        js_free(ctx, fixed);
+        JS_ThrowInternalError(ctx, "Failed to set callback for path: %s",
+                              path);
+        JS_FreeCString(ctx, path);
+        return JS_EXCEPTION;
+    }
+    server->fixed[server->fixed_len++] = fixed;
+    JS_FreeCString(ctx, path);
+    return JS_UNDEFINED;
+}
+
+// reverse proxy, bodies are moved between evbuffers and never enter JS
+#define PROXY_HIGH_WATER (1 << 20)
+
+typedef struct {
+    struct evhttp_connection *evcon;
+    size_t active;
+} proxy_conn;
+
+typedef struct {
+    http_proxy *px;
+    char *url;
+    char *host;
+    int port;
+    // allocated one by one, transfers keep pointers to them
+    proxy_conn **conns;
+    size_t conns_len;
+    size_t active;
+    int healthy;
+    int fails;
+    // without healthPath, when an unhealthy upstream gets its next try
+    int64_t retry_at;
+    struct evhttp_connection *health_conn;
+    uint64_t requests;
+    uint64_t errors;
+} http_upstream;
+
+typedef struct proxy_xfer {
+    struct proxy_xfer *prev, *next;
+    http_upstream *up;
+    proxy_conn *conn;
+    struct evhttp_request *req;
+    int started;
+    int paused;
+} proxy_xfer;
+
+struct http_proxy {
+    http_server *server;
+    char *prefix;
+    size_t prefix_len;
+    http_upstream *ups;
+    size_t ups_len;
+    int least_conn;
+    size_t rr;
+    int max_conns;
+    int timeout;
+    char *health_path;
+    int health_fails;
+    struct timeval health_interval;
+    struct event *health_ev;
+    proxy_xfer *xfers;
+};
+
+static const char *hop_headers[] = {
+    "Connection",          "Keep-Alive", "Proxy-Authenticate",
+    "Proxy-Authorization", "TE",         "Trailer",
+    "Transfer-Encoding",   "Upgrade",
+};
+
+static void proxy_copy_headers(struct evkeyvalq *dst, struct evkeyvalq *src) {
+    for (struct evkeyval *p = src->tqh_first; p; p = p->next.tqe_next) {
+        size_t i;
+        for (i = 0; i < countof(hop_headers); ++i) {
+            if (!evutil_ascii_strcasecmp(p->key, hop_headers[i]))
+                break;
+        }
+        if (i == countof(hop_headers))
+            evhttp_add_header(dst, p->key, p->value);
+    }
+}
+
+static int64_t proxy_retry_us(const http_proxy *px) {
+    return (int64_t)px->health_interval.tv_sec * 1000000 +
+           px->health_interval.tv_usec;
+}
+
+static void proxy_mark(http_upstream *up, int ok) {
+    if (ok) {
+        up->fails = 0;
+        up->healthy = 1;
+    } else if (++up->fails >= up->px->health_fails) {
+        up->healthy = 0;
+        up->retry_at = util_now_us() + proxy_retry_us(up->px);
+    }
+}
+
+// an unhealthy upstream is left out until the probe passes. without
+// healthPath it gets one request per interval, whose result decides
+static int proxy_usable(http_upstream *up) {
+    int64_t now;
+    if (up->healthy)
+        return 1;
+    if (up->px->health_path || (now = util_now_us()) < up->retry_at)
+        return 0;
+    up->retry_at = now + proxy_retry_us(up->px);
+    return 1;
+}
+
+static http_upstream *proxy_pick(http_proxy *px) {
+    http_upstream *best = NULL;
+    for (size_t i = 0; i < px->ups_len; ++i) {
+        http_upstream *up = &px->ups[(px->rr + i) % px->ups_len];
+        if (!proxy_usable(up))
+            continue;
+        if (!px->least_conn) {
+            best = up;
+            break;
+        }
+        if (!best || up->active < best->active)
+            best = up;
+    }
+    px->rr++;
+    return best;
+}
+
+static proxy_conn *proxy_conn_get(http_upstream *up) {
+    http_server *server = up->px->server;
+    proxy_conn *conn = NULL, *fresh, **tab;
+
+    for (size_t i = 0; i < up->conns_len; ++i) {
+        if (!conn || up->conns[i]->active < conn->active)
+            conn = up->conns[i];
+    }
+    if (conn && (!conn->active || up->conns_len >= (size_t)up->px->max_conns))
+        return conn;
+    tab = realloc(up->conns, (up->conns_len + 1) * sizeof(*tab));
+    if (!tab)
+        return conn;
+    up->conns = tab;
+    fresh = calloc(1, sizeof(*fresh));
+    if (!fresh)
+        return conn;
+    fresh->evcon = evhttp_connection_base_new(server->base, NULL, up->host,
+                                              (unsigned short)up->port);
+    if (!fresh->evcon) {
+        free(fresh);
+        return conn;
+    }
+    evhttp_connection_set_timeout(fresh->evcon, up->px->timeout);
+    up->conns[up->conns_len++] = fresh;
+    return fresh;
+}
+
+static void proxy_xfer_end(proxy_xfer *x) {
+    http_proxy *px = x->up->px;
+    x->conn->active--;
+    x->up->active--;
+    if (x->prev)
+        x->prev->next = x->next;
+    else
+        px->xfers = x->next;
+    if (x->next)
+        x->next->prev = x->prev;
+    free(x);
+    px->server->inflight--;
+    http_server_request_done(px->server);
+}
+
+static int proxy_header_cb(struct evhttp_request *ureq, void *arg) {
+    proxy_xfer *x = arg;
+    proxy_copy_headers(evhttp_request_get_output_headers(x->req),
+                       evhttp_request_get_input_headers(ureq));
+    drain_close(x->up->px->server, x->req);
+    evhttp_send_reply_start(x->req, evhttp_request_get_response_code(ureq),
+                            evhttp_request_get_response_code_line(ureq));
+    x->started = 1;
+    return 0;
+}
+
+static void proxy_drained_cb(struct evhttp_connection *evcon, void *arg) {
+    proxy_xfer *x = arg;
+    if (x->paused) {
+        x->paused = 0;
+        bufferevent_enable(evhttp_connection_get_bufferevent(x->conn->evcon),
+                           EV_READ);
+    }
+}
+
+static void proxy_chunk_cb(struct evhttp_request *ureq, void *arg) {
+    proxy_xfer *x = arg;
+    struct evbuffer *buf = evhttp_request_get_input_buffer(ureq);
+    struct evhttp_connection *evcon = evhttp_request_get_connection(x->req);
+
+    if (!evcon) {
+        // client is gone, let the upstream response run out
+        evbuffer_drain(buf, evbuffer_get_length(buf));
+        return;
+    }
+    evhttp_send_reply_chunk_with_cb(x->req, buf, proxy_drained_cb, x);
+    if (evbuffer_get_length(bufferevent_get_output(
+            evhttp_connection_get_bufferevent(evcon))) > PROXY_HIGH_WATER) {
+        x->paused = 1;
+        bufferevent_disable(evhttp_connection_get_bufferevent(x->conn->evcon),
+                            EV_READ);
+    }
+}
+
+static void proxy_done_cb(struct evhttp_request *ureq, void *arg) {
+    proxy_xfer *x = arg;
+    int code = ureq ? evhttp_request_get_response_code(ureq) : 0;
+
+    if (x->paused)
+        bufferevent_enable(evhttp_connection_get_bufferevent(x->conn->evcon),
+                           EV_READ);
+    // a 5xx is passed on but counts against the upstream
+    if (!code || code >= 500)
+        x->up->errors++;
+    proxy_mark(x->up, code && code < 500);
+    if (x->started) {
+        struct evhttp_connection *evcon = evhttp_request_get_connection(x->req);
+        if (!code) {
+            // no last chunk, the client has to see the body as cut short
+            if (evcon)
+                evhttp_connection_free(evcon);
+            proxy_xfer_end(x);
+            return;
+        }
+        if (evcon)
+            evhttp_send_reply_chunk_with_cb(x->req,
+                                            evhttp_request_get_input_buffer(ureq),
+                                            NULL, NULL);
+        evhttp_send_reply_end(x->req);
+    } else {
+        evhttp_send_error(x->req, 502, "Bad Gateway");
+    }
+    proxy_xfer_end(x);
+}
+
+static void proxy_handle(http_proxy *px, struct evhttp_request *req) {
+    http_upstream *up = proxy_pick(px);
+    struct evhttp_request *ureq;
+    struct evkeyvalq *out;
+    proxy_xfer *x;
+    char host[300];
+
+    if (!up) {
+        evhttp_send_error(req, 503, "No Healthy Upstream");
+        return;
+    }
+    x = calloc(1, sizeof(*x));
+    if (!x || !(x->conn = proxy_conn_get(up))) {
+        free(x);
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    x->up = up;
+    x->req = req;
+    ureq = evhttp_request_new(proxy_done_cb, x);
+    if (!ureq) {
+        free(x);
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    evhttp_request_set_header_cb(ureq, proxy_header_cb);
+    evhttp_request_set_chunked_cb(ureq, proxy_chunk_cb);
+
+    out = evhttp_request_get_output_headers(ureq);
+    proxy_copy_headers(out, evhttp_request_get_input_headers(req));
+    evhttp_remove_header(out, "Host");
+    snprintf(host, sizeof(host), "%s:%d", up->host, up->port);
+    evhttp_add_header(out, "Host", host);
+    if (evhttp_request_get_connection(req)) {
+        const char *prior = evhttp_find_header(out, "X-Forwarded-For");
+        char *peer, *list;
+        ev_uint16_t port;
+        evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer,
+                                   &port);
+        if (!prior) {
+            evhttp_add_header(out, "X-Forwarded-For", peer);
+        } else if ((list = malloc(strlen(prior) + strlen(peer) + 3))) {
+            // earlier proxies first, this hop's client last
+            sprintf(list, "%s, %s", prior, peer);
+            evhttp_remove_header(out, "X-Forwarded-For");
+            evhttp_add_header(out, "X-Forwarded-For", list);
+            free(list);
+        }
+    }
+    evbuffer_add_buffer(evhttp_request_get_output_buffer(ureq),
+                        evhttp_request_get_input_buffer(req));
+
+    if (evhttp_make_request(x->conn->evcon, ureq, evhttp_request_get_command(req),
+                            evhttp_request_get_uri(req)) < 0) {
+        free(x);
+        up->errors++;
+        evhttp_send_error(req, 502, "Bad Gateway");
+        return;
+    }
+    x->conn->active++;
+    up->active++;
+    up->requests++;
+    x->next = px->xfers;
+    if (px->xfers)
+        px->xfers->prev = x;
+    px->xfers = x;
+    px->server->inflight++;
+}
+
+// paths without an exact handler
+static void proxy_gencb(struct evhttp_request *req, void *arg) {
+    http_server *server = arg;
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+
+    conn_track(server, req);
+    access_log_begin(req);
+    for (size_t i = 0; path && i < server->proxies_len; ++i) {
+        http_proxy *px = server->proxies[i];
+        if (!strncmp(path, px->prefix, px->prefix_len)) {
+            proxy_handle(px, req);
+            return;
+        }
+    }
+    evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+}
+
+static void proxy_health_done(struct evhttp_request *ureq, void *arg) {
+    http_upstream *up = arg;
+    int code = ureq ? evhttp_request_get_response_code(ureq) : 0;
+    proxy_mark(up, code >= 200 && code < 400);
+}
+
+static void proxy_health_cb(evutil_socket_t fd, short what, void *arg) {
+    http_proxy *px = arg;
+    struct evhttp_request *ureq;
+    char host[300];
+
+    for (size_t i = 0; i < px->ups_len; ++i) {
+        http_upstream *up = &px->ups[i];
+        if (!up->health_conn) {
+            up->health_conn = evhttp_connection_base_new(
+                px->server->base, NULL, up->host, (unsigned short)up->port);
+            if (!up->health_conn)
+                continue;
+            evhttp_connection_set_timeout(
+                up->health_conn, (int)px->health_interval.tv_sec > 0
+                                     ? (int)px->health_interval.tv_sec
+                                     : 1);
+        }
+        ureq = evhttp_request_new(proxy_health_done, up);
+        if (!ureq)
+            continue;
+        snprintf(host, sizeof(host), "%s:%d", up->host, up->port);
+        evhttp_add_header(evhttp_request_get_output_headers(ureq), "Host",
+                          host);
+        if (evhttp_make_request(up->health_conn, ureq, EVHTTP_REQ_GET,
+                                px->health_path) < 0)
+            proxy_mark(up, 0);
+    }
+}
+
+static void proxy_free(http_proxy *px) {
+    proxy_xfer *x, *next;
+    if (!px)
+        return;
+    if (px->health_ev)
+        event_free(px->health_ev);
+    // pending upstream requests are dropped without their callbacks
+    for (size_t i = 0; i < px->ups_len; ++i) {
+        http_upstream *up = &px->ups[i];
+        for (size_t j = 0; j < up->conns_len; ++j) {
+            evhttp_connection_free(up->conns[j]->evcon);
+            free(up->conns[j]);
+        }
+        if (up->health_conn)
+            evhttp_connection_free(up->health_conn);
+        free(up->conns);
+        free(up->url);
+        free(up->host);
+    }
+    for (x = px->xfers; x; x = next) {
+        next = x->next;
+        free(x);
+    }
+    free(px->ups);
+    free(px->prefix);
+    free(px->health_path);
+    free(px);
+}
+
+static int proxy_add_upstream(JSContext *ctx, http_proxy *px, const char *url) {
+    struct evhttp_uri *uri = evhttp_uri_parse(url);
+    http_upstream *up;
+    const char *scheme, *host;
+
+    if (!uri) {
+        JS_ThrowTypeError(ctx, "invalid upstream: %s", url);
+        return -1;
+    }
+    scheme = evhttp_uri_get_scheme(uri);
+    host = evhttp_uri_get_host(uri);
+    if (!host || (scheme && strcmp(scheme, "http"))) {
+        evhttp_uri_free(uri);
+        JS_ThrowTypeError(ctx, "upstream must be http://host[:port]: %s", url);
+        return -1;
+    }
+    up = &px->ups[px->ups_len];
+    memset(up, 0, sizeof(*up));
+    up->px = px;
+    up->healthy = 1;
+    up->url = strdup(url);
+    up->host = strdup(host);
+    up->port = evhttp_uri_get_port(uri) > 0 ? evhttp_uri_get_port(uri) : 80;
+    evhttp_uri_free(uri);
+    if (!up->url || !up->host) {
+        free(up->url);
+        free(up->host);
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    px->ups_len++;
+    return 0;
+}
+
+// proxy(prefix, {upstreams, balance, maxConns, timeoutMs, healthPath,
+// healthIntervalMs, healthFails})
+static JSValue http_server_proxy(JSContext *ctx, JSValueConst this_val,
+                                 int argc, JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    http_proxy *px = NULL, **tab;
+    JSValue v = JS_UNDEFINED, item;
+    const char *str;
+    int64_t len;
+    double d;
+    int ret;
+
+    if (!server)
+        return JS_EXCEPTION;
+    if (argc < 2 || !JS_IsString(argv[0]) || !JS_IsObject(argv[1]))
+        return JS_ThrowTypeError(ctx, "proxy([prefix, opts]), prefix and opts "
+                                      "must be string and object");
+    px = calloc(1, sizeof(*px));
+    if (!px)
+        return JS_ThrowOutOfMemory(ctx);
+    px->server = server;
+    px->max_conns = 16;
+    px->timeout = 30;
+    px->health_fails = 2;
+    px->health_interval.tv_sec = 5;
+
+    str = JS_ToCString(ctx, argv[0]);
+    if (!str)
+        goto fail;
+    px->prefix = strdup(str);
+    JS_FreeCString(ctx, str);
+    if (!px->prefix)
+        goto oom;
+    px->prefix_len = strlen(px->prefix);
+
+    v = JS_GetPropertyStr(ctx, argv[1], "upstreams");
+    if (!JS_IsArray(ctx, v) ||
+        JS_ToInt64(ctx, &len, JS_GetPropertyStr(ctx, v, "length")) || len < 1) {
+        JS_ThrowTypeError(ctx, "proxy([prefix, opts]), opts.upstreams must be "
+                               "a non-empty array");
+        goto fail;
+    }
+    px->ups = calloc(len, sizeof(http_upstream));
+    if (!px->ups)
+        goto oom;
+    for (int64_t i = 0; i < len; ++i) {
+        item = JS_GetPropertyUint32(ctx, v, (uint32_t)i);
+        str = JS_IsString(item) ? JS_ToCString(ctx, item) : NULL;
+        JS_FreeValue(ctx, item);
+        if (!str) {
+            JS_ThrowTypeError(ctx, "proxy([prefix, opts]), opts.upstreams "
+                                   "must be strings");
+            goto fail;
+        }
+        ret = proxy_add_upstream(ctx, px, str);
+        JS_FreeCString(ctx, str);
+        if (ret < 0)
+            goto fail;
+    }
+    JS_FreeValue(ctx, v);
+
+    v = JS_GetPropertyStr(ctx, argv[1], "balance");
+    if (!JS_IsUndefined(v)) {
+        str = JS_ToCString(ctx, v);
+        if (!str)
+            goto fail;
+        if (!strcmp(str, "least_conn"))
+            px->least_conn = 1;
+        else if (strcmp(str, "round_robin")) {
+            JS_FreeCString(ctx, str);
+            JS_ThrowTypeError(ctx, "proxy([prefix, opts]), opts.balance must "
+                                   "be round_robin or least_conn");
+            goto fail;
+        }
+        JS_FreeCString(ctx, str);
+    }
+    JS_FreeValue(ctx, v);
+    v = JS_UNDEFINED;
+
+    if ((ret = opt_number(ctx, argv[1], "maxConns", &d)) < 0)
+        goto fail;
+    if (ret && d >= 1)
+        px->max_conns = (int)d;
+    if ((ret = opt_number(ctx, argv[1], "timeoutMs", &d)) < 0)
+        goto fail;
+    if (ret)
+        px->timeout = d < 1000 ? 1 : (int)(d / 1000);
+    if ((ret = opt_number(ctx, argv[1], "healthFails", &d)) < 0)
+        goto fail;
+    if (ret && d >= 1)
+        px->health_fails = (int)d;
+    if ((ret = opt_number(ctx, argv[1], "healthIntervalMs", &d)) < 0)
+        goto fail;
+    if (ret) {
+        px->health_interval.tv_sec = (long)(d / 1000);
+        px->health_interval.tv_usec = (long)((int64_t)(d * 1000) % 1000000);
+    }
+    v = JS_GetPropertyStr(ctx, argv[1], "healthPath");
+    if (!JS_IsUndefined(v)) {
+        str = JS_ToCString(ctx, v);
+        if (!str)
+            goto fail;
+        px->health_path = strdup(str);
+        JS_FreeCString(ctx, str);
+        if (!px->health_path)
+            goto oom;
+        px->health_ev =
+            event_new(server->base, -1, EV_PERSIST, proxy_health_cb, px);
+        if (!px->health_ev || event_add(px->health_ev, &px->health_interval))
+            goto oom;
+    }
+    JS_FreeValue(ctx, v);
+    v = JS_UNDEFINED;
+
+    tab = js_realloc(ctx, server->proxies,
+                     (server->proxies_len + 1) * sizeof(http_proxy *));
+    if (!tab)
+        goto oom;
+    server->proxies = tab;
+    server->proxies[server->proxies_len++] = px;
+    server_set_gencb(server, proxy_gencb, server);
+    return JS_UNDEFINED;
+oom:
+    JS_ThrowOutOfMemory(ctx);
+fail:
+    JS_FreeValue(ctx, v);
+    proxy_free(px);
+    return JS_EXCEPTION;
+}
+
+#if defined(HTTP_URING) || defined(HTTP_NGHTTP2)
+// picks the route evhttp would, on the decoded path without the query.
+// returns 0 with cb or fixed set, else the status to answer with
+static int backend_route(http_server *server, const char *uri,
+                         http_server_cb **cb, http_server_fixed **fixed) {
+    struct evhttp_uri *parsed;
+    const char *path = NULL;
+    char *decoded = NULL;
+
+    *cb = NULL;
+    *fixed = NULL;
+    parsed = evhttp_uri_parse_with_flags(uri, 0);
+    if (parsed)
+        path = evhttp_uri_get_path(parsed);
+    if (path)
+        decoded = evhttp_uridecode(path, 0, NULL);
+    evhttp_uri_free(parsed);
+    if (!decoded)
+        return HTTP_BADREQUEST;
+    for (size_t i = 0; i < server->fixed_len && !*fixed; ++i) {
+        if (!strcmp(server->fixed[i]->path, decoded))
+            *fixed = server->fixed[i];
+    }
+    for (size_t i = 0; i < server->cbs_len && !*fixed && !*cb; ++i) {
+        if (!strcmp(server->cbs[i]->path, decoded))
+            *cb = server->cbs[i];
+    }
+    free(decoded);
+    return *cb || *fixed ? 0 : HTTP_NOTFOUND;
+}
+
+// html page like the ones evhttp sends for its own errors, malloc'd
+static char *backend_page(int status, const char *uri) {
+    const char *reason = status == 400   ? "Bad Request"
+                         : status == 413 ? "Request Entity Too Large"
+                         : status == 415 ? "Unsupported Media Type"
+                         : status == 503 ? "Service Unavailable"
+                                         : "Internal Server Error";
+    char *escaped, *page;
+    size_t len;
+
+    if (status != HTTP_NOTFOUND) {
+        if ((page = malloc(160)))
+            snprintf(page, 160,
+                     "<HTML><HEAD>\n<TITLE>%d %s</TITLE>\n</HEAD><BODY>\n"
+                     "<H1>%s</H1>\n</BODY></HTML>\n",
+                     status, reason, reason);
+        return page;
+    }
+    if (!(escaped = evhttp_htmlescape(uri)))
+        return NULL;
+    len = strlen(escaped) + 160;
+    if ((page = malloc(len)))
+        snprintf(page, len,
+                 "<html><head><title>404 Not Found</title></head><body>"
+                 "<h1>Not Found</h1><p>The requested URL %s was not found "
+                 "on this server.</p></body></html>\n",
+                 escaped);
+    free(escaped);
+    return page;
+}
+
+// the response evhttp_send_error would send
+static http_res_data *backend_error(int status, const char *uri) {
+    http_res_data *data = calloc(1, sizeof(*data));
+
+    if (!data)
+        return NULL;
+    data->headers.tqh_last = &data->headers.tqh_first;
+    data->status = status;
+    if (!(data->body = backend_page(status, uri))) {
+        free(data);
+        return NULL;
+    }
+    data->body_len = strlen(data->body);
+    if (status == 415)
+        evhttp_add_header(&data->headers, "Accept-Encoding", decode_accepted());
+    return data;
+}
+
+// runs cb for a request parsed outside evhttp. headers are the request's,
+// body decoding may rewrite them. returns NULL with the status to answer
+// with when there is no response
+static http_res_data *backend_call(http_server_cb *cb, const char *method,
+                                   const char *uri, struct evkeyvalq *headers,
+                                   const char *body, size_t body_len,
+                                   int *status) {
+    JSContext *ctx = cb->ctx;
+    struct evbuffer *buf = NULL;
+    http_res_data *data = NULL;
+    http_res *res_obj;
+    JSValue obj, ret;
+    int64_t heap = 0, start, t;
+    int aborted, err;
+
+    *status = HTTP_INTERNAL;
+    start = t = route_enter(cb, &heap);
+    if (body_len && (!strcmp(method, "POST") || !strcmp(method, "PUT") ||
+                     !strcmp(method, "PATCH"))) {
+        buf = evbuffer_new();
+        if (!buf || evbuffer_add(buf, body, body_len)) {
+            if (buf)
+                evbuffer_free(buf);
+            goto done;
+        }
+        if ((err = body_decode(cb->server, headers, buf))) {
+            evbuffer_free(buf);
+            *status = err;
+            goto done;
+        }
+        if (evbuffer_add(buf, "", 1)) {
+            evbuffer_free(buf);
+            goto done;
+        }
+    }
+    trace_phase("parse", &t);
+    obj = http_req_new(ctx, method, uri, headers, buf);
+    if (JS_IsException(obj)) {
+        js_std_dump_error(ctx);
+        goto done;
+    }
+    trace_phase("marshal", &t);
+
+    ret = route_invoke(cb, obj, &aborted);
+    trace_phase("call", &t);
+    if (aborted) {
+        *status = 503;
+        goto done;
+    }
+    res_obj = JS_GetOpaque(ret, http_res_class_id);
+    if (!res_obj) {
+        if (!JS_IsException(ret))
+            JS_ThrowInternalError(ctx, "callback must return response object");
+        js_std_dump_error(ctx);
+    } else if (!(data = http_res_data_new(
+                     ctx, res_obj, etag_kind(cb, method),
+                     evhttp_find_header(headers, "If-None-Match")))) {
+        js_std_dump_error(ctx);
+    } else if (data->status == 304) {
+        cb->not_modified++;
+    }
+    JS_FreeValue(ctx, ret);
+    trace_phase("serialize", &t);
+done:
+    route_leave(cb, heap, start);
+    return data;
+}
+#endif
+
+#ifdef HTTP_URING
+static void uring_reply_free(void *opaque) { http_res_data_free(opaque); }
+
+// with own set data is freed once the body is sent
+static void uring_reply_data(uring_request *ureq, uring_reply *reply,
+                             http_res_data *data, int own) {
+    if (own) {
+        reply->done = uring_reply_free;
+        reply->opaque = data;
+    }
+    reply->body = data->body;
+    reply->body_len = data->body_len;
+    reply->head = uring_head(ureq, data->status, data->reason, &data->headers,
+                             &reply->body_len, &reply->close,
+                             &reply->head_len);
+}
+
+static void uring_route(void *arg, uring_request *ureq, uring_reply *reply) {
+    http_server_fixed *fixed;
+    http_server_cb *cb;
+    http_res_data *data = NULL;
+    int status;
+
+    if (!(status = backend_route(arg, ureq->uri, &cb, &fixed))) {
+        if (fixed) {
+            uring_reply_data(ureq, reply, fixed->data, 0);
+            return;
+        }
+        data = backend_call(cb, ureq->method, ureq->uri, &ureq->headers,
+                            ureq->body, ureq->body_len, &status);
+    }
+    // without a head the backend answers 500
+    if (!data && status != HTTP_INTERNAL)
+        data = backend_error(status, ureq->uri);
+    if (data)
+        uring_reply_data(ureq, reply, data, 1);
+}
+#endif
+
+#ifdef HTTP_NGHTTP2
+static void h2_reply_free(void *opaque) { http_res_data_free(opaque); }
+
+// with own set data is freed once the stream is closed
+static void h2_reply_data(h2_reply *reply, http_res_data *data, int own) {
+    if (own) {
+        reply->done = h2_reply_free;
+        reply->opaque = data;
+    }
+    reply->status = data->status;
+    reply->headers = &data->headers;
+    reply->body = data->body;
+    reply->body_len = data->body_len;
+}
+
+// streams are routed like io_uring requests. server_h2_on keeps clients on
+// HTTP/1.1 while a route would need more than backend_call
+static void h2_route(void *arg, h2_request *req, h2_reply *reply) {
+    http_server_fixed *fixed;
+    http_server_cb *cb;
+    http_res_data *data = NULL;
+    int status;
+
+    if (!(status = backend_route(arg, req->uri, &cb, &fixed))) {
+        if (fixed) {
+            h2_reply_data(reply, fixed->data, 0);
+            return;
+        }
+        data = backend_call(cb, req->method, req->uri, req->headers,
+                            req->body, req->body_len, &status);
+    }
+    if (!data)
+        data = backend_error(status, req->uri);
+    // left empty it is a bare 500
+    if (data)
+        h2_reply_data(reply, data, 1);
+}
+#endif
+
+// moves the plain listeners over to io_uring, the evhttp ones stay bound but
+// stop accepting. tls and anything that needs an evhttp request stays put
+static void server_backend_start(http_server *server) {
+#ifdef HTTP_URING
+    char err[128];
+    int *fds;
+    size_t n = 0;
+
+    if (server->uring)
+        return;
+    if (server->sched.on) {
+        fprintf(stderr, "http: io_uring backend does not schedule by "
+                        "priority, using libevent\n");
+        server->backend = HTTP_BACKEND_LIBEVENT;
+        return;
+    }
+    if (server->proxies_len) {
+        fprintf(stderr, "http: io_uring backend does not proxy, using "
+                        "libevent\n");
+        server->backend = HTTP_BACKEND_LIBEVENT;
+        return;
+    }
+    for (size_t i = 0; i < server->cbs_len; ++i) {
+        if (server->cbs[i]->offload) {
+            fprintf(stderr, "http: io_uring backend does not offload "
+                            "handlers, using libevent\n");
+            server->backend = HTTP_BACKEND_LIBEVENT;
+            return;
+        }
+    }
+    fds = malloc((server->listeners_len + 1) * sizeof(*fds));
+    if (!fds)
+        return;
+    for (size_t i = 0; i < server->listeners_len; ++i) {
+        if (!server->listeners[i].tls)
+            fds[n++] = server->listeners[i].fd;
+    }
+    if (n)
+        server->uring = uring_start(server->base, fds, n, uring_route, server,
+                                    err, sizeof(err));
+    free(fds);
+    if (!n)
+        return;
+    if (!server->uring) {
+        fprintf(stderr, "http: io_uring backend unavailable, %s, using "
+                        "libevent\n",
+                err);
+        server->backend = HTTP_BACKEND_LIBEVENT;
+        return;
+    }
+    for (size_t i = 0; i < server->listeners_len; ++i) {
+        if (!server->listeners[i].tls)
+            evconnlistener_disable(
+                evhttp_bound_socket_get_listener(server->listeners[i].bound));
+    }
+#else
+    fprintf(stderr, "http: built without io_uring, using libevent\n");
+    server->backend = HTTP_BACKEND_LIBEVENT;
+#endif
+}
+
+static JSValue http_server_stats(JSContext *ctx, JSValueConst this_val,
+                                 int argc, JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    JSValue obj, routes, route, gc, listeners;
+    if (!server)
+        return JS_EXCEPTION;
+
+    obj = JS_NewObject(ctx);
+    if (JS_IsException(obj))
+        return JS_EXCEPTION;
+    routes = JS_NewObject(ctx);
+    for (size_t i = 0; i < server->cbs_len; ++i) {
+        http_server_cb *cb = server->cbs[i];
+        route = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, route, "requests",
+                                  JS_NewInt64(ctx, cb->requests),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, route, "aborted",
+                                  JS_NewInt64(ctx, cb->aborted), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, route, "notModified",
+                                  JS_NewInt64(ctx, cb->not_modified),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, routes, cb->path, route, JS_PROP_C_W_E);
+    }
+    JS_DefinePropertyValueStr(ctx, obj, "routes", routes, JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(
+        ctx, obj, "backend",
+        JS_NewString(ctx, server->backend == HTTP_BACKEND_URING ? "uring"
+                                                                 : "libevent"),
+        JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, obj, "connections",
+                              JS_NewInt64(ctx, server->conns.len),
+                              JS_PROP_C_W_E);
+    if (server->drain.on || server->handoff.sent) {
+        JSValue drain = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, drain, "draining",
+                                  JS_NewBool(ctx, server->drain.on),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, drain, "idleClosed",
+                                  JS_NewInt64(ctx, server->drain.idle_closed),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, drain, "handoffs",
+                                  JS_NewInt64(ctx, server->handoff.sent),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "drain", drain, JS_PROP_C_W_E);
+    }
+    if (!server->decompress.off) {
+        JSValue dec = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, dec, "requests",
+                                  JS_NewInt64(ctx, server->decompress.requests),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, dec, "encodedBytes",
+            JS_NewInt64(ctx, server->decompress.encoded_bytes), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, dec, "decodedBytes",
+            JS_NewInt64(ctx, server->decompress.decoded_bytes), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, dec, "rejected",
+                                  JS_NewInt64(ctx, server->decompress.rejected),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "decompress", dec, JS_PROP_C_W_E);
+    }
+    if (server->sched.on) {
+        JSValue sched = JS_NewObject(ctx), cls;
+        for (int i = 0; i < SCHED_COUNT; ++i) {
+            sched_class *c = &server->sched.classes[i];
+            cls = JS_NewObject(ctx);
+            JS_DefinePropertyValueStr(ctx, cls, "weight",
+                                      JS_NewInt32(ctx, c->weight),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "maxQueue",
+                                      JS_NewInt64(ctx, c->max_queue),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "queued",
+                                      JS_NewInt64(ctx, c->len), JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "served",
+                                      JS_NewInt64(ctx, c->served),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "rejected",
+                                      JS_NewInt64(ctx, c->rejected),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "expired",
+                                      JS_NewInt64(ctx, c->expired),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "cancelled",
+                                      JS_NewInt64(ctx, c->cancelled),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, cls, "waitUs",
+                                      hist_to_obj(ctx, &c->wait),
+                                      JS_PROP_C_W_E);
+            JS_DefinePropertyValueStr(ctx, sched, sched_names[i], cls,
+                                      JS_PROP_C_W_E);
+        }
+        JS_DefinePropertyValueStr(ctx, obj, "scheduler", sched, JS_PROP_C_W_E);
+    }
+    if (server->recycle) {
+        http_recycle *rc = server->recycle;
+        JSValue r = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, r, "reused",
+                                  JS_NewInt64(ctx, rc->reused), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, r, "allocated",
+                                  JS_NewInt64(ctx, rc->allocated),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, r, "idle",
+            JS_NewInt64(ctx, rc->reqs_len + rc->ress_len + rc->bufs_len),
+            JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "recycle", r, JS_PROP_C_W_E);
+    }
+#ifdef HTTP_NGHTTP2
+    if (server->h2) {
+        JSValue h = JS_NewObject(ctx);
+        h2_stats hs;
+        h2_get_stats(server->h2, &hs);
+        JS_DefinePropertyValueStr(ctx, h, "sessions",
+                                  JS_NewInt64(ctx, hs.sessions), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, h, "upgrades",
+                                  JS_NewInt64(ctx, hs.upgrades), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, h, "streams",
+                                  JS_NewInt64(ctx, hs.streams), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, h, "resets",
+                                  JS_NewInt64(ctx, hs.resets), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, h, "active",
+                                  JS_NewInt64(ctx, hs.active), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "http2", h, JS_PROP_C_W_E);
+    }
+#endif
+#ifdef HTTP_URING
+    if (server->uring) {
+        JSValue u = JS_NewObject(ctx);
+        uring_stats us;
+        uring_get_stats(server->uring, &us);
+        JS_DefinePropertyValueStr(ctx, u, "accepted",
+                                  JS_NewInt64(ctx, us.accepted), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "requests",
+                                  JS_NewInt64(ctx, us.requests), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "connections",
+                                  JS_NewInt64(ctx, us.conns), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "submits",
+                                  JS_NewInt64(ctx, us.submits), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, u, "submitsPerRequest",
+            JS_NewFloat64(ctx, us.requests ? (double)us.submits / us.requests
+                                           : 0),
+            JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "recvs", JS_NewInt64(ctx, us.recvs),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "sends", JS_NewInt64(ctx, us.sends),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "zeroCopySends",
+                                  JS_NewInt64(ctx, us.zc_sends), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, u, "noBuffers",
+                                  JS_NewInt64(ctx, us.no_buffers),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "uring", u, JS_PROP_C_W_E);
+    }
+#endif
+
+    listeners = JS_NewArray(ctx);
+    for (size_t i = 0; i < server->listeners_len; ++i) {
+        JSValue l = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, l, "name",
+                                  JS_NewString(ctx, server->listeners[i].name),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, l, "tls",
+                                  JS_NewBool(ctx, server->listeners[i].tls),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueUint32(ctx, listeners, (uint32_t)i, l,
+                                     JS_PROP_C_W_E);
+    }
+    JS_DefinePropertyValueStr(ctx, obj, "listeners", listeners, JS_PROP_C_W_E);
+
+    if (access_log_enabled()) {
+        JSValue log = JS_NewObject(ctx);
+        access_log_stats st;
+        access_log_get_stats(&st);
+        JS_DefinePropertyValueStr(ctx, log, "written",
+                                  JS_NewInt64(ctx, st.written), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, log, "dropped",
+                                  JS_NewInt64(ctx, st.dropped), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, log, "rotations",
+                                  JS_NewInt64(ctx, st.rotations),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, log, "writeErrors",
+                                  JS_NewInt64(ctx, st.write_errors),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "accessLog", log, JS_PROP_C_W_E);
+    }
+    if (capture_enabled()) {
+        JSValue cap = JS_NewObject(ctx);
+        capture_stats st;
+        capture_get_stats(&st);
+        JS_DefinePropertyValueStr(ctx, cap, "captured",
+                                  JS_NewInt64(ctx, st.captured),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, cap, "dropped",
+                                  JS_NewInt64(ctx, st.dropped), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, cap, "bytes",
+                                  JS_NewInt64(ctx, st.bytes), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, cap, "writeErrors",
+                                  JS_NewInt64(ctx, st.write_errors),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "capture", cap, JS_PROP_C_W_E);
+    }
+
+    if (server->watchdog.running) {
+        JSValue loop = JS_NewObject(ctx), last;
+        const char *route = __atomic_load_n(&server->watchdog.last_route,
+                                            __ATOMIC_RELAXED);
+        JS_DefinePropertyValueStr(ctx, loop, "lagUs",
+                                  hist_to_obj(ctx, &server->watchdog.lag),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, loop, "stalls",
+            JS_NewInt64(ctx, __atomic_load_n(&server->watchdog.stalls,
+                                             __ATOMIC_RELAXED)),
+            JS_PROP_C_W_E);
+        last = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(
+            ctx, last, "lagUs",
+            JS_NewInt64(ctx, __atomic_load_n(&server->watchdog.last_stall_us,
+                                             __ATOMIC_RELAXED)),
+            JS_PROP_C_W_E);
+        if (route)
+            JS_DefinePropertyValueStr(ctx, last, "route",
+                                      JS_NewString(ctx, route), JS_PROP_C_W_E);
+        if (server->watchdog.last_stack)
+            JS_DefinePropertyValueStr(
+                ctx, last, "stack",
+                JS_NewString(ctx, server->watchdog.last_stack), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, loop, "lastStall", last, JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "loop", loop, JS_PROP_C_W_E);
+    }
+
+    gc = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, gc, "runs", JS_NewInt64(ctx, server->gc.runs),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, gc, "pauseTotalUs",
+                              JS_NewInt64(ctx, server->gc.pause_total_us),
+                              JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, gc, "pauseMaxUs",
+                              JS_NewInt64(ctx, server->gc.pause_max_us),
+                              JS_PROP_C_W_E);
+    if (server->gc.metrics) {
+        JS_DefinePropertyValueStr(
+            ctx, gc, "heapGrowthAvg",
+            JS_NewFloat64(ctx, server->gc.samples
+                                   ? (double)server->gc.growth_total /
+                                         server->gc.samples
+                                   : 0),
+            JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, gc, "heapGrowthMax",
+                                  JS_NewInt64(ctx, server->gc.growth_max),
+                                  JS_PROP_C_W_E);
+    }
+    JS_DefinePropertyValueStr(ctx, obj, "gc", gc, JS_PROP_C_W_E);
+
+    if (server->pool) {
+        JSValue offload = JS_NewObject(ctx);
+        size_t queued;
+        pthread_mutex_lock(&server->pool->lock);
+        queued = server->pool->queued;
+        pthread_mutex_unlock(&server->pool->lock);
+        JS_DefinePropertyValueStr(ctx, offload, "workers",
+                                  JS_NewInt32(ctx, server->pool->nthreads),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, offload, "queued",
+                                  JS_NewInt64(ctx, queued), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, offload, "completed",
+                                  JS_NewInt64(ctx, server->pool->completed),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "offload", offload, JS_PROP_C_W_E);
+    }
+
+    if (server->proxies_len) {
+        JSValue proxies = JS_NewObject(ctx), ups, up_obj;
+        for (size_t i = 0; i < server->proxies_len; ++i) {
+            http_proxy *px = server->proxies[i];
+            ups = JS_NewArray(ctx);
+            for (size_t j = 0; j < px->ups_len; ++j) {
+                http_upstream *up = &px->ups[j];
+                up_obj = JS_NewObject(ctx);
+                JS_DefinePropertyValueStr(ctx, up_obj, "url",
+                                          JS_NewString(ctx, up->url),
+                                          JS_PROP_C_W_E);
+                JS_DefinePropertyValueStr(ctx, up_obj, "healthy",
+                                          JS_NewBool(ctx, up->healthy),
+                                          JS_PROP_C_W_E);
+                JS_DefinePropertyValueStr(ctx, up_obj, "active",
+                                          JS_NewInt64(ctx, up->active),
+                                          JS_PROP_C_W_E);
+                JS_DefinePropertyValueStr(ctx, up_obj, "connections",
+                                          JS_NewInt64(ctx, up->conns_len),
+                                          JS_PROP_C_W_E);
+                JS_DefinePropertyValueStr(ctx, up_obj, "requests",
+                                          JS_NewInt64(ctx, up->requests),
+                                          JS_PROP_C_W_E);
+                JS_DefinePropertyValueStr(ctx, up_obj, "errors",
+                                          JS_NewInt64(ctx, up->errors),
+                                          JS_PROP_C_W_E);
+                JS_DefinePropertyValueUint32(ctx, ups, (uint32_t)j, up_obj,
+                                             JS_PROP_C_W_E);
+            }
+            JS_DefinePropertyValueStr(ctx, proxies, px->prefix, ups,
+                                      JS_PROP_C_W_E);
+        }
+        JS_DefinePropertyValueStr(ctx, obj, "proxies", proxies, JS_PROP_C_W_E);
+    }
+#ifdef HTTP_OPENSSL
+    if (server->ssl_ctx) {
+        JSValue tls = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, tls, "handshakes",
+                                  JS_NewInt64(ctx, server->tls.handshakes),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, tls, "resumed",
+                                  JS_NewInt64(ctx, server->tls.resumed),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, tls, "resumptionRatio",
+            JS_NewFloat64(ctx, server->tls.handshakes
+                                   ? (double)server->tls.resumed /
+                                         server->tls.handshakes
+                                   : 0),
+            JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, tls, "sessionCacheHits",
+            JS_NewInt64(ctx, SSL_CTX_sess_hits(server->ssl_ctx)),
+            JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(
+            ctx, tls, "sessionCacheMisses",
+            JS_NewInt64(ctx, SSL_CTX_sess_misses(server->ssl_ctx)),
+            JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, tls, "ktls",
+                                  JS_NewInt64(ctx, server->tls.ktls),
+                                  JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, obj, "tls", tls, JS_PROP_C_W_E);
+    }
+#endif
     return obj;
-fail:
-    JS_FreeValue(ctx, proto);
-    JS_FreeValue(ctx, obj);
-    js_free(ctx, server);
-    return JS_EXCEPTION;
 }
 
-static JSValue http_server_listen(JSContext *ctx, JSValueConst this_val,
-                                  int argc, JSValueConst *argv) {
+static JSValue http_server_dispatch(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv) {
     http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
-    char *address;
-    int port;
     if (!server)
         return JS_EXCEPTION;
-    if (argc < 2)
-        return JS_ThrowTypeError(ctx, "listen([address, port]), address and "
-                                      "port must be string and number");
-    if (JS_ToCString(ctx, argv[0]) && JS_ToInt32(ctx, &port, argv[1])) {
-        return JS_ThrowTypeError(ctx, "listen([address, port]), address and "
-                                      "port must be string and number");
-    }
-    address = (char *)JS_ToCString(ctx, argv[0]);
-    if (!address)
+    if (server->backend == HTTP_BACKEND_URING && !server->drain.on)
+        server_backend_start(server);
+#ifdef HTTP_NGHTTP2
+    if (server->http2 && !server_h2_on(server))
+        fprintf(stderr, "http: http2 does not schedule, proxy, offload, log "
+                        "or capture, using HTTP/1.1\n");
+#endif
+    if (event_base_dispatch(server->base) < 0)
+        return JS_ThrowInternalError(ctx, "dispatch failed");
+    return JS_UNDEFINED;
+}
+
+static JSValue http_server_break(JSContext *ctx, JSValueConst this_val,
+                                 int argc, JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    if (!server)
         return JS_EXCEPTION;
-    if (evhttp_bind_socket(server->http, address, port) < 0) {
-        js_free(ctx, address);
-        return JS_ThrowInternalError(ctx, "Failed to bind to port: %d", port);
-    }
-    js_free(ctx, address);
+    if (event_base_loopbreak(server->base) < 0)
+        return JS_ThrowInternalError(ctx, "break failed");
     return JS_UNDEFINED;
 }
 
-static const char *evhttp_cmd_str[] = {
-    "GET", "POST", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE", "CONNECT",
-};
+// drain([timeoutMs]), stops accepting and lets dispatch return once the
+// requests in flight are answered and their connections closed, or after
+// timeoutMs (30000)
+static JSValue http_server_drain(JSContext *ctx, JSValueConst this_val,
+                                 int argc, JSValueConst *argv) {
+    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    int64_t timeout_ms = 30000;
+    if (!server)
+        return JS_EXCEPTION;
+    if (argc > 0 && !JS_IsUndefined(argv[0]) &&
+        JS_ToInt64(ctx, &timeout_ms, argv[0]))
+        return JS_EXCEPTION;
+    if (timeout_ms < 0)
+        return JS_ThrowRangeError(ctx, "drain, timeoutMs must not be negative");
+    if (drain_start(server, timeout_ms * 1000) < 0)
+        return JS_ThrowOutOfMemory(ctx);
+    return JS_UNDEFINED;
+}
 
-static const char *evhttp_cmd_type_to_str(enum evhttp_cmd_type type) {
-    size_t i = 0;
-    if (type < EVHTTP_REQ_GET || type > EVHTTP_REQ_PATCH)
-        return NULL;
-    for (i = 0; i < countof(evhttp_cmd_str); ++i) {
-        if (type & (1 << i))
-            break;
+static void handoff_close(http_server *server) {
+    if (server->handoff.peer_ev) {
+        event_free(server->handoff.peer_ev);
+        server->handoff.peer_ev = NULL;
+    }
+    if (server->handoff.peer >= 0) {
+        evutil_closesocket(server->handoff.peer);
+        server->handoff.peer = -1;
+    }
+    if (server->handoff.ev) {
+        event_free(server->handoff.ev);
+        server->handoff.ev = NULL;
+    }
+    if (server->handoff.fd >= 0) {
+        evutil_closesocket(server->handoff.fd);
+        server->handoff.fd = -1;
+    }
+    if (server->handoff.path) {
+#ifndef _WIN32
+        unlink(server->handoff.path);
+#endif
+        js_free(server->ctx, server->handoff.path);
+        server->handoff.path = NULL;
     }
-    return evhttp_cmd_str[type];
 }
 
-static void callback_helper(struct evhttp_request *req, void *arg) {
-    http_server_cb *cb = arg;
-    JSAtom atom;
-    JSValue argv[1], ret, key, value;
-    http_req *req_obj;
-    http_res *res_obj;
-    const char *uri_str, *method_str;
-    struct evkeyvalq *headers, uri_params;
-    struct evbuffer *buf;
-    size_t len, idx = 0;
+#ifndef _WIN32
+// listeners one handoff carries
+#define HANDOFF_MAX 64
+#define HANDOFF_LINE 200
+// how long the new process may take to answer
+#define HANDOFF_WAIT_SEC 10
 
-    uri_str = evhttp_request_get_uri(req);
-    enum evhttp_cmd_type method = evhttp_request_get_command(req);
-    method_str = evhttp_cmd_type_to_str(method);
-    if (!method_str || !uri_str) {
-        JS_ThrowInternalError(cb->ctx, "method_str or uri_str is NULL");
-        js_std_dump_error(cb->ctx);
-        return;
-    }
-    evhttp_parse_query_str(uri_str, &uri_params);
-    headers = evhttp_request_get_input_headers(req);
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
-    req_obj = js_mallocz(cb->ctx, sizeof(*req_obj));
-    if (!req_obj) {
-        js_std_dump_error(cb->ctx);
-        return;
+// "tls\tunix_path\tname" per listener and an empty line, the fds ride on
+// the same message
+static int handoff_send(http_server *server, evutil_socket_t peer) {
+    char buf[HANDOFF_MAX * HANDOFF_LINE];
+    char cbuf[CMSG_SPACE(HANDOFF_MAX * sizeof(int))];
+    size_t len = 0, n = server->listeners_len;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    int *fds;
+
+    if (!n || n > HANDOFF_MAX)
+        return -1;
+    for (size_t i = 0; i < n; ++i) {
+        http_listener *l = &server->listeners[i];
+        len += snprintf(buf + len, sizeof(buf) - len, "%d\t%s\t%s\n", l->tls,
+                        l->unix_path ? l->unix_path : "", l->name);
+        if (len >= sizeof(buf) - 1)
+            return -1;
     }
-    req_obj->ctx = cb->ctx;
-    req_obj->str_fields[HTTP_REQ_URI] = js_strdup(cb->ctx, uri_str);
-    req_obj->str_fields[HTTP_REQ_METHOD] = js_strdup(cb->ctx, method_str);
-    buf = evhttp_request_get_input_buffer(req);
-    len = evbuffer_get_length(buf);
-    if (len > 0 && (method == EVHTTP_REQ_POST || method == EVHTTP_REQ_PUT ||
-                    method == EVHTTP_REQ_PATCH)) {
-        req_obj->str_fields[HTTP_REQ_BODY] = js_malloc(cb->ctx, len + 1);
-        if (!req_obj->str_fields[HTTP_REQ_BODY]) {
-            js_std_dump_error(cb->ctx);
-            return;
-        }
-        evbuffer_copyout(buf, req_obj->str_fields[HTTP_REQ_BODY], len);
-        req_obj->str_fields[HTTP_REQ_BODY][len] = '\0';
+    buf[len++] = '\n';
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+    fds = (int *)CMSG_DATA(cm);
+    for (size_t i = 0; i < n; ++i) {
+        fds[i] = server->listeners[i].fd;
     }
-    req_obj->js_fields[HTTP_REQ_PARAMS - HTTP_REQ_PARAMS] =
-        ev_params_to_obj(cb->ctx, &uri_params);
-    req_obj->js_fields[HTTP_REQ_HEADERS - HTTP_REQ_PARAMS] =
-        ev_headers_to_obj(cb->ctx, headers);
+    return sendmsg(peer, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
 
-    argv[0] = JS_NewObjectClass(cb->ctx, http_req_class_id);
-    if (JS_IsException(argv[0])) {
-        for (size_t i = 0; i < HTTP_REQ_PARAMS; ++i) {
-            js_free(req_obj->ctx, req_obj->str_fields[i]);
-        }
-        js_free(cb->ctx, req_obj);
-        js_std_dump_error(cb->ctx);
+// a byte back means the new process accepts on everything
+static void handoff_ack_cb(evutil_socket_t fd, short what, void *arg) {
+    http_server *server = arg;
+    int64_t timeout_us = server->handoff.timeout_us;
+    char ack;
+    int ok = (what & EV_READ) && recv(fd, &ack, 1, 0) == 1;
+
+    event_free(server->handoff.peer_ev);
+    server->handoff.peer_ev = NULL;
+    evutil_closesocket(fd);
+    server->handoff.peer = -1;
+    // it went away before taking over, keep serving and wait for another
+    if (!ok)
         return;
+    server->handoff.sent++;
+    // the socket files are the new process's to unlink
+    for (size_t i = 0; i < server->listeners_len; ++i) {
+        js_free(server->ctx, server->listeners[i].unix_path);
+        server->listeners[i].unix_path = NULL;
     }
-    JS_SetOpaque(argv[0], req_obj);
+    handoff_close(server);
+    if (drain_start(server, timeout_us) < 0)
+        event_base_loopbreak(server->base);
+}
 
-    ret = JS_Call(cb->ctx, cb->server->callbacks[cb->callback_index],
-                  cb->server_this, 1, argv);
+// the listeners only go to a process of the same user
+static int handoff_peer_ok(evutil_socket_t peer) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(peer, &uid, &gid) < 0)
+        return 0;
+    return uid == geteuid();
+#endif
+}
 
-    if (!JS_IsObject(ret)) {
-        js_std_dump_error(cb->ctx);
+static void handoff_accept_cb(evutil_socket_t fd, short what, void *arg) {
+    http_server *server = arg;
+    struct timeval tv = {HANDOFF_WAIT_SEC, 0};
+    evutil_socket_t peer = accept(fd, NULL, NULL);
+
+    if (peer < 0)
         return;
-    }
-    res_obj = JS_GetOpaque(ret, http_res_class_id);
-    if (!res_obj) {
-        JS_ThrowInternalError(cb->ctx, "callback must return response object");
-        js_std_dump_error(cb->ctx);
+    // one taker at a time
+    if (server->handoff.peer >= 0 || !handoff_peer_ok(peer) ||
+        handoff_send(server, peer) < 0) {
+        evutil_closesocket(peer);
         return;
     }
-    buf = evbuffer_new();
-    if (!buf) {
-        JS_ThrowOutOfMemory(cb->ctx);
-        js_std_dump_error(cb->ctx);
+    server->handoff.peer_ev =
+        event_new(server->base, peer, EV_READ, handoff_ack_cb, server);
+    if (!server->handoff.peer_ev) {
+        evutil_closesocket(peer);
         return;
     }
-    // if (JS_GetPropertyLength(cb->ctx, (int64_t *)&len, res_obj->headers) ==
-    //     -1) {
-    //     js_std_dump_error(cb->ctx);
-    //     return;
-    // }
-    while (!JS_IsUndefined(res_obj->headers)) {
-        key = JS_GetPropertyUint32(cb->ctx, res_obj->headers, idx++);
-        if (JS_IsUndefined(key))
-            break;
-        if (JS_IsException(key)) {
-            js_std_dump_error(cb->ctx);
-            return;
-        }
-        atom = JS_ValueToAtom(cb->ctx, key);
-        if (unlikely(atom == JS_ATOM_NULL)) {
-            js_std_dump_error(cb->ctx);
-            return;
-        }
-        value = JS_GetProperty(cb->ctx, res_obj->headers, atom);
-        JS_FreeAtom(cb->ctx, atom);
-        if (JS_IsException(value)) {
-            js_std_dump_error(cb->ctx);
-            return;
-        }
-        evhttp_add_header(evhttp_request_get_output_headers(req),
-                          JS_ToCString(cb->ctx, key),
-                          JS_ToCString(cb->ctx, value));
-        JS_FreeValue(cb->ctx, key);
-        JS_FreeValue(cb->ctx, value);
-    }
-    if (res_obj->body)
-        evbuffer_add(buf, res_obj->body, strlen(res_obj->body));
-    evhttp_send_reply(req, res_obj->status, res_obj->reason, buf);
-    evbuffer_free(buf);
+    server->handoff.peer = peer;
+    event_add(server->handoff.peer_ev, &tv);
 }
+#endif
 
-static JSValue http_server_on(JSContext *ctx, JSValueConst this_val, int argc,
-                              JSValueConst *argv) {
+// handoff(path, [timeoutMs]), waits on the unix socket path for a new
+// process calling takeover(path). once that one accepts on the listeners
+// this one drains like drain(timeoutMs)
+static JSValue http_server_handoff(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv) {
     http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
-    char *path;
-    JSValue call_back;
+#ifndef _WIN32
+    int64_t timeout_ms = 30000;
+    char address[sizeof(((struct sockaddr_un *)0)->sun_path) + 8];
+    const char *path;
+    listen_opts o;
+    evutil_socket_t fd;
+    mode_t mask;
 
     if (!server)
         return JS_EXCEPTION;
-    if (argc < 2)
-        return JS_ThrowTypeError(ctx, "on([path, handler]), path and handler "
-                                      "must be string and function");
-    if (!JS_ToCString(ctx, argv[0]) || !JS_IsFunction(ctx, argv[1]))
-        return JS_ThrowTypeError(ctx, "on([path, handler]), path and handler "
-                                      "must be string and function");
-
-    path = (char *)JS_ToCString(ctx, argv[0]);
+    if (argc < 1 || !JS_IsString(argv[0]))
+        return JS_ThrowTypeError(ctx, "handoff(path, [timeoutMs]), path must "
+                                      "be string");
+    if (argc > 1 && !JS_IsUndefined(argv[1]) &&
+        JS_ToInt64(ctx, &timeout_ms, argv[1]))
+        return JS_EXCEPTION;
+    if (timeout_ms < 0)
+        return JS_ThrowRangeError(ctx,
+                                  "handoff, timeoutMs must not be negative");
+    if (!server->listeners_len || server->listeners_len > HANDOFF_MAX)
+        return JS_ThrowRangeError(ctx, "handoff, needs 1 to %d listeners",
+                                  HANDOFF_MAX);
+    if (server->handoff.fd >= 0 || server->drain.on)
+        return JS_ThrowInternalError(ctx, "handoff, already %s",
+                                     server->drain.on ? "draining"
+                                                      : "handing off");
+    path = JS_ToCString(ctx, argv[0]);
     if (!path)
         return JS_EXCEPTION;
-
-    call_back = JS_DupValue(ctx, argv[1]);
-    server->callbacks = js_realloc(
-        ctx, server->callbacks, (server->callbacks_len + 1) * sizeof(JSValue));
-    if (!server->callbacks) {
-        js_free(ctx, path);
-        JS_FreeValue(ctx, call_back);
-        return JS_ThrowOutOfMemory(ctx);
-    }
-    server->callbacks[server->callbacks_len] = call_back;
-    server->callbacks_len++;
-
-    server->cbs = js_realloc(ctx, server->cbs,
-                             (server->cbs_len + 1) * sizeof(http_server_cb));
-    if (!server->cbs) {
-        js_free(ctx, path);
-        JS_FreeValue(ctx, call_back);
-        return JS_ThrowOutOfMemory(ctx);
-    }
-    server->cbs[server->cbs_len].ctx = ctx;
-    server->cbs[server->cbs_len].server = server;
-    server->cbs[server->cbs_len].server_this = this_val;
-    server->cbs[server->cbs_len].callback_index = server->callbacks_len - 1;
-    server->cbs_len++;
-
-    if (evhttp_set_cb(server->http, path, callback_helper,
-                      &server->cbs[server->cbs_len - 1]) < 0) {
-        js_free(ctx, path);
-        JS_FreeValue(ctx, call_back);
-        return JS_ThrowInternalError(ctx, "Failed to set callback for path: %s",
-                                     path);
+    snprintf(address, sizeof(address), "unix:%s", path);
+    memset(&o, 0, sizeof(o));
+    o.backlog = 1;
+    // whoever connects gets the listening sockets, the file is 0600 from the
+    // moment it exists
+    mask = umask(0177);
+    fd = listen_socket(ctx, address, 0, &o);
+    umask(mask);
+    if (fd < 0)
+        goto fail;
+    server->handoff.fd = fd;
+    server->handoff.path = js_strdup(ctx, path);
+    server->handoff.timeout_us = timeout_ms * 1000;
+    server->handoff.ev = event_new(server->base, fd, EV_READ | EV_PERSIST,
+                                   handoff_accept_cb, server);
+    if (!server->handoff.path || !server->handoff.ev) {
+        handoff_close(server);
+        JS_ThrowOutOfMemory(ctx);
+        goto fail;
     }
-    js_free(ctx, path);
+    event_add(server->handoff.ev, NULL);
+    JS_FreeCString(ctx, path);
     return JS_UNDEFINED;
+fail:
+    JS_FreeCString(ctx, path);
+    return JS_EXCEPTION;
+#else
+    if (!server)
+        return JS_EXCEPTION;
+    return JS_ThrowInternalError(ctx, "handoff is not supported on windows");
+#endif
 }
 
-static JSValue http_server_dispatch(JSContext *ctx, JSValueConst this_val,
+// takeover(path, [opts]), asks the process that called handoff(path) for
+// its listeners and accepts on them right away. opts are listen's, cert
+// and key are needed when one of them is tls. returns their names
+static JSValue http_server_takeover(JSContext *ctx, JSValueConst this_val,
                                     int argc, JSValueConst *argv) {
     http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+#ifndef _WIN32
+    char buf[HANDOFF_MAX * HANDOFF_LINE];
+    char cbuf[CMSG_SPACE(HANDOFF_MAX * sizeof(int))];
+    struct timeval tv = {HANDOFF_WAIT_SEC, 0};
+    struct sockaddr_un sun;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    int fds[HANDOFF_MAX], flags = 0;
+    size_t nfds = 0, len = 0, i = 0, n;
+    evutil_socket_t sock = -1;
+    JSValueConst opts = argc > 1 ? argv[1] : JS_UNDEFINED;
+    JSValue names = JS_UNDEFINED;
+    const char *path = NULL;
+    char *line, *end, *tab1, *tab2;
+    struct evhttp *http;
+    listen_opts o;
+    ssize_t r;
+    int tls;
+
     if (!server)
         return JS_EXCEPTION;
-    if (event_base_dispatch(server->base) < 0)
-        return JS_ThrowInternalError(ctx, "dispatch failed");
-    return JS_UNDEFINED;
-}
+    if (argc < 1 || !JS_IsString(argv[0]))
+        return JS_ThrowTypeError(ctx, "takeover(path, [opts]), path must be "
+                                      "string");
+    if (!JS_IsUndefined(opts) && !JS_IsObject(opts))
+        return JS_ThrowTypeError(ctx, "takeover, opts must be object");
+    if (listen_opts_parse(ctx, opts, &o) < 0)
+        return JS_EXCEPTION;
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        JS_ThrowRangeError(ctx, "unix socket path too long: %s", path);
+        goto fail;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        JS_ThrowInternalError(ctx, "takeover, cannot reach %s: %s", path,
+                              strerror(errno));
+        goto fail;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+    // the fds come with the first bytes, the lines may take more reads
+    do {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf + len;
+        iov.iov_len = sizeof(buf) - 1 - len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        r = recvmsg(sock, &msg, flags);
+        if (r <= 0) {
+            JS_ThrowInternalError(ctx, "takeover, %s sent no listeners",
+                                  path);
+            goto fail;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+                continue;
+            n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (n > HANDOFF_MAX - nfds)
+                n = HANDOFF_MAX - nfds;
+            memcpy(fds + nfds, CMSG_DATA(cm), n * sizeof(int));
+            nfds += n;
+        }
+        len += r;
+        buf[len] = 0;
+    } while ((len < 2 || strcmp(buf + len - 2, "\n\n")) &&
+             len < sizeof(buf) - 1);
+    if (len < 2 || strcmp(buf + len - 2, "\n\n")) {
+        JS_ThrowInternalError(ctx, "takeover, bad handoff from %s", path);
+        goto fail;
+    }
 
-static JSValue http_server_break(JSContext *ctx, JSValueConst this_val,
-                                 int argc, JSValueConst *argv) {
-    http_server *server = JS_GetOpaque2(ctx, this_val, http_server_class_id);
+    names = JS_NewArray(ctx);
+    if (JS_IsException(names))
+        goto fail;
+    for (line = buf; *line && *line != '\n'; line = end + 1) {
+        end = strchr(line, '\n');
+        *end = 0;
+        tab1 = strchr(line, '\t');
+        tab2 = tab1 ? strchr(tab1 + 1, '\t') : NULL;
+        if (!tab2 || i >= nfds)
+            break;
+        *tab1 = *tab2 = 0;
+        tls = atoi(line);
+        if (tls && !(JS_IsObject(opts) && listen_has_tls(ctx, opts))) {
+            JS_ThrowTypeError(ctx, "takeover, %s is tls, opts.cert and "
+                                   "opts.key must be string",
+                              tab2 + 1);
+            goto fail;
+        }
+        http = server_frontend(ctx, server, opts, tls);
+        if (!http || listen_adopt(ctx, fds[i], &o) < 0 ||
+            server_listener_add(ctx, server, http, fds[i], tab2 + 1,
+                                *(tab1 + 1) ? tab1 + 1 : NULL) < 0)
+            goto fail;
+        JS_SetPropertyUint32(ctx, names, i++, JS_NewString(ctx, tab2 + 1));
+    }
+    if (*line != '\n' || i != nfds) {
+        JS_ThrowInternalError(ctx, "takeover, bad handoff from %s", path);
+        goto fail;
+    }
+    // the old process starts draining on this
+    send(sock, "", 1, MSG_NOSIGNAL);
+    evutil_closesocket(sock);
+    JS_FreeCString(ctx, path);
+    return names;
+fail:
+    // the ones not listening yet
+    for (; i < nfds; ++i) {
+        close(fds[i]);
+    }
+    if (sock >= 0)
+        evutil_closesocket(sock);
+    JS_FreeCString(ctx, path);
+    JS_FreeValue(ctx, names);
+    return JS_EXCEPTION;
+#else
     if (!server)
         return JS_EXCEPTION;
-    if (event_base_loopbreak(server->base) < 0)
-        return JS_ThrowInternalError(ctx, "break failed");
-    return JS_UNDEFINED;
+    return JS_ThrowInternalError(ctx, "takeover is not supported on windows");
+#endif
+}
+
+static JSValue http_server_dump_trace(JSContext *ctx, JSValueConst this_val,
+                                      int argc, JSValueConst *argv) {
+    const char *path;
+    long n;
+    if (argc < 1 || !JS_IsString(argv[0]))
+        return JS_ThrowTypeError(ctx, "dumpTrace([path]), path must be string");
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+    n = trace_dump(path);
+    if (n < 0) {
+        JS_ThrowInternalError(ctx, "Failed to write trace to %s", path);
+        JS_FreeCString(ctx, path);
+        return JS_EXCEPTION;
+    }
+    JS_FreeCString(ctx, path);
+    return JS_NewInt64(ctx, n);
 }
 
 static const JSCFunctionListEntry http_server_proto_funcs[] = {
+    JS_CFUNC_DEF("set", 1, http_server_set),
     JS_CFUNC_DEF("listen", 2, http_server_listen),
     JS_CFUNC_DEF("on", 2, http_server_on),
+    JS_CFUNC_DEF("fixed", 2, http_server_fixed_add),
+    JS_CFUNC_DEF("proxy", 2, http_server_proxy),
+    JS_CFUNC_DEF("stats", 0, http_server_stats),
+    JS_CFUNC_DEF("dumpTrace", 1, http_server_dump_trace),
     JS_CFUNC_DEF("dispatch", 0, http_server_dispatch),
     JS_CFUNC_DEF("break", 0, http_server_break),
+    JS_CFUNC_DEF("drain", 1, http_server_drain),
+    JS_CFUNC_DEF("handoff", 2, http_server_handoff),
+    JS_CFUNC_DEF("takeover", 2, http_server_takeover),
 };
 
-static int http_init(JSContext *ctx, JSModuleDef *m) {
-
-    JSValue req_proto, req_obj, res_proto, res_obj, server_proto, server_obj;
+// in the order of http_export_names
+static void http_new_exports(JSContext *ctx, JSValue *exports) {
+    JSValue req_proto, res_proto, server_proto;
 
     req_proto = JS_NewObject(ctx);
     JS_SetPropertyFunctionList(ctx, req_proto, http_req_proto_funcs,
                                countof(http_req_proto_funcs));
     JS_SetClassProto(ctx, http_req_class_id, req_proto);
 
-    req_obj = JS_NewCFunction2(ctx, http_req_ctor, "request", 0,
-                               JS_CFUNC_constructor, 0);
-    JS_SetConstructor(ctx, req_obj, req_proto);
-    JS_SetModuleExport(ctx, m, "request", req_obj);
+    exports[0] = JS_NewCFunction2(ctx, http_req_ctor, "request", 0,
+                                  JS_CFUNC_constructor, 0);
+    JS_SetConstructor(ctx, exports[0], req_proto);
 
     res_proto = JS_NewObject(ctx);
     JS_SetPropertyFunctionList(ctx, res_proto, http_res_proto_funcs,
                                countof(http_res_proto_funcs));
     JS_SetClassProto(ctx, http_res_class_id, res_proto);
 
-    res_obj = JS_NewCFunction2(ctx, http_res_ctor, "response", 0,
-                               JS_CFUNC_constructor, 0);
-    JS_SetConstructor(ctx, res_obj, res_proto);
-    JS_SetModuleExport(ctx, m, "response", res_obj);
+    exports[1] = JS_NewCFunction2(ctx, http_res_ctor, "response", 0,
+                                  JS_CFUNC_constructor, 0);
+    JS_SetConstructor(ctx, exports[1], res_proto);
 
-    JS_SetModuleExport(ctx, m, "fetch",
-                       JS_NewCFunction(ctx, http_fetch, "fetch", 1));
+    exports[2] = JS_NewCFunction(ctx, http_fetch, "fetch", 2);
 
     server_proto = JS_NewObject(ctx);
     JS_SetPropertyFunctionList(ctx, server_proto, http_server_proto_funcs,
                                countof(http_server_proto_funcs));
     JS_SetClassProto(ctx, http_server_class_id, server_proto);
 
-    server_obj = JS_NewCFunction2(ctx, http_server_ctor, "server", 0,
+    exports[3] = JS_NewCFunction2(ctx, http_server_ctor, "server", 0,
                                   JS_CFUNC_constructor, 0);
-    JS_SetConstructor(ctx, server_obj, server_proto);
-    JS_SetModuleExport(ctx, m, "server", server_obj);
+    JS_SetConstructor(ctx, exports[3], server_proto);
+
+    exports[4] = JS_NewCFunction(ctx, http_fetch_set, "fetchSet", 1);
+    exports[5] = JS_NewCFunction(ctx, http_fetch_stats, "fetchStats", 0);
+    exports[6] = JS_NewCFunction(ctx, http_fetch_all, "fetchAll", 2);
+}
+
+static int http_init(JSContext *ctx, JSModuleDef *m) {
+    JSValue exports[countof(http_export_names)];
 
+    http_new_exports(ctx, exports);
+    for (size_t i = 0; i < countof(http_export_names); ++i) {
+        JS_SetModuleExport(ctx, m, http_export_names[i], exports[i]);
+    }
+    return 0;
+}
+
+// class ids are process wide, the classes must exist in every runtime
+static int http_new_classes(JSRuntime *rt) {
+    static const struct {
+        JSClassID *id;
+        JSClassDef *def;
+    } classes[] = {
+        {&http_req_class_id, &http_req_class},
+        {&http_res_class_id, &http_res_class},
+        {&http_server_class_id, &http_server_class},
+    };
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < countof(classes); ++i) {
+        if (*classes[i].id == 0)
+            JS_NewClassID(classes[i].id);
+    }
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < countof(classes); ++i) {
+        if (!JS_IsRegisteredClass(rt, *classes[i].id) &&
+            JS_NewClass(rt, *classes[i].id, classes[i].def) < 0)
+            return -1;
+    }
     return 0;
 }
 
 export_fn JSModuleDef *js_init_module(JSContext *ctx, const char *module_name) {
     JSModuleDef *m;
-    JSClassID id;
 
     m = JS_NewCModule(ctx, module_name, http_init);
     if (!m)
         return NULL;
 
-    if (http_req_class_id == 0) {
-        int ret;
-        id = JS_NewClassID(&http_req_class_id);
-        ret = JS_NewClass(JS_GetRuntime(ctx), id, &http_req_class);
-        if (ret < 0)
-            return NULL;
-        http_req_class_id = id;
-    }
-    if (http_res_class_id == 0) {
-        int ret;
-        id = JS_NewClassID(&http_res_class_id);
-        ret = JS_NewClass(JS_GetRuntime(ctx), id, &http_res_class);
-        if (ret < 0)
-            return NULL;
-        http_res_class_id = id;
-    }
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (http_new_classes(JS_GetRuntime(ctx)) < 0)
+        return NULL;
 
-    JS_AddModuleExport(ctx, m, "request");
-    JS_AddModuleExport(ctx, m, "response");
-    JS_AddModuleExport(ctx, m, "fetch");
-    JS_AddModuleExport(ctx, m, "server");
+    for (size_t i = 0; i < countof(http_export_names); ++i) {
+        JS_AddModuleExport(ctx, m, http_export_names[i]);
+    }
 
     return m;
-}
\ No newline at end of file
+}
@@ -0,0 +1,208 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_ARG_LEN 48
+
+typedef struct {
+    // 2 * index + 2 once written, odd while being written
+    uint64_t seq;
+    const char *name;
+    int64_t ts;
+    int64_t dur;
+    char arg[TRACE_ARG_LEN];
+} trace_event;
+
+// written only by its own thread, read by trace_dump. taken over by the next
+// new thread once its own has exited
+typedef struct trace_ring {
+    struct trace_ring *next;
+    int idle;
+    uint32_t tid;
+    size_t cap;
+    uint64_t head;
+    trace_event *events;
+} trace_ring;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings;
+static uint32_t next_tid = 1;
+// requests between two traced ones, 0 when off
+static uint32_t trace_every;
+static size_t trace_events = 65536;
+
+static _Thread_local trace_ring *ring;
+static _Thread_local uint32_t seen;
+static _Thread_local int active;
+// only for its destructor, which frees the ring up at thread exit
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void ring_release(void *arg) {
+    trace_ring *r = arg;
+    pthread_mutex_lock(&trace_lock);
+    r->idle = 1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void ring_key_new(void) { pthread_key_create(&ring_key, ring_release); }
+
+void trace_configure(double sample, size_t events) {
+    uint32_t every = 0;
+    if (sample > 0)
+        every = sample >= 1 ? 1 : (uint32_t)(1 / sample + 0.5);
+    pthread_mutex_lock(&trace_lock);
+    if (events)
+        trace_events = events;
+    pthread_mutex_unlock(&trace_lock);
+    __atomic_store_n(&trace_every, every, __ATOMIC_RELAXED);
+}
+
+static trace_ring *ring_get(void) {
+    trace_ring *r;
+    if (ring)
+        return ring;
+    pthread_once(&ring_once, ring_key_new);
+    pthread_mutex_lock(&trace_lock);
+    // its events stay until overwritten, under the same tid
+    for (r = rings; r && !r->idle; r = r->next)
+        ;
+    if (r) {
+        r->idle = 0;
+        pthread_mutex_unlock(&trace_lock);
+        pthread_setspecific(ring_key, r);
+        ring = r;
+        return r;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    pthread_mutex_lock(&trace_lock);
+    r->cap = trace_events;
+    r->events = calloc(r->cap, sizeof(trace_event));
+    if (!r->events) {
+        pthread_mutex_unlock(&trace_lock);
+        free(r);
+        return NULL;
+    }
+    r->tid = next_tid++;
+    // rings outlive their threads so a dump still sees them
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&trace_lock);
+    pthread_setspecific(ring_key, r);
+    ring = r;
+    return r;
+}
+
+int64_t trace_begin_request(void) {
+    uint32_t every = __atomic_load_n(&trace_every, __ATOMIC_RELAXED);
+    if (!every || seen++ % every)
+        return 0;
+    active = 1;
+    return util_now_us();
+}
+
+void trace_end_request(int64_t start, const char *arg) {
+    if (!start)
+        return;
+    trace_span("request", start, util_now_us(), arg);
+    active = 0;
+}
+
+int trace_active(void) { return active; }
+
+void trace_span(const char *name, int64_t start_us, int64_t end_us,
+                const char *arg) {
+    trace_ring *r = ring_get();
+    trace_event *e;
+    uint64_t head;
+    if (!r)
+        return;
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    e = &r->events[head % r->cap];
+    // a dump reading the slot meanwhile sees the odd seq and skips it
+    __atomic_store_n(&e->seq, 2 * head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->name = name;
+    e->ts = start_us;
+    e->dur = end_us - start_us;
+    if (arg)
+        snprintf(e->arg, sizeof(e->arg), "%s", arg);
+    else
+        e->arg[0] = '\0';
+    __atomic_store_n(&e->seq, 2 * head + 2, __ATOMIC_RELEASE);
+    // publishes the event to trace_dump
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void json_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+long trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    trace_ring *r;
+    trace_event e;
+    uint64_t head, start, seq;
+    long n = 0;
+
+    if (!f)
+        return -1;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+    pthread_mutex_lock(&trace_lock);
+    for (r = rings; r; r = r->next) {
+        fprintf(f,
+                "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":\"http-%u\"}}",
+                n ? "," : "", r->tid, r->tid);
+        n++;
+        // events overwritten while this runs are left out
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        start = head > r->cap ? head - r->cap : 0;
+        for (uint64_t i = start; i < head; ++i) {
+            trace_event *slot = &r->events[i % r->cap];
+            // copied, then kept only if the writer did not touch it meanwhile
+            seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq != 2 * i + 2)
+                continue;
+            memcpy(&e, slot, sizeof(e));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            e.arg[sizeof(e.arg) - 1] = '\0';
+            fputs(",{\"name\":", f);
+            json_str(f, e.name);
+            fprintf(f,
+                    ",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%lld,\"dur\":%lld",
+                    r->tid, (long long)e.ts, (long long)e.dur);
+            if (e.arg[0]) {
+                fputs(",\"args\":{\"arg\":", f);
+                json_str(f, e.arg);
+                fputc('}', f);
+            }
+            fputc('}', f);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fputs("]}\n", f);
+    if (fclose(f))
+        return -1;
+    return n;
+}
@@ -0,0 +1,33 @@
+#ifndef LANYT_TRACE_H
+#define LANYT_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// sample is the fraction of requests traced, 0 turns tracing off. events is
+// the ring size of each thread, the oldest events are overwritten
+void trace_configure(double sample, size_t events);
+// decides whether the request starting on this thread is traced, returns
+// its start time or 0
+int64_t trace_begin_request(void);
+void trace_end_request(int64_t start, const char *arg);
+// inside a traced request on this thread
+int trace_active(void);
+void trace_span(const char *name, int64_t start_us, int64_t end_us,
+                const char *arg);
+// chrome trace event json, returns the number of events or -1
+long trace_dump(const char *path);
+
+// closes the phase that started at *t and starts the next one
+static inline void trace_phase(const char *name, int64_t *t) {
+    int64_t now;
+    if (!*t)
+        return;
+    now = util_now_us();
+    trace_span(name, *t, now, NULL);
+    *t = now;
+}
+
+#endif // LANYT_TRACE_H
@@ -0,0 +1,827 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <liburing.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/util.h>
+
+#define URING_ENTRIES 4096
+#define URING_BUFS 1024
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+#define URING_CQE_BATCH 256
+#define URING_HEAD_MAX 16384
+#define URING_BODY_MAX (8 << 20)
+// input held for one connection, a pipelining client that does not read its
+// replies is cut off here
+#define URING_IN_MAX (URING_HEAD_MAX + URING_BODY_MAX)
+// below this copying into the socket is cheaper than pinning pages
+#define URING_ZC_MIN 16384
+
+// low bits of user_data, the pointers are at least 8 byte aligned
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND_HEAD,
+    OP_SEND_BODY,
+    OP_MASK = 3,
+};
+
+typedef struct uring_conn uring_conn;
+
+typedef struct {
+    uring_backend *u;
+    int fd;
+    struct event *retry_ev;
+} uring_listener;
+
+struct uring_conn {
+    uring_backend *u;
+    uring_conn *prev, *next;
+    int fd;
+    int recv_armed;
+    // send sqes and zero-copy notifications still owned by the kernel
+    int sends;
+    int notifs;
+    int send_error;
+    int replying;
+    int continued;
+    int eof;
+    int closing;
+    char *in;
+    size_t in_len, in_cap;
+    // head plus body of the request being read, 0 while the head is partial
+    size_t need;
+    uring_reply reply;
+    size_t head_off, body_off;
+};
+
+struct uring_backend {
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    struct event *ev;
+    uring_listener *listeners;
+    size_t listeners_len;
+    uring_conn *conns;
+    uring_handler handler;
+    void *arg;
+    uring_stats stats;
+    // no more accepts, connections close once their replies are out
+    int draining;
+    // parsed copy of the current head
+    char scratch[URING_HEAD_MAX + 1];
+};
+
+static const struct {
+    int status;
+    const char *phrase;
+} uring_phrases[] = {
+    {100, "Continue"},
+    {101, "Switching Protocols"},
+    {200, "OK"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {204, "No Content"},
+    {206, "Partial Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
+    {400, "Bad Request"},
+    {401, "Unauthorized"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {408, "Request Timeout"},
+    {409, "Conflict"},
+    {410, "Gone"},
+    {411, "Length Required"},
+    {412, "Precondition Failed"},
+    {413, "Request Entity Too Large"},
+    {415, "Unsupported Media Type"},
+    {429, "Too Many Requests"},
+    {431, "Request Header Fields Too Large"},
+    {500, "Internal Server Error"},
+    {501, "Not Implemented"},
+    {502, "Bad Gateway"},
+    {503, "Service Unavailable"},
+    {504, "Gateway Timeout"},
+};
+
+static const char *uring_phrase(int status) {
+    for (size_t i = 0; i < sizeof(uring_phrases) / sizeof(uring_phrases[0]);
+         ++i) {
+        if (uring_phrases[i].status == status)
+            return uring_phrases[i].phrase;
+    }
+    return status < 400 ? "OK" : "Error";
+}
+
+// evhttp leaves the length and type out when there can be no body
+static int uring_has_body(const uring_request *req, int status) {
+    return strcmp(req->method, "HEAD") && status >= 200 && status != 204 &&
+           status != 304;
+}
+
+char *uring_head(const uring_request *req, int status, const char *reason,
+                 const struct evkeyvalq *headers, size_t *body_len,
+                 int *close, size_t *len) {
+    static __thread time_t date_at;
+    static __thread char date[40];
+    struct evbuffer *buf;
+    const struct evkeyval *h;
+    const char *conn;
+    time_t now;
+    struct tm tm;
+    char *head;
+    int body;
+
+    buf = evbuffer_new();
+    if (!buf)
+        return NULL;
+    conn = headers ? evhttp_find_header(headers, "Connection") : NULL;
+    *close = !req->keep_alive ||
+             (conn && !evutil_ascii_strcasecmp(conn, "close"));
+    body = uring_has_body(req, status);
+    evbuffer_add_printf(buf, "HTTP/1.%d %d %s\r\n", req->minor, status,
+                        reason ? reason : uring_phrase(status));
+    for (h = headers ? headers->tqh_first : NULL; h; h = h->next.tqe_next) {
+        if (!evutil_ascii_strcasecmp(h->key, "Content-Length") ||
+            !evutil_ascii_strcasecmp(h->key, "Connection"))
+            continue;
+        evbuffer_add_printf(buf, "%s: %s\r\n", h->key, h->value);
+    }
+    if (req->minor >= 1 && !(headers && evhttp_find_header(headers, "Date"))) {
+        now = time(NULL);
+        if (now != date_at) {
+            gmtime_r(&now, &tm);
+            strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            date_at = now;
+        }
+        evbuffer_add_printf(buf, "Date: %s\r\n", date);
+    }
+    if (body) {
+        if (!(headers && evhttp_find_header(headers, "Content-Type")))
+            evbuffer_add_printf(
+                buf, "Content-Type: text/html; charset=ISO-8859-1\r\n");
+        evbuffer_add_printf(buf, "Content-Length: %zu\r\n", *body_len);
+    } else {
+        *body_len = 0;
+    }
+    if (*close)
+        evbuffer_add_printf(buf, "Connection: close\r\n");
+    else if (req->minor == 0)
+        evbuffer_add_printf(buf, "Connection: keep-alive\r\n");
+    evbuffer_add(buf, "\r\n", 2);
+
+    *len = evbuffer_get_length(buf);
+    head = malloc(*len);
+    if (head)
+        evbuffer_remove(buf, head, *len);
+    evbuffer_free(buf);
+    return head;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_backend *u) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    if (!sqe) {
+        io_uring_submit(&u->ring);
+        u->stats.submits++;
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+    return sqe;
+}
+
+static void uring_submit(uring_backend *u) {
+    if (io_uring_sq_ready(&u->ring)) {
+        io_uring_submit(&u->ring);
+        u->stats.submits++;
+    }
+}
+
+static int arm_accept(uring_listener *l) {
+    struct io_uring_sqe *sqe = uring_sqe(l->u);
+    if (!sqe)
+        return -1;
+    io_uring_prep_multishot_accept(sqe, l->fd, NULL, NULL, SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)l | OP_ACCEPT);
+    return 0;
+}
+
+static int arm_recv(uring_conn *c) {
+    struct io_uring_sqe *sqe = uring_sqe(c->u);
+    if (!sqe)
+        return -1;
+    io_uring_prep_recv_multishot(sqe, c->fd, NULL, 0, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | OP_RECV);
+    c->recv_armed = 1;
+    return 0;
+}
+
+static void reply_release(uring_conn *c) {
+    free(c->reply.head);
+    if (c->reply.done)
+        c->reply.done(c->reply.opaque);
+    memset(&c->reply, 0, sizeof(c->reply));
+    c->head_off = c->body_off = 0;
+    c->send_error = 0;
+    c->replying = 0;
+}
+
+static void conn_maybe_free(uring_conn *c) {
+    uring_backend *u = c->u;
+    if (!c->closing || c->recv_armed || c->sends || c->notifs)
+        return;
+    if (c->replying)
+        reply_release(c);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        u->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    u->stats.conns--;
+    close(c->fd);
+    free(c->in);
+    free(c);
+}
+
+// the pending multishot recv ends once the socket is shut down, the conn
+// is freed by the completion handler that drops the last reference
+static void conn_close(uring_conn *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+// queues whatever is left of the reply, head and body linked in order
+static void conn_send(uring_conn *c) {
+    uring_backend *u = c->u;
+    struct io_uring_sqe *sqe;
+    size_t head = c->reply.head_len - c->head_off;
+    size_t body = c->reply.body_len - c->body_off;
+
+    if (io_uring_sq_space_left(&u->ring) < 2)
+        uring_submit(u);
+    if (head) {
+        sqe = uring_sqe(u);
+        // a short head fails the link and the body comes back cancelled
+        io_uring_prep_send(sqe, c->fd, c->reply.head + c->head_off, head,
+                           MSG_NOSIGNAL | (body ? MSG_WAITALL | MSG_MORE : 0));
+        io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | OP_SEND_HEAD);
+        if (body)
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        c->sends++;
+        u->stats.sends++;
+    }
+    if (body) {
+        sqe = uring_sqe(u);
+        if (body >= URING_ZC_MIN) {
+            io_uring_prep_send_zc(sqe, c->fd, c->reply.body + c->body_off,
+                                  body, MSG_NOSIGNAL | MSG_WAITALL, 0);
+            u->stats.zc_sends++;
+        } else {
+            io_uring_prep_send(sqe, c->fd, c->reply.body + c->body_off, body,
+                               MSG_NOSIGNAL | MSG_WAITALL);
+        }
+        io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | OP_SEND_BODY);
+        c->sends++;
+        u->stats.sends++;
+    }
+}
+
+static void conn_reply_error(uring_conn *c, uring_request *req, int status) {
+    char body[256], *p;
+    size_t len;
+    int close;
+
+    len = snprintf(body, sizeof(body),
+                   "<HTML><HEAD>\n<TITLE>%d %s</TITLE>\n</HEAD><BODY>\n"
+                   "<H1>%s</H1>\n</BODY></HTML>\n",
+                   status, uring_phrase(status), uring_phrase(status));
+    req->keep_alive = 0;
+    c->reply.head = uring_head(req, status, NULL, NULL, &len, &close,
+                               &c->reply.head_len);
+    if (!c->reply.head) {
+        conn_close(c);
+        return;
+    }
+    // the page goes out with the head, nothing else references it
+    p = realloc(c->reply.head, c->reply.head_len + len);
+    if (!p) {
+        free(c->reply.head);
+        c->reply.head = NULL;
+        conn_close(c);
+        return;
+    }
+    c->reply.head = p;
+    memcpy(c->reply.head + c->reply.head_len, body, len);
+    c->reply.head_len += len;
+    c->reply.close = 1;
+    c->replying = 1;
+    conn_send(c);
+}
+
+static char *trim(char *s, char *end) {
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        *--end = '\0';
+    *end = '\0';
+    return s;
+}
+
+static const char *uring_methods[] = {
+    "GET", "POST", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE", "CONNECT",
+    "PATCH",
+};
+
+// end of the head, past the empty line, or 0 when it is not complete
+static size_t head_end(const char *p, size_t len) {
+    for (size_t i = 0; i + 1 < len; ++i) {
+        if (p[i] != '\n')
+            continue;
+        if (p[i + 1] == '\n')
+            return i + 2;
+        if (p[i + 1] == '\r' && i + 2 < len && p[i + 2] == '\n')
+            return i + 3;
+    }
+    return 0;
+}
+
+// parses at most one request from the input, 1 when one was handed out
+static int conn_request(uring_conn *c) {
+    uring_backend *u = c->u;
+    uring_request req = {0};
+    size_t skip = 0, end, len;
+    char *line, *next, *p, *colon;
+    const char *v;
+    long long cl = 0;
+    int status = 0, known = 0;
+
+    // stray line breaks between requests are allowed
+    while (skip < c->in_len && (c->in[skip] == '\r' || c->in[skip] == '\n'))
+        skip++;
+    if (skip) {
+        memmove(c->in, c->in + skip, c->in_len - skip);
+        c->in_len -= skip;
+        c->need = 0;
+    }
+    if (!c->in_len || (c->need && c->in_len < c->need))
+        return 0;
+
+    req.headers.tqh_first = NULL;
+    req.headers.tqh_last = &req.headers.tqh_first;
+    req.method = "GET";
+    req.uri = "/";
+    req.minor = 1;
+    end = head_end(c->in,
+                   c->in_len < URING_HEAD_MAX ? c->in_len : URING_HEAD_MAX);
+    if (!end) {
+        if (c->in_len < URING_HEAD_MAX)
+            return 0;
+        status = 431;
+        goto error;
+    }
+    memcpy(u->scratch, c->in, end);
+    u->scratch[end] = '\0';
+
+    line = u->scratch;
+    next = strchr(line, '\n');
+    *next++ = '\0';
+    p = strchr(line, ' ');
+    if (!p) {
+        status = 400;
+        goto error;
+    }
+    *p++ = '\0';
+    req.method = line;
+    line = p;
+    p = strchr(line, ' ');
+    if (!p || strncmp(p + 1, "HTTP/1.", 7) || (p[8] != '0' && p[8] != '1')) {
+        req.method = "GET";
+        status = 400;
+        goto error;
+    }
+    *p = '\0';
+    req.uri = line;
+    req.minor = p[8] - '0';
+    for (size_t i = 0; i < sizeof(uring_methods) / sizeof(uring_methods[0]);
+         ++i) {
+        if (!strcmp(req.method, uring_methods[i]))
+            known = 1;
+    }
+
+    for (line = next; *line && *line != '\r' && *line != '\n'; line = next) {
+        next = strchr(line, '\n');
+        *next++ = '\0';
+        colon = strchr(line, ':');
+        if (!colon || colon == line) {
+            status = 400;
+            goto error;
+        }
+        *colon = '\0';
+        evhttp_add_header(&req.headers, line, trim(colon + 1, next - 1));
+    }
+
+    if (!known) {
+        status = 501;
+        goto error;
+    }
+    if (evhttp_find_header(&req.headers, "Transfer-Encoding")) {
+        // chunked uploads are left to the libevent backend
+        status = 501;
+        goto error;
+    }
+    // one only, two could be read differently by a proxy in front
+    for (struct evkeyval *h = req.headers.tqh_first, *first = NULL; h;
+         h = h->next.tqe_next) {
+        if (evutil_ascii_strcasecmp(h->key, "Content-Length"))
+            continue;
+        if (first) {
+            status = 400;
+            goto error;
+        }
+        first = h;
+    }
+    if ((v = evhttp_find_header(&req.headers, "Content-Length"))) {
+        char *e;
+        cl = strtoll(v, &e, 10);
+        if (e == v || *e || cl < 0) {
+            status = 400;
+            goto error;
+        }
+        if (cl > URING_BODY_MAX) {
+            status = 413;
+            goto error;
+        }
+    }
+    v = evhttp_find_header(&req.headers, "Connection");
+    if (req.minor)
+        req.keep_alive = !(v && !evutil_ascii_strcasecmp(v, "close"));
+    else
+        req.keep_alive = v && !evutil_ascii_strcasecmp(v, "keep-alive");
+    if (u->draining)
+        req.keep_alive = 0;
+
+    c->need = end + cl;
+    if (c->in_len < c->need) {
+        v = evhttp_find_header(&req.headers, "Expect");
+        if (req.minor && v && !evutil_ascii_strcasecmp(v, "100-continue") &&
+            !c->continued) {
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            c->continued = 1;
+            if (send(c->fd, cont, sizeof(cont) - 1, MSG_NOSIGNAL) < 0) {
+                evhttp_clear_headers(&req.headers);
+                conn_close(c);
+                return 0;
+            }
+        }
+        evhttp_clear_headers(&req.headers);
+        return 0;
+    }
+
+    req.body = c->in + end;
+    req.body_len = (size_t)cl;
+    u->stats.requests++;
+    c->replying = 1;
+    u->handler(u->arg, &req, &c->reply);
+    evhttp_clear_headers(&req.headers);
+    if (!c->reply.head) {
+        reply_release(c);
+        status = 500;
+        goto error_sent;
+    }
+    len = c->need;
+    memmove(c->in, c->in + len, c->in_len - len);
+    c->in_len -= len;
+    c->need = 0;
+    c->continued = 0;
+    conn_send(c);
+    return 1;
+
+error:
+    evhttp_clear_headers(&req.headers);
+error_sent:
+    // the rest of the input is not trusted anymore
+    c->in_len = 0;
+    c->need = 0;
+    conn_reply_error(c, &req, status);
+    return 1;
+}
+
+static void conn_process(uring_conn *c) {
+    if (!c->replying && !c->closing)
+        conn_request(c);
+    if (!c->replying && c->eof)
+        conn_close(c);
+}
+
+static void reply_done(uring_conn *c) {
+    int close = c->reply.close;
+    reply_release(c);
+    // a pipelined request is still answered, with Connection: close
+    if (close || (c->u->draining && !c->in_len))
+        conn_close(c);
+    else
+        conn_process(c);
+}
+
+static void on_accept(uring_listener *l, struct io_uring_cqe *cqe) {
+    uring_backend *u = l->u;
+    uring_conn *c;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !u->draining) {
+        // out of fds or memory, try again a bit later instead of spinning
+        if (cqe->res < 0) {
+            struct timeval tv = {0, 100000};
+            event_add(l->retry_ev, &tv);
+        } else {
+            arm_accept(l);
+        }
+    }
+    if (cqe->res < 0)
+        return;
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(cqe->res);
+        return;
+    }
+    c->u = u;
+    c->fd = cqe->res;
+    c->next = u->conns;
+    if (u->conns)
+        u->conns->prev = c;
+    u->conns = c;
+    u->stats.accepted++;
+    u->stats.conns++;
+    if (arm_recv(c) < 0)
+        conn_close(c);
+    conn_maybe_free(c);
+}
+
+static void on_recv(uring_conn *c, struct io_uring_cqe *cqe) {
+    uring_backend *u = c->u;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (!more)
+        c->recv_armed = 0;
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = u->bufs + (size_t)bid * URING_BUF_SIZE;
+        size_t n = (size_t)cqe->res;
+        u->stats.recvs++;
+        if (!c->closing && c->in_len + n > URING_IN_MAX) {
+            n = 0;
+            conn_close(c);
+        }
+        if (!c->closing) {
+            if (c->in_len + n > c->in_cap) {
+                size_t cap = c->in_cap ? c->in_cap * 2 : URING_BUF_SIZE;
+                char *in;
+                while (cap < c->in_len + n)
+                    cap *= 2;
+                in = realloc(c->in, cap);
+                if (!in) {
+                    n = 0;
+                    conn_close(c);
+                } else {
+                    c->in = in;
+                    c->in_cap = cap;
+                }
+            }
+            if (n) {
+                memcpy(c->in + c->in_len, buf, n);
+                c->in_len += n;
+            }
+        }
+        io_uring_buf_ring_add(u->br, buf, URING_BUF_SIZE, bid,
+                              io_uring_buf_ring_mask(URING_BUFS), 0);
+        io_uring_buf_ring_advance(u->br, 1);
+        if (!c->closing)
+            conn_process(c);
+    } else if (cqe->res == -ENOBUFS) {
+        // the kernel used up the ring before this batch of completions gave
+        // the buffers back, the recv is re-armed
+        u->stats.no_buffers++;
+    } else if (cqe->res <= 0) {
+        c->eof = 1;
+        if (cqe->res < 0 || !c->replying)
+            conn_close(c);
+    }
+    if (!c->recv_armed && !c->closing && !c->eof && arm_recv(c) < 0)
+        conn_close(c);
+    conn_maybe_free(c);
+}
+
+static void on_send(uring_conn *c, int op, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        c->notifs--;
+    } else {
+        c->sends--;
+        if (cqe->flags & IORING_CQE_F_MORE)
+            c->notifs++;
+        if (cqe->res > 0) {
+            if (op == OP_SEND_HEAD)
+                c->head_off += cqe->res;
+            else
+                c->body_off += cqe->res;
+        } else if (cqe->res != -ECANCELED) {
+            c->send_error = 1;
+        }
+    }
+    if (c->sends) {
+    } else if (c->send_error || c->closing) {
+        conn_close(c);
+    } else if (c->head_off < c->reply.head_len ||
+               c->body_off < c->reply.body_len) {
+        // a short or cancelled send, the body may still be pinned by
+        // the previous zero-copy send but the bytes are not going to change
+        conn_send(c);
+    } else if (!c->notifs && c->replying) {
+        reply_done(c);
+    }
+    conn_maybe_free(c);
+}
+
+static void uring_cb(evutil_socket_t fd, short what, void *arg) {
+    uring_backend *u = arg;
+    struct io_uring_cqe *cqes[URING_CQE_BATCH];
+    unsigned n;
+
+    while ((n = io_uring_peek_batch_cqe(&u->ring, cqes, URING_CQE_BATCH))) {
+        for (unsigned i = 0; i < n; ++i) {
+            uint64_t data = io_uring_cqe_get_data64(cqes[i]);
+            void *p = (void *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+            int op = (int)(data & OP_MASK);
+            switch (op) {
+            case OP_ACCEPT:
+                // cancels from uring_drain complete with the backend
+                if (p != u)
+                    on_accept(p, cqes[i]);
+                break;
+            case OP_RECV:
+                on_recv(p, cqes[i]);
+                break;
+            default:
+                on_send(p, op, cqes[i]);
+                break;
+            }
+        }
+        io_uring_cq_advance(&u->ring, n);
+    }
+    uring_submit(u);
+}
+
+static void retry_accept_cb(evutil_socket_t fd, short what, void *arg) {
+    uring_listener *l = arg;
+    arm_accept(l);
+    uring_submit(l->u);
+}
+
+uring_backend *uring_start(struct event_base *base, const int *fds,
+                           size_t nfds, uring_handler handler, void *arg,
+                           char *err, size_t err_len) {
+    uring_backend *u;
+    struct io_uring_probe *probe;
+    int ret;
+
+    u = calloc(1, sizeof(*u));
+    if (!u) {
+        snprintf(err, err_len, "out of memory");
+        return NULL;
+    }
+    u->handler = handler;
+    u->arg = arg;
+    ret = io_uring_queue_init(URING_ENTRIES, &u->ring, 0);
+    if (ret < 0) {
+        snprintf(err, err_len, "io_uring_queue_init: %s", strerror(-ret));
+        free(u);
+        return NULL;
+    }
+    // multishot accept and recv came before zero-copy send, 6.0
+    probe = io_uring_get_probe_ring(&u->ring);
+    if (!probe || !io_uring_opcode_supported(probe, IORING_OP_SEND_ZC)) {
+        if (probe)
+            io_uring_free_probe(probe);
+        snprintf(err, err_len, "kernel lacks zero-copy send");
+        io_uring_queue_exit(&u->ring);
+        free(u);
+        return NULL;
+    }
+    io_uring_free_probe(probe);
+
+    u->br = io_uring_setup_buf_ring(&u->ring, URING_BUFS, URING_BGID, 0, &ret);
+    if (!u->br) {
+        snprintf(err, err_len, "io_uring_setup_buf_ring: %s", strerror(-ret));
+        io_uring_queue_exit(&u->ring);
+        free(u);
+        return NULL;
+    }
+    u->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    u->listeners = calloc(nfds ? nfds : 1, sizeof(*u->listeners));
+    u->ev = event_new(base, u->ring.ring_fd, EV_READ | EV_PERSIST, uring_cb, u);
+    if (!u->bufs || !u->listeners || !u->ev) {
+        snprintf(err, err_len, "out of memory");
+        goto fail;
+    }
+    for (unsigned i = 0; i < URING_BUFS; ++i) {
+        io_uring_buf_ring_add(u->br, u->bufs + (size_t)i * URING_BUF_SIZE,
+                              URING_BUF_SIZE, i,
+                              io_uring_buf_ring_mask(URING_BUFS), i);
+    }
+    io_uring_buf_ring_advance(u->br, URING_BUFS);
+
+    for (size_t i = 0; i < nfds; ++i) {
+        uring_listener *l = &u->listeners[i];
+        l->u = u;
+        l->fd = fds[i];
+        l->retry_ev = evtimer_new(base, retry_accept_cb, l);
+        if (!l->retry_ev) {
+            snprintf(err, err_len, "out of memory");
+            goto fail;
+        }
+        u->listeners_len++;
+        if (arm_accept(l) < 0) {
+            snprintf(err, err_len, "submission queue full");
+            goto fail;
+        }
+    }
+    uring_submit(u);
+    event_add(u->ev, NULL);
+    return u;
+fail:
+    uring_stop(u);
+    return NULL;
+}
+
+void uring_stop(uring_backend *u) {
+    uring_conn *c, *next;
+    if (!u)
+        return;
+    if (u->ev)
+        event_free(u->ev);
+    for (size_t i = 0; i < u->listeners_len; ++i) {
+        event_free(u->listeners[i].retry_ev);
+    }
+    // the ring goes first so nothing in flight still points at a conn
+    io_uring_free_buf_ring(&u->ring, u->br, URING_BUFS, URING_BGID);
+    io_uring_queue_exit(&u->ring);
+    for (c = u->conns; c; c = next) {
+        next = c->next;
+        if (c->replying)
+            reply_release(c);
+        close(c->fd);
+        free(c->in);
+        free(c);
+    }
+    free(u->listeners);
+    free(u->bufs);
+    free(u);
+}
+
+void uring_drain(uring_backend *u) {
+    struct io_uring_sqe *sqe;
+    uring_conn *c, *next;
+
+    if (u->draining)
+        return;
+    u->draining = 1;
+    for (size_t i = 0; i < u->listeners_len; ++i) {
+        uring_listener *l = &u->listeners[i];
+        event_del(l->retry_ev);
+        // the ring holds the listening socket until the accept is gone
+        if (!(sqe = uring_sqe(u)))
+            continue;
+        io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)l | OP_ACCEPT, 0);
+        io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)u | OP_ACCEPT);
+    }
+    for (c = u->conns; c; c = next) {
+        next = c->next;
+        if (!c->replying && !c->in_len) {
+            conn_close(c);
+            conn_maybe_free(c);
+        }
+    }
+    uring_submit(u);
+}
+
+void uring_get_stats(uring_backend *u, uring_stats *stats) {
+    *stats = u->stats;
+}
@@ -0,0 +1,72 @@
+#ifndef LANYT_URING_H
+#define LANYT_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/keyvalq_struct.h>
+
+struct event_base;
+
+// one parsed request, the strings live until the handler returns
+typedef struct {
+    const char *method;
+    const char *uri;
+    int minor;
+    int keep_alive;
+    struct evkeyvalq headers;
+    const char *body;
+    size_t body_len;
+} uring_request;
+
+// head and body go out as two linked sends, large bodies without copying
+typedef struct {
+    // malloc'd, freed by the backend
+    char *head;
+    size_t head_len;
+    const char *body;
+    size_t body_len;
+    // called once the body is no longer referenced
+    void (*done)(void *opaque);
+    void *opaque;
+    // close the connection after this reply
+    int close;
+} uring_reply;
+
+typedef void (*uring_handler)(void *arg, uring_request *req,
+                              uring_reply *reply);
+
+typedef struct {
+    uint64_t accepted;
+    uint64_t requests;
+    // io_uring_enter calls
+    uint64_t submits;
+    uint64_t recvs;
+    uint64_t sends;
+    uint64_t zc_sends;
+    uint64_t no_buffers;
+    uint64_t conns;
+} uring_stats;
+
+typedef struct uring_backend uring_backend;
+
+// status line and headers the way evhttp writes them, with Date, the default
+// Content-Type, Content-Length and Connection. body_len is zeroed when the
+// reply must not have a body, close tells whether the connection ends after
+char *uring_head(const uring_request *req, int status, const char *reason,
+                 const struct evkeyvalq *headers, size_t *body_len,
+                 int *close, size_t *len);
+
+// serves the listening fds from an io_uring driven by base. NULL with a
+// message in err when io_uring, provided buffers or zero-copy send are
+// missing, the caller keeps using libevent then
+uring_backend *uring_start(struct event_base *base, const int *fds,
+                           size_t nfds, uring_handler handler, void *arg,
+                           char *err, size_t err_len);
+void uring_stop(uring_backend *u);
+// stops accepting, closes idle connections and the others once their reply
+// is out. stats.conns reaches 0 when it is done
+void uring_drain(uring_backend *u);
+void uring_get_stats(uring_backend *u, uring_stats *stats);
+
+#endif // LANYT_URING_H
@@ -2,6 +2,14 @@
 #include "util.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#endif
 
 // 判断字符是否需要编码
 static int is_char_needs_encoding(unsigned char c) {
@@ -60,3 +68,247 @@ void urldecode(const char *src, char *dst, size_t dst_max_len) {
     }
     *dst = '\0';
 }
+
+// 单调时钟, 微秒
+int64_t util_now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t)(now.QuadPart / (double)freq.QuadPart * 1000000.0);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// 当前线程消耗的CPU时间, 微秒
+int64_t util_cputime_us(void) {
+#ifdef _WIN32
+    FILETIME create, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user);
+    return (int64_t)((((uint64_t)kernel.dwHighDateTime << 32 |
+                       kernel.dwLowDateTime) +
+                      ((uint64_t)user.dwHighDateTime << 32 |
+                       user.dwLowDateTime)) /
+                     10);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+// 阻塞当前线程, 微秒
+void util_sleep_us(int64_t us) {
+#ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+// 值所在的桶
+static int hist_index(uint64_t v) {
+    int shift = 0;
+    while ((v >> shift) >= 2 * UTIL_HIST_SUB)
+        shift++;
+    int i = shift ? (shift + 1) * UTIL_HIST_SUB + (int)(v >> shift) -
+                        UTIL_HIST_SUB
+                  : (int)v;
+    return i < UTIL_HIST_BUCKETS ? i : UTIL_HIST_BUCKETS - 1;
+}
+
+// 桶的上界
+static uint64_t hist_upper(int i) {
+    if (i < 2 * UTIL_HIST_SUB)
+        return (uint64_t)i;
+    int shift = i / UTIL_HIST_SUB - 1;
+    uint64_t base = (uint64_t)(i % UTIL_HIST_SUB + UTIL_HIST_SUB) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+void util_hist_add(util_hist *h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+// 分位数, q 在 0..1 之间, 返回桶上界
+uint64_t util_hist_quantile(const util_hist *h, double q) {
+    uint64_t rank, seen = 0;
+    if (!h->count)
+        return 0;
+    rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (int i = 0; i < UTIL_HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t up = hist_upper(i);
+            return up < h->max ? up : h->max;
+        }
+    }
+    return h->max;
+}
+
+void util_hist_merge(util_hist *dst, const util_hist *src) {
+    for (int i = 0; i < UTIL_HIST_BUCKETS; ++i)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// 小端读取
+static uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t xxh_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+void util_xxh64_init(util_xxh64_state *s, uint64_t seed) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = seed + XXH_P1 + XXH_P2;
+    s->v[1] = seed + XXH_P2;
+    s->v[2] = seed;
+    s->v[3] = seed - XXH_P1;
+}
+
+void util_xxh64_update(util_xxh64_state *s, const void *data, size_t len) {
+    const uint8_t *p = data, *end = p + len;
+
+    s->total += len;
+    if (s->mem_len + len < 32) {
+        memcpy(s->mem + s->mem_len, p, len);
+        s->mem_len += (uint32_t)len;
+        return;
+    }
+    if (s->mem_len) {
+        memcpy(s->mem + s->mem_len, p, 32 - s->mem_len);
+        p += 32 - s->mem_len;
+        for (int i = 0; i < 4; ++i)
+            s->v[i] = xxh_round(s->v[i], xxh_read64(s->mem + i * 8));
+        s->mem_len = 0;
+    }
+    for (; p + 32 <= end; p += 32) {
+        for (int i = 0; i < 4; ++i)
+            s->v[i] = xxh_round(s->v[i], xxh_read64(p + i * 8));
+    }
+    if (p < end) {
+        memcpy(s->mem, p, end - p);
+        s->mem_len = (uint32_t)(end - p);
+    }
+}
+
+uint64_t util_xxh64_digest(const util_xxh64_state *s) {
+    const uint8_t *p = s->mem, *end = p + s->mem_len;
+    uint64_t h;
+
+    if (s->total >= 32) {
+        h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) +
+            xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxh_merge(h, s->v[i]);
+    } else {
+        // v[2] 保存的是种子
+        h = s->v[2] + XXH_P5;
+    }
+    h += s->total;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t util_xxh64(const void *data, size_t len, uint64_t seed) {
+    util_xxh64_state s;
+    util_xxh64_init(&s, seed);
+    util_xxh64_update(&s, data, len);
+    return util_xxh64_digest(&s);
+}
+
+void *util_shared_swap(util_shared *s, void *p) {
+    void *old;
+    pthread_mutex_lock(&s->lock);
+    old = s->current;
+    __atomic_store_n(&s->current, p, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->lock);
+    if (old) {
+        while (__atomic_load_n(&s->users, __ATOMIC_SEQ_CST))
+            util_sleep_us(100);
+    }
+    return old;
+}
+
+int util_shared_enabled(util_shared *s) {
+    return __atomic_load_n(&s->current, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void *util_shared_enter(util_shared *s) {
+    __atomic_add_fetch(&s->users, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&s->current, __ATOMIC_SEQ_CST);
+}
+
+void util_shared_leave(util_shared *s) {
+    __atomic_sub_fetch(&s->users, 1, __ATOMIC_SEQ_CST);
+}
+
+void *util_shared_lock(util_shared *s) {
+    pthread_mutex_lock(&s->lock);
+    return s->current;
+}
+
+void util_shared_unlock(util_shared *s) { pthread_mutex_unlock(&s->lock); }
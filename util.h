@@ -2,10 +2,65 @@
 #ifndef LANYT_UTIL_H
 #define LANYT_UTIL_H
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
 size_t calculate_encoded_size(const char *src);
 void urlencode(const char *src, char *dst, size_t dst_max_len);
 void urldecode(const char *src, char *dst, size_t dst_max_len);
 
+int64_t util_now_us(void);
+int64_t util_cputime_us(void);
+void util_sleep_us(int64_t us);
+
+// log-linear histogram, 8 sub-buckets per power of two, not thread safe
+#define UTIL_HIST_SUB 8
+#define UTIL_HIST_BUCKETS (UTIL_HIST_SUB * 40)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[UTIL_HIST_BUCKETS];
+} util_hist;
+
+void util_hist_add(util_hist *h, uint64_t v);
+uint64_t util_hist_quantile(const util_hist *h, double q);
+void util_hist_merge(util_hist *dst, const util_hist *src);
+
+// streaming xxHash64, for etags and other non-cryptographic fingerprints
+typedef struct {
+    uint64_t total;
+    uint64_t v[4];
+    uint8_t mem[32];
+    uint32_t mem_len;
+} util_xxh64_state;
+
+void util_xxh64_init(util_xxh64_state *s, uint64_t seed);
+void util_xxh64_update(util_xxh64_state *s, const void *data, size_t len);
+uint64_t util_xxh64_digest(const util_xxh64_state *s);
+uint64_t util_xxh64(const void *data, size_t len, uint64_t seed);
+
+// a process wide object, like the access log, that request threads use while
+// it can be replaced from any thread
+typedef struct {
+    pthread_mutex_t lock;
+    void *current;
+    // threads between enter and leave
+    int users;
+} util_shared;
+
+#define UTIL_SHARED_INIT {PTHREAD_MUTEX_INITIALIZER, NULL, 0}
+
+// publishes p and returns the previous object once no thread uses it
+void *util_shared_swap(util_shared *s, void *p);
+int util_shared_enabled(util_shared *s);
+// the current object, NULL when there is none. always pair with leave
+void *util_shared_enter(util_shared *s);
+void util_shared_leave(util_shared *s);
+// the current object with the lock held, for reading its stats
+void *util_shared_lock(util_shared *s);
+void util_shared_unlock(util_shared *s);
+
 #endif // LANYT_UTIL_H
\ No newline at end of file